@@ -92,66 +92,39 @@ task(G, P1, P2, P3, P4, P5, P6, P7) :- '$task'(G, P1, P2, P3, P4, P5, P6, P7).
 %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
 %
 
-merge([], R, R) :- !.
-merge(R, [], R) :- !.
-merge([H1|T1], [H2|T2], Result) :-
-	compare(Delta, H1, H2), !,
-	merge(Delta, H1, H2, T1, T2, Result).
-
-merge(>, H1, H2, T1, T2, [H2|R]) :-
-	merge([H1|T1], T2, R).
-merge(=, H1, _, T1, T2, [H1|R]) :-
-	merge(T1, T2, R).
-merge(<, H1, H2, T1, T2, [H1|R]) :-
-	merge(T1, [H2|T2], R).
+predsort(P, L, Sorted) :-
+	length(L, N),
+	predsort(P, N, L, _, Sorted1), !,
+	Sorted = Sorted1.
 
-%
-%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
-
-%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
-%
-
-sort(L, R) :-
-	'$mustbe_instantiated'(L, R),
-	'$mustbe_list'(L),
-	'$mustbe_list_or_var'(R),
-	length(L,N),
-	sort(N, L, _, R).
-
-sort(2, [X1, X2|L], L, R) :- !,
-	compare(Delta, X1, X2),
+predsort(P, 2, [X1,X2|L], L, R) :- !,
+	call(P, Delta, X1, X2),
 	'$sort2'(Delta, X1, X2, R).
-sort(1, [X|L], L, [X]) :- !.
-sort(0, L, L, []) :- !.
-sort(N, L1, L3, R) :-
+predsort(_, 1, [X|L], L, [X]) :- !.
+predsort(_, 0, L, L, []) :- !.
+predsort(P, N, L1, L3, R) :-
 	N1 is N // 2,
 	plus(N1, N2, N),
-	sort(N1, L1, L2, R1),
-	sort(N2, L2, L3, R2),
-	merge(R1, R2, R).
+	predsort(P, N1, L1, L2, R1),
+	predsort(P, N2, L2, L3, R2),
+	predmerge(P, R1, R2, R).
 
-'$sort2'(<, X1, X2, [X1, X2]).
+'$sort2'(<, X1, X2, [X1,X2]).
 '$sort2'(=, X1, _,  [X1]).
-'$sort2'(>, X1, X2, [X2, X1]).
+'$sort2'(>, X1, X2, [X2,X1]).
 
-%
-%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
+predmerge(_, [], R, R) :- !.
+predmerge(_, R, [], R) :- !.
+predmerge(P, [H1|T1], [H2|T2], Result) :-
+	call(P, Delta, H1, H2), !,
+	predmerge_(Delta, P, H1, H2, T1, T2, Result).
 
-%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
-%
-
-mmerge([], R, R) :- !.
-mmerge(R, [], R) :- !.
-mmerge([H1|T1], [H2|T2], Result) :-
-	compare(Delta, H1, H2), !,
-	mmerge(Delta, H1, H2, T1, T2, Result).
-
-mmerge(>, H1, H2, T1, T2, [H2|R]) :-
-	mmerge([H1|T1], T2, R).
-mmerge(=, H1, H2, T1, T2, [H1|R]) :-
-	mmerge(T1, [H2|T2], R).
-mmerge(<, H1, H2, T1, T2, [H1|R]) :-
-	mmerge(T1, [H2|T2], R).
+predmerge_(<, P, H1, H2, T1, T2, [H1|R]) :-
+	predmerge(P, T1, [H2|T2], R).
+predmerge_(=, P, H1, _, T1, T2, [H1|R]) :-
+	predmerge(P, T1, T2, R).
+predmerge_(>, P, H1, H2, T1, T2, [H2|R]) :-
+	predmerge(P, [H1|T1], T2, R).
 
 %
 %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
@@ -159,95 +132,38 @@ mmerge(<, H1, H2, T1, T2, [H1|R]) :-
 %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
 %
 
-msort(L, R) :-
-	'$mustbe_instantiated'(L, R),
-	'$mustbe_list'(L),
-	'$mustbe_list_or_var'(R),
-	length(L,N),
-	msort(N, L, _, R).
-
-msort(2, [X1, X2|L], L, R) :- !,
-	compare(Delta, X1, X2),
-	'$msort2'(Delta, X1, X2, R).
-msort(1, [X|L], L, [X]) :- !.
-msort(0, L, L, []) :- !.
-msort(N, L1, L3, R) :-
-	N1 is N // 2,
-	plus(N1, N2, N),
-	msort(N1, L1, L2, R1),
-	msort(N2, L2, L3, R2),
-	mmerge(R1, R2, R).
-
-'$msort2'(<, X1, X2, [X1, X2]).
-'$msort2'(=, X1, X2, [X1, X2]).
-'$msort2'(>, X1, X2, [X2, X1]).
-
-%
-%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
-
-%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
-%
-
-keymerge([], R, R) :- !.
-keymerge(R, [], R) :- !.
-keymerge([H1|T1], [H2|T2], Result) :-
-	keycompare(Delta, H1, H2), !,
-	keymerge(Delta, H1, H2, T1, T2, Result).
-
-keymerge(>, H1, H2, T1, T2, [H2|R]) :-
-	keymerge([H1|T1], T2, R).
-keymerge(=, H1, H2, T1, T2, [H1|R]) :-
-	keymerge(T1, [H2|T2], R).
-keymerge(<, H1, H2, T1, T2, [H1|R]) :-
-	keymerge(T1, [H2|T2], R).
-
-%
-%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
-
-%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
-%
-
-keycompare(Delta, (K1-_), (K2-_)) :-
-	(K1 @< K2 -> Delta = '<' ;
-	(K1 @> K2 -> Delta = '>' ;
-	Delta = '=')).
-
-keysort(L, R) :-
-	'$mustbe_instantiated'(L, R),
-	'$mustbe_pairlist'(L),
-	'$mustbe_pairlist_or_var'(R),
-	length(L,N),
-	keysort(N, L, _, R).
-
-keysort(2, [X1, X2|L], L, R) :- !,
-	keycompare(Delta, X1, X2),
-	'$msort2'(Delta, X1, X2, R).
-keysort(1, [X|L], L, [X]) :- !.
-keysort(0, L, L, []) :- !.
-keysort(N, L1, L3, R) :-
-	N1 is N // 2,
-	plus(N1, N2, N),
-	keysort(N1, L1, L2, R1),
-	keysort(N2, L2, L3, R2),
-	keymerge(R1, R2, R).
-
-%
-%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
-
-%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
-%
+% A regular file is mapped and the grammar runs directly over the
+% mapping. Anything else (a pipe, a device) is read lazily a chunk at
+% a time as the grammar consumes it. library(freeze) is only loaded
+% when first needed.
 
 phrase_from_file(P, Filename) :-
-	open(Filename, read, Str, [mmap(Ms)]),
-	copy_term(P, P2), P2=P,
-	phrase(P2, Ms, []),
-	close(Str).
+	phrase_from_file(P, Filename, []).
 
 phrase_from_file(P, Filename, Opts) :-
-	open(Filename, read, Str, [mmap(Ms)|Opts]),
-	copy_term(P, P2), P2=P,
-	phrase(P2, Ms, []),
-	close(Str).
+	catch(exists_file(Filename), _, fail), !,
+	setup_call_cleanup(
+		open(Filename, read, Str, [mmap(Ms)|Opts]),
+		phrase(P, Ms, []),
+		close(Str)).
+phrase_from_file(P, Filename, Opts) :-
+	use_module(library(freeze)),
+	setup_call_cleanup(
+		open(Filename, read, Str, Opts),
+		( stream_property(Str, position(Pos)),
+		  '$lazy_start'(Str),
+		  '$lazy_list'(Str, Pos, Ls),
+		  phrase(P, Ls, [])
+		),
+		close(Str)).
+
+'$lazy_list'(Str, Pos, Ls) :-
+	freeze(Ls, '$lazy_chunk'(Str, Pos, Ls)).
+
+'$lazy_chunk'(Str, Pos, Ls) :-
+	'$get_chars'(Str, Pos, 4096, Ls0, Tail, Pos1),
+	( Ls0 == [] -> true ; '$lazy_list'(Str, Pos1, Tail) ),
+	Ls = Ls0.
 
 phrase(GRBody, S0) :-
 	phrase(GRBody, S0, []).
@@ -282,7 +198,8 @@ phrase_((A -> B), S0, S) :-
 phrase_(phrase(NonTerminal), S0, S) :-
 	phrase(NonTerminal, S0, S).
 phrase_([T|Ts], S0, S) :-
-	append([T|Ts], S, S0).
+	append([T|Ts], S, S1),
+	S0 = S1.
 
 %
 %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
@@ -343,72 +260,250 @@ load_files(Files) :- load_files(Files,[]).
 consult(Files) :- load_files(Files,[]).
 
 %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
-% Global variables. using the namespace 'user' to make sure they
-% are truly global and not just in the current module. This a quick
-% hack using assert/retract...
+% Global variables. The values live in a per-thread table in C, see
+% src/globals.c, these are just the enumerating wrappers...
 
-nb_setval(K, _) :-
-	'$mustbe_atom'(K),
-	user:retract('$global_key'(K, _)),
-	fail.
-nb_setval(K, V) :-
-	'$mustbe_atom'(K),
-	user:assertz('$global_key'(K, V)).
+nb_current(K, V) :-
+	atom(K), !,
+	'$nb_current'(K, V).
+nb_current(K, V) :-
+	'$global_vars'(Ks),
+	'$nb_member'(K, Ks),
+	'$nb_current'(K, V).
 
-nb_getval(K, V) :-
-	'$mustbe_atom'(K),
-	user:catch('$global_key'(K, V), _, throw(error(existence_error(variable, K), nb_setval/2))).
+'$nb_member'(X, [X|_]).
+'$nb_member'(X, [_|Xs]) :- '$nb_member'(X, Xs).
 
-nb_delete(K) :-
-	'$mustbe_atom'(K),
-	user:retract('$global_key'(K, _)),
-	!.
-nb_delete(_).
+b_setval0(K, V) :-
+	(nb_current(K, _) -> true ; nb_setval(K, 0)),
+	b_setval(K, V).
 
-nb_current(K, V) :-
-	user:clause('$global_key'(K, V), _).
+b_delete(K) :-
+	nb_delete(K).
 
 %
 %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
 
 %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
-% Global variables. using the namespace 'user' to make sure they
-% are truly global and not just in the current module. This a quick
-% hack using assert/retract...
-% The following is not really correct.
-
-b_setval(K, _) :-
-	'$mustbe_atom'(K),
-	\+ user:clause('$global_key'(K, _), _), asserta('$global_key'(K, [])),
-	fail.
-b_setval(K, V) :-
-	'$mustbe_atom'(K),
-	user:asserta('$global_key'(K, V)).
-b_setval(K, _) :-
-	user:retract('$global_key'(K, _)),
-	!.
+% Alarms. These are kept per query in a heap in C, see src/alarms.c,
+% and run from '$alarm_hook' once due. A goal that fails is ignored,
+% an exception is raised where the query happens to be.
+
+alarm(Time, Goal, '$alarm'(N, Gen)) :-
+	'$alarm'(Time, Goal, N, Gen).
+
+alarm(Time, Goal, Id, _) :-
+	alarm(Time, Goal, Id).
+
+remove_alarm('$alarm'(N, Gen)) :-
+	'$remove_alarm'(N, Gen).
 
-b_setval0(K, _) :-
-	'$mustbe_atom'(K),
-	\+ user:clause('$global_key'(K, _), _), asserta('$global_key'(K, 0)),
+'$alarm_hook' :-
+	'$next_alarm'(G), !,
+	(call(G) -> true ; true),
+	'$alarm_hook'.
+'$alarm_hook'.
+
+call_with_time_limit(Time, Goal) :-
+	Time > 0, !,
+	setup_call_cleanup(
+		alarm(Time, throw(time_limit_exceeded), Id),
+		once(Goal),
+		remove_alarm(Id)).
+call_with_time_limit(_, _) :-
+	throw(time_limit_exceeded).
+
+%
+%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
+
+%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
+% Threads. Each thread runs a copy of the goal in its own query,
+% uncaught exceptions are recorded as the thread's exit status.
+
+thread_create(G, Id) :-
+	thread_create(G, Id, []).
+
+thread_create(G, Id, Opts) :-
+	'$mustbe_callable'(G),
+	'$thread_create'('$thread_run'(G), Id, Opts).
+
+'$thread_run'(G) :-
+	catch(G, E, ('$thread_exception'(E), fail)), !.
+
+thread_join(Id) :-
+	thread_join(Id, Status),
+	(Status == true -> true ; throw(error(thread_error(Id, Status), thread_join/1))).
+
+message_queue_create(Q) :-
+	message_queue_create(Q, []).
+
+% Engines run '$engine_run'/2 in their own query, each solution of the
+% goal is yielded as an answer and then backtracked into for the next.
+
+engine_create(T, G, E) :-
+	engine_create(T, G, E, []).
+
+engine_create(T, G, E, Opts) :-
+	'$mustbe_callable'(G),
+	'$engine_create'('$engine_run'(T, G), E, Opts).
+
+'$engine_run'(T, G) :-
+	catch(G, E, ('$engine_exception'(E), fail)),
+	engine_yield(T),
 	fail.
-b_setval0(K, V) :-
-	'$mustbe_atom'(K),
-	asserta('$global_key'(K, V)).
-b_setval0(K, _) :-
-	user:retract('$global_key'(K, _)),
-	!.
 
-b_getval(K, V) :-
-	'$mustbe_atom'(K),
-	user:catch('$global_key'(K, V), _, throw(error(existence_error(variable, K), b_setval/2))),
-	!.
+engine_next(E, T) :-
+	'$engine_next'(E, R),
+	'$engine_reply'(R, T).
+
+'$engine_reply'(R, T) :-
+	(R = answer(T0) -> T = T0 ; R = exception(B), throw(B)).
+
+engine_next_reified(E, T) :-
+	catch((engine_next(E, A) -> T = the(A) ; T = no), B, T = throw(B)).
+
+engine_post(E, P, T) :-
+	'$engine_post'(E, P, R),
+	'$engine_reply'(R, T).
+
+% Goals are split into one contiguous chunk per worker, each chunk's
+% bindings come back as a single message and are applied in order.
+
+'$concurrent_run'([]) :- !.
+'$concurrent_run'(Goals) :-
+	length(Goals, N),
+	current_prolog_flag(cpu_count, Cpus),
+	W is max(1, min(Cpus, N)),
+	Size is (N + W - 1) // W,
+	'$cc_chunks'(Goals, Size, Chunks),
+	message_queue_create(Q),
+	'$cc_spawn'(Chunks, 1, Q, Ids),
+	'$cc_collect'(Ids, 1, Q, Results),
+	message_queue_destroy(Q),
+	'$cc_results'(Chunks, Results).
+
+'$cc_chunks'([], _, []) :- !.
+'$cc_chunks'(Goals, Size, [Chunk|Chunks]) :-
+	'$cc_take'(Size, Goals, Chunk, Rest),
+	'$cc_chunks'(Rest, Size, Chunks).
+
+'$cc_take'(0, L, [], L) :- !.
+'$cc_take'(_, [], [], []) :- !.
+'$cc_take'(N, [X|Xs], [X|Ys], Rest) :-
+	N2 is N - 1,
+	'$cc_take'(N2, Xs, Ys, Rest).
+
+'$cc_spawn'([], _, _, []).
+'$cc_spawn'([Chunk|Chunks], I, Q, [Id|Ids]) :-
+	thread_create('$cc_worker'(Q, I, Chunk), Id, []),
+	I2 is I + 1,
+	'$cc_spawn'(Chunks, I2, Q, Ids).
+
+'$cc_worker'(Q, I, Chunk) :-
+	catch(('$cc_all'(Chunk) -> R = true(Chunk) ; R = false), E, R = exception(E)),
+	thread_send_message(Q, I-R).
+
+'$cc_all'([]).
+'$cc_all'([G|Gs]) :- call(G), !, '$cc_all'(Gs).
+
+'$cc_collect'([], _, _, []).
+'$cc_collect'([Id|Ids], I, Q, [R|Rs]) :-
+	thread_get_message(Q, I-R),
+	thread_join(Id, _),
+	I2 is I + 1,
+	'$cc_collect'(Ids, I2, Q, Rs).
+
+'$cc_results'([], []).
+'$cc_results'([Chunk|Chunks], [R|Rs]) :-
+	'$cc_result'(R, Chunk),
+	'$cc_results'(Chunks, Rs).
+
+'$cc_result'(true(Chunk), Chunk).
+'$cc_result'(exception(E), _) :- throw(E).
+
+concurrent_maplist(G, L) :-
+	'$cc_goals1'(L, G, Gs),
+	'$concurrent_run'(Gs).
+
+concurrent_maplist(G, L1, L2) :-
+	'$cc_goals2'(L1, L2, G, Gs),
+	'$concurrent_run'(Gs).
+
+concurrent_maplist(G, L1, L2, L3) :-
+	'$cc_goals3'(L1, L2, L3, G, Gs),
+	'$concurrent_run'(Gs).
+
+'$cc_goals1'([], _, []).
+'$cc_goals1'([X|Xs], G, [call(G,X)|Gs]) :-
+	'$cc_goals1'(Xs, G, Gs).
+
+'$cc_goals2'([], [], _, []).
+'$cc_goals2'([X|Xs], [Y|Ys], G, [call(G,X,Y)|Gs]) :-
+	'$cc_goals2'(Xs, Ys, G, Gs).
+
+'$cc_goals3'([], [], [], _, []).
+'$cc_goals3'([X|Xs], [Y|Ys], [Z|Zs], G, [call(G,X,Y,Z)|Gs]) :-
+	'$cc_goals3'(Xs, Ys, Zs, G, Gs).
+
+% Each solution of Generator yields one job collecting the solutions
+% of Goal, the bags are concatenated in generator order.
+
+concurrent_findall(T, Gen, G, L) :-
+	findall(findall(T, G, L0)-L0, Gen, Pairs),
+	'$cc_split'(Pairs, Jobs, Ls),
+	'$concurrent_run'(Jobs),
+	'$cc_append'(Ls, L).
+
+'$cc_split'([], [], []).
+'$cc_split'([J-L|Ps], [J|Js], [L|Ls]) :-
+	'$cc_split'(Ps, Js, Ls).
+
+'$cc_append'([], []).
+'$cc_append'([L|Ls], L2) :-
+	'$cc_append'(Ls, L1),
+	'$cc_append'(L, L1, L2).
+
+'$cc_append'([], L, L).
+'$cc_append'([X|Xs], L, [X|Ys]) :-
+	'$cc_append'(Xs, L, Ys).
+
+% The first goal to succeed wins, the others are cancelled and joined.
+
+first_solution(X, Goals, _Opts) :-
+	message_queue_create(Q),
+	'$fs_spawn'(Goals, X, Q, Ids),
+	length(Ids, N),
+	'$fs_wait'(N, Q, R),
+	'$fs_cancel'(Ids),
+	message_queue_destroy(Q),
+	'$fs_result'(R, X).
+
+'$fs_spawn'([], _, _, []).
+'$fs_spawn'([G|Gs], X, Q, [Id|Ids]) :-
+	thread_create('$fs_worker'(Q, X, G), Id, []),
+	'$fs_spawn'(Gs, X, Q, Ids).
+
+'$fs_worker'(Q, X, G) :-
+	catch((call(G) -> R = true(X) ; R = false), E, R = exception(E)),
+	thread_send_message(Q, R).
+
+'$fs_wait'(0, _, false) :- !.
+'$fs_wait'(N, Q, R) :-
+	thread_get_message(Q, R0),
+	(	R0 == false
+	->	N2 is N - 1,
+		'$fs_wait'(N2, Q, R)
+	;	R = R0
+	).
 
-b_delete(K) :-
-	'$mustbe_atom'(K),
-	user:retractall('$global_key'(K, _)),
-	!.
-b_delete(_).
+'$fs_cancel'([]).
+'$fs_cancel'([Id|Ids]) :-
+	'$thread_cancel'(Id),
+	thread_join(Id, _),
+	'$fs_cancel'(Ids).
+
+'$fs_result'(true(X), X).
+'$fs_result'(exception(E), _) :- throw(E).
 
 %
 %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
@@ -0,0 +1,254 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "trealla.h"
+#include "internal.h"
+#include "parser.h"
+#include "module.h"
+#include "prolog.h"
+#include "builtins.h"
+#include "query.h"
+#include "heap.h"
+
+#define INITIAL_NBR_ALARMS 16
+
+static bool earlier(const alarm_heap *ah, unsigned i, unsigned j)
+{
+	return ah->slots[ah->heap[i]].due < ah->slots[ah->heap[j]].due;
+}
+
+static void swap_entries(alarm_heap *ah, unsigned i, unsigned j)
+{
+	unsigned tmp = ah->heap[i];
+	ah->heap[i] = ah->heap[j];
+	ah->heap[j] = tmp;
+	ah->slots[ah->heap[i]].pos = i;
+	ah->slots[ah->heap[j]].pos = j;
+}
+
+static void sift_up(alarm_heap *ah, unsigned i)
+{
+	while (i) {
+		unsigned parent = (i - 1) / 2;
+
+		if (!earlier(ah, i, parent))
+			break;
+
+		swap_entries(ah, i, parent);
+		i = parent;
+	}
+}
+
+static void sift_down(alarm_heap *ah, unsigned i)
+{
+	while (true) {
+		unsigned child = (i * 2) + 1;
+
+		if (child >= ah->cnt)
+			break;
+
+		if (((child + 1) < ah->cnt) && earlier(ah, child+1, child))
+			child++;
+
+		if (!earlier(ah, child, i))
+			break;
+
+		swap_entries(ah, i, child);
+		i = child;
+	}
+}
+
+// Free slots are chained through their pos field, biased by one so
+// that zero ends the list.
+
+static void free_slot(alarm_heap *ah, unsigned n)
+{
+	alarm_slot *a = ah->slots + n;
+	clear_term(a->goal);
+	free(a->goal);
+	a->goal = NULL;
+	a->gen++;
+	a->pos = ah->free_slot;
+	ah->free_slot = n + 1;
+}
+
+static void unlink_alarm(alarm_heap *ah, unsigned n)
+{
+	unsigned i = ah->slots[n].pos;
+
+	if (i != --ah->cnt) {
+		swap_entries(ah, i, ah->cnt);
+		sift_down(ah, i);
+		sift_up(ah, i);
+	}
+
+	free_slot(ah, n);
+}
+
+static bool add_alarm(alarm_heap *ah, term *goal, uint64_t due, unsigned *n)
+{
+	if (!ah->free_slot) {
+		unsigned size = ah->nbr_slots ? ah->nbr_slots * 2 : INITIAL_NBR_ALARMS;
+		alarm_slot *slots = realloc(ah->slots, sizeof(alarm_slot)*size);
+		if (!slots) return false;
+		ah->slots = slots;
+		unsigned *heap = realloc(ah->heap, sizeof(unsigned)*size);
+		if (!heap) return false;
+		ah->heap = heap;
+
+		for (unsigned i = size; i-- > ah->nbr_slots;) {
+			slots[i] = (alarm_slot){0};
+			slots[i].pos = ah->free_slot;
+			ah->free_slot = i + 1;
+		}
+
+		ah->nbr_slots = size;
+	}
+
+	*n = ah->free_slot - 1;
+	alarm_slot *a = ah->slots + *n;
+	ah->free_slot = a->pos;
+	a->goal = goal;
+	a->due = due;
+	a->pos = ah->cnt;
+	ah->heap[ah->cnt++] = *n;
+	sift_up(ah, a->pos);
+	return true;
+}
+
+bool next_alarm_due(const query *q, uint64_t *due)
+{
+	if (!q->alarms.cnt)
+		return false;
+
+	*due = q->alarms.slots[q->alarms.heap[0]].due;
+	return true;
+}
+
+void clear_alarms(alarm_heap *ah)
+{
+	for (unsigned i = 0; i < ah->cnt; i++) {
+		alarm_slot *a = ah->slots + ah->heap[i];
+		clear_term(a->goal);
+		free(a->goal);
+	}
+
+	free(ah->slots);
+	free(ah->heap);
+	memset(ah, 0, sizeof(alarm_heap));
+}
+
+// Run '$alarm_hook' (which runs whatever alarms are due) before going
+// on to the cell after the current one, or to ret if given.
+
+pl_status do_alarm_hook(query *q, cell *ret)
+{
+	cell *tmp = alloc_on_heap(q, 3);
+	may_ptr_error(tmp);
+	// Needed for follow() to work
+	*tmp = (cell){0};
+	tmp[0].val_type = TYPE_EMPTY;
+	tmp[0].nbr_cells = 1;
+	tmp[0].flags = FLAG_BUILTIN;
+
+	tmp[1].val_type = TYPE_LITERAL;
+	tmp[1].nbr_cells = 1;
+	tmp[1].arity = 0;
+	tmp[1].flags = 0;
+	tmp[1].val_off = g_alarm_hook_s;
+	tmp[1].match = find_predicate(q->st.m->pl->user_m, tmp+1);
+
+	const cell *c = q->st.curr_cell;
+	const frame *g = GET_CURR_FRAME();
+	make_end(tmp+2);
+	tmp[2].val_ptr = ret ? ret : (cell*)c + c->nbr_cells;
+	tmp[2].cgen = g->cgen;
+	tmp[2].mod_nbr = q->st.m->id;
+	q->st.curr_cell = tmp;
+	return pl_success;
+}
+
+static USE_RESULT pl_status fn_sys_alarm_4(query *q)
+{
+	GET_FIRST_ARG(p1,any);
+	GET_NEXT_ARG(p2,callable);
+	GET_NEXT_ARG(p3,variable);
+	GET_NEXT_ARG(p4,variable);
+	double secs;
+
+	if (is_integer(p1))
+		secs = p1->val_num;
+	else if (is_float(p1))
+		secs = p1->val_flt;
+	else
+		return throw_error(q, p1, "type_error", "number");
+
+	term *goal = detach_term(q, p2, p2_ctx);
+	may_ptr_error(goal);
+	uint64_t due = (get_time_in_usec() / 1000) + (secs > 0 ? (uint64_t)(secs * 1000) : 0);
+	unsigned n;
+
+	if (!add_alarm(&q->alarms, goal, due, &n)) {
+		clear_term(goal);
+		free(goal);
+		return pl_error;
+	}
+
+	cell tmp;
+	make_int(&tmp, n);
+	set_var(q, p3, p3_ctx, &tmp, q->st.curr_frame);
+	make_int(&tmp, q->alarms.slots[n].gen);
+	set_var(q, p4, p4_ctx, &tmp, q->st.curr_frame);
+	return pl_success;
+}
+
+// Removing an alarm that has already fired (its slot generation has
+// moved on) quietly succeeds.
+
+static USE_RESULT pl_status fn_sys_remove_alarm_2(query *q)
+{
+	GET_FIRST_ARG(p1,integer);
+	GET_NEXT_ARG(p2,integer);
+	alarm_heap *ah = &q->alarms;
+
+	if ((p1->val_num < 0) || ((uint_t)p1->val_num >= ah->nbr_slots))
+		return pl_success;
+
+	unsigned n = p1->val_num;
+
+	if (ah->slots[n].goal && (ah->slots[n].gen == (uint64_t)p2->val_num))
+		unlink_alarm(ah, n);
+
+	return pl_success;
+}
+
+// Take the earliest alarm if it's due.
+
+static USE_RESULT pl_status fn_sys_next_alarm_1(query *q)
+{
+	GET_FIRST_ARG(p1,variable);
+	alarm_heap *ah = &q->alarms;
+
+	if (!ah->cnt)
+		return pl_failure;
+
+	unsigned n = ah->heap[0];
+
+	if (ah->slots[n].due > (get_time_in_usec() / 1000))
+		return pl_failure;
+
+	cell *tmp = attach_term(q, ah->slots[n].goal);
+	may_ptr_error(tmp);
+	unlink_alarm(ah, n);
+	return unify(q, p1, p1_ctx, tmp, q->st.curr_frame);
+}
+
+const struct builtins g_alarm_funcs[] =
+{
+	{"$alarm", 4, fn_sys_alarm_4, "+number,+callable,-integer,-integer"},
+	{"$remove_alarm", 2, fn_sys_remove_alarm_2, "+integer,+integer"},
+	{"$next_alarm", 1, fn_sys_next_alarm_1, "-callable"},
+
+	{0}
+};
@@ -0,0 +1,292 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "trealla.h"
+#include "internal.h"
+#include "parser.h"
+#include "prolog.h"
+#include "builtins.h"
+#include "query.h"
+#include "heap.h"
+
+#define INITIAL_NBR_GLOBALS 16
+
+static idx_t hash_key(const global_vars *gv, idx_t off)
+{
+	uint64_t h = (uint64_t)off * 0x9E3779B97F4A7C15ULL;
+	return (h ^ (h >> 32)) & (gv->size - 1);
+}
+
+static global_var *find_global_var(const global_vars *gv, idx_t off)
+{
+	if (!gv->size)
+		return NULL;
+
+	for (idx_t i = hash_key(gv, off); gv->vars[i].val; i = (i + 1) & (gv->size - 1)) {
+		if (gv->vars[i].key.val_off == off)
+			return gv->vars + i;
+	}
+
+	return NULL;
+}
+
+static bool grow_global_vars(global_vars *gv)
+{
+	idx_t size = gv->size ? gv->size * 2 : INITIAL_NBR_GLOBALS;
+	global_var *vars = calloc(size, sizeof(global_var));
+	if (!vars) return false;
+	global_vars tmp = {.vars = vars, .size = size, .cnt = gv->cnt};
+
+	for (idx_t i = 0; i < gv->size; i++) {
+		const global_var *v = gv->vars + i;
+
+		if (!v->val)
+			continue;
+
+		idx_t j = hash_key(&tmp, v->key.val_off);
+
+		while (vars[j].val)
+			j = (j + 1) & (size - 1);
+
+		vars[j] = *v;
+	}
+
+	free(gv->vars);
+	*gv = tmp;
+	return true;
+}
+
+static void free_value(term *t)
+{
+	if (!t)
+		return;
+
+	clear_term(t);
+	free(t);
+}
+
+// Install a new value, handing back the old one (NULL if unset).
+
+static bool set_global_var(global_vars *gv, const cell *key, term *val, term **old)
+{
+	global_var *v = find_global_var(gv, key->val_off);
+	*old = NULL;
+
+	if (v) {
+		*old = v->val;
+		v->val = val;
+		return true;
+	}
+
+	if (((gv->cnt + 1) * 2) > gv->size) {
+		if (!grow_global_vars(gv))
+			return false;
+	}
+
+	idx_t i = hash_key(gv, key->val_off);
+
+	while (gv->vars[i].val)
+		i = (i + 1) & (gv->size - 1);
+
+	gv->vars[i].key = *key;
+	gv->vars[i].val = val;
+	gv->cnt++;
+	return true;
+}
+
+// Backward-shift deletion keeps probe chains intact without tombstones.
+
+static term *del_global_var(global_vars *gv, idx_t off)
+{
+	global_var *v = find_global_var(gv, off);
+
+	if (!v)
+		return NULL;
+
+	term *old = v->val;
+	idx_t mask = gv->size - 1, i = v - gv->vars;
+	gv->cnt--;
+
+	for (idx_t j = (i + 1) & mask; gv->vars[j].val; j = (j + 1) & mask) {
+		idx_t k = hash_key(gv, gv->vars[j].key.val_off);
+
+		if (((j > i) && ((k <= i) || (k > j)))
+			|| ((j < i) && (k <= i) && (k > j))) {
+			gv->vars[i] = gv->vars[j];
+			i = j;
+		}
+	}
+
+	gv->vars[i].val = NULL;
+	return old;
+}
+
+void clear_global_vars(global_vars *gv)
+{
+	for (idx_t i = 0; i < gv->size; i++)
+		free_value(gv->vars[i].val);
+
+	free(gv->vars);
+	memset(gv, 0, sizeof(global_vars));
+}
+
+void undo_global_var(global_undo *u)
+{
+	term *old;
+
+	if (u->val)
+		set_global_var(u->gv, &u->key, u->val, &old);
+	else
+		old = del_global_var(u->gv, u->key.val_off);
+
+	free_value(old);
+	free(u);
+}
+
+void drop_global_var(global_undo *u)
+{
+	free_value(u->val);
+	free(u);
+}
+
+static bool make_key(query *q, const cell *p1, cell *key)
+{
+	*key = (cell){0};
+	key->val_type = TYPE_LITERAL;
+	key->nbr_cells = 1;
+
+	if (is_cstring(p1)) {
+		key->val_off = index_from_pool(q->st.m->pl, GET_STR(p1));
+		return key->val_off != ERR_IDX;
+	}
+
+	key->val_off = p1->val_off;
+	return true;
+}
+
+static USE_RESULT pl_status do_setval(query *q, bool backtrackable)
+{
+	GET_FIRST_ARG(p1,atom);
+	GET_NEXT_ARG(p2,any);
+	cell key;
+	may_error(make_key(q, p1, &key));
+	term *val = detach_term(q, p2, p2_ctx);
+	may_ptr_error(val);
+	global_vars *gv = get_global_vars(q);
+	term *old;
+
+	if (!set_global_var(gv, &key, val, &old)) {
+		free_value(val);
+		return pl_error;
+	}
+
+	if (!backtrackable || !q->cp) {
+		free_value(old);
+		return pl_success;
+	}
+
+	global_undo *u = malloc(sizeof(global_undo));
+
+	if (!u) {
+		free_value(old);
+		return pl_error;
+	}
+
+	u->gv = gv;
+	u->val = old;
+	u->key = key;
+	return trail_global_var(q, u);
+}
+
+static USE_RESULT pl_status fn_nb_setval_2(query *q)
+{
+	return do_setval(q, false);
+}
+
+static USE_RESULT pl_status fn_b_setval_2(query *q)
+{
+	return do_setval(q, true);
+}
+
+static USE_RESULT pl_status do_getval(query *q, bool must_exist)
+{
+	GET_FIRST_ARG(p1,atom);
+	GET_NEXT_ARG(p2,any);
+	cell key;
+	may_error(make_key(q, p1, &key));
+	const global_var *v = find_global_var(get_global_vars(q), key.val_off);
+
+	if (!v) {
+		if (must_exist)
+			return throw_error(q, p1, "existence_error", "variable");
+
+		return pl_failure;
+	}
+
+	cell *tmp = attach_term(q, v->val);
+	may_ptr_error(tmp);
+	return unify(q, p2, p2_ctx, tmp, q->st.curr_frame);
+}
+
+static USE_RESULT pl_status fn_nb_getval_2(query *q)
+{
+	return do_getval(q, true);
+}
+
+static USE_RESULT pl_status fn_sys_nb_current_2(query *q)
+{
+	return do_getval(q, false);
+}
+
+static USE_RESULT pl_status fn_nb_delete_1(query *q)
+{
+	GET_FIRST_ARG(p1,atom);
+	cell key;
+	may_error(make_key(q, p1, &key));
+	free_value(del_global_var(get_global_vars(q), key.val_off));
+	return pl_success;
+}
+
+static USE_RESULT pl_status fn_sys_global_vars_1(query *q)
+{
+	GET_FIRST_ARG(p1,variable);
+	const global_vars *gv = get_global_vars(q);
+	bool first = true;
+
+	for (idx_t i = 0; i < gv->size; i++) {
+		if (!gv->vars[i].val)
+			continue;
+
+		if (first) {
+			allocate_list(q, &gv->vars[i].key);
+			first = false;
+		} else
+			append_list(q, &gv->vars[i].key);
+	}
+
+	if (first) {
+		cell tmp = (cell){0};
+		tmp.val_type = TYPE_LITERAL;
+		tmp.nbr_cells = 1;
+		tmp.val_off = g_nil_s;
+		return unify(q, p1, p1_ctx, &tmp, q->st.curr_frame);
+	}
+
+	cell *l = end_list(q);
+	may_ptr_error(l);
+	return unify(q, p1, p1_ctx, l, q->st.curr_frame);
+}
+
+const struct builtins g_global_funcs[] =
+{
+	{"nb_setval", 2, fn_nb_setval_2, NULL},
+	{"b_setval", 2, fn_b_setval_2, NULL},
+	{"nb_getval", 2, fn_nb_getval_2, NULL},
+	{"b_getval", 2, fn_nb_getval_2, NULL},
+	{"nb_delete", 1, fn_nb_delete_1, NULL},
+	{"$nb_current", 2, fn_sys_nb_current_2, NULL},
+	{"$global_vars", 1, fn_sys_global_vars_1, NULL},
+
+	{0}
+};
@@ -10,6 +10,8 @@
 #include "builtins.h"
 #include "heap.h"
 
+THREAD_LOCAL var_tabs g_tabs;
+
 size_t alloc_grow(void **addr, size_t elem_size, size_t min_elements, size_t max_elements)
 {
 	assert(min_elements <= max_elements);
@@ -64,29 +66,20 @@ cell *alloc_on_tmp(query *q, idx_t nbr_cells)
 // done as it will invalidate existing pointers. Build any compounds
 // first on the tmp heap, then allocate in one go here and copy in.
 // When more space is need allocate a new heap and keep them in the
-// arena list. Backtracking will garbage collect and free as needed.
+// arena list. Backtracking will garbage collect and free as needed,
+// and collect_heap() below frees arenas that are no longer reachable.
+// Only the arena numbered 'anbr-1' is current: if it was collected
+// (or backtracked over) start a fresh one rather than reuse an older.
 
 cell *alloc_on_heap(query *q, idx_t nbr_cells)
 {
-	if (!q->arenas) {
-		if (q->h_size < nbr_cells)
-			q->h_size = nbr_cells;
-
-		arena *a = calloc(1, sizeof(arena));
-		ensure(a);
-		a->heap = calloc(q->h_size, sizeof(cell));
-		ensure(a->heap);
-		a->h_size = q->h_size;
-		a->nbr = q->st.anbr++;
-		q->arenas = a;
-	}
-
-	if ((q->st.hp + nbr_cells) >= q->h_size) {
+	if (!q->arenas || (q->arenas->nbr != (q->st.anbr - 1))
+		|| ((q->st.hp + nbr_cells) >= q->arenas->h_size)) {
 		arena *a = calloc(1, sizeof(arena));
 		ensure(a);
 		a->next = q->arenas;
 
-		if (q->h_size < nbr_cells) {
+		if (q->h_size <= nbr_cells) {
 			q->h_size = nbr_cells;
 			q->h_size += nbr_cells / 2;
 		}
@@ -97,6 +90,8 @@ cell *alloc_on_heap(query *q, idx_t nbr_cells)
 		a->nbr = q->st.anbr++;
 		q->arenas = a;
 		q->st.hp = 0;
+		q->tot_heaps++;
+		q->tot_heapsize += a->h_size;
 	}
 
 	cell *c = q->arenas->heap + q->st.hp;
@@ -105,6 +100,175 @@ cell *alloc_on_heap(query *q, idx_t nbr_cells)
 	return c;
 }
 
+void free_arena(query *q, arena *a)
+{
+	for (idx_t i = 0; i < a->hp; i++) {
+		cell *c = a->heap + i;
+		unshare_cell(c);
+		c->val_type = TYPE_EMPTY;
+	}
+
+	q->tot_heaps--;
+	q->tot_heapsize -= a->h_size;
+	free(a->heap);
+	free(a);
+}
+
+// A mark-sweep collector over the arena list. It works at the level
+// of whole arenas: an arena is live if any root points into it, and
+// then anything its cells point to is live too. The roots are the
+// goal pointers held in the query, frames and choices, the bindings
+// and attributes in the slots and the attributes on the trail.
+// Only heap pointers are followed, which are found in indirect cells
+// (a bound compound), end cells (a continuation) and the attributes
+// of variables. Must only be called between goals, when no builtin
+// holds heap pointers on the C stack.
+
+typedef struct {
+	arena **arenas;
+	bool *marked;
+	idx_t *stack;
+	idx_t nbr, sp;
+} gc_state;
+
+static int gc_cmp(const void *p1, const void *p2)
+{
+	const arena *a1 = *(const arena**)p1, *a2 = *(const arena**)p2;
+	return a1->heap < a2->heap ? -1 : a1->heap > a2->heap ? 1 : 0;
+}
+
+static void gc_mark_ptr(gc_state *gc, const cell *c)
+{
+	if (!c)
+		return;
+
+	idx_t lo = 0, hi = gc->nbr;
+
+	while (lo < hi) {
+		idx_t mid = (lo + hi) / 2;
+		const arena *a = gc->arenas[mid];
+
+		if (c < a->heap)
+			hi = mid;
+		else if (c >= (a->heap + a->h_size))
+			lo = mid + 1;
+		else {
+			if (!gc->marked[mid]) {
+				gc->marked[mid] = true;
+				gc->stack[gc->sp++] = mid;
+			}
+
+			return;
+		}
+	}
+}
+
+static void gc_mark_cell(gc_state *gc, const cell *c)
+{
+	if (is_indirect(c) || is_end(c))
+		gc_mark_ptr(gc, c->val_ptr);
+	else if (is_variable(c) || is_empty(c))
+		gc_mark_ptr(gc, c->attrs);
+}
+
+bool collect_heap(query *q)
+{
+	if (!q->arenas || !q->arenas->next)
+		return true;
+
+	uint64_t started = get_time_in_usec();
+	gc_state gc = {0};
+
+	for (const arena *a = q->arenas; a; a = a->next)
+		gc.nbr++;
+
+	gc.arenas = malloc(sizeof(arena*) * gc.nbr);
+	gc.marked = calloc(gc.nbr, sizeof(bool));
+	gc.stack = malloc(sizeof(idx_t) * gc.nbr);
+
+	if (!gc.arenas || !gc.marked || !gc.stack) {
+		free(gc.arenas);
+		free(gc.marked);
+		free(gc.stack);
+		return false;
+	}
+
+	idx_t n = 0;
+
+	for (arena *a = q->arenas; a; a = a->next)
+		gc.arenas[n++] = a;
+
+	qsort(gc.arenas, gc.nbr, sizeof(arena*), gc_cmp);
+
+	// The current arena is never collected...
+
+	gc_mark_ptr(&gc, q->arenas->heap);
+
+	// Choices may restore frames and slots beyond the current ones...
+
+	idx_t max_fp = q->st.fp, max_sp = q->st.sp;
+	gc_mark_ptr(&gc, q->st.curr_cell);
+	gc_mark_ptr(&gc, q->variable_names);
+
+	for (idx_t i = 0; i < q->cp; i++) {
+		const choice *ch = GET_CHOICE(i);
+		gc_mark_ptr(&gc, ch->st.curr_cell);
+
+		if (ch->st.fp > max_fp)
+			max_fp = ch->st.fp;
+
+		if (ch->st.sp > max_sp)
+			max_sp = ch->st.sp;
+	}
+
+	for (idx_t i = 0; (i < max_fp) && (i < q->frames_size); i++)
+		gc_mark_ptr(&gc, GET_FRAME(i)->prev_cell);
+
+	for (idx_t i = 0; (i < max_sp) && (i < q->slots_size); i++)
+		gc_mark_cell(&gc, &q->slots[i].c);
+
+	for (idx_t i = 0; i < q->st.tp; i++)
+		gc_mark_ptr(&gc, q->trails[i].attrs);
+
+	while (gc.sp) {
+		const arena *a = gc.arenas[gc.stack[--gc.sp]];
+
+		for (idx_t i = 0; i < a->hp; i++)
+			gc_mark_cell(&gc, a->heap + i);
+	}
+
+	// Look everything up before freeing anything, as the sorted list
+	// can't be searched once some of its arenas are gone...
+
+	n = 0;
+
+	for (const arena *a = q->arenas; a; a = a->next) {
+		arena **found = bsearch(&a, gc.arenas, gc.nbr, sizeof(arena*), gc_cmp);
+		gc.stack[n++] = found - gc.arenas;
+	}
+
+	n = 0;
+
+	for (arena **ptr = &q->arenas; *ptr; n++) {
+		arena *a = *ptr;
+
+		if (gc.marked[gc.stack[n]]) {
+			ptr = &a->next;
+			continue;
+		}
+
+		*ptr = a->next;
+		free_arena(q, a);
+	}
+
+	free(gc.arenas);
+	free(gc.marked);
+	free(gc.stack);
+	q->tot_gcs++;
+	q->gc_time += get_time_in_usec() - started;
+	return true;
+}
+
 cell *deep_copy2_to_tmp(query *q, cell *p1, idx_t p1_ctx, unsigned depth, bool nonlocals_only, bool copy_attrs)
 {
 	if (depth >= 64000) {
@@ -131,9 +295,9 @@ cell *deep_copy2_to_tmp(query *q, cell *p1, idx_t p1_ctx, unsigned depth, bool n
 		slot *e = GET_SLOT(g, p1->var_nbr);
 		idx_t slot_nbr = e - q->slots;
 
-		for (size_t i = 0; i < q->st.m->pl->tab_idx; i++) {
-			if (q->st.m->pl->tab1[i] == slot_nbr) {
-				tmp->var_nbr = q->st.m->pl->tab2[i];
+		for (size_t i = 0; i < g_tabs.tab_idx; i++) {
+			if (g_tabs.tab1[i] == slot_nbr) {
+				tmp->var_nbr = g_tabs.tab2[i];
 				tmp->flags = FLAG2_FRESH;
 
 				if (is_anon(p1))
@@ -145,7 +309,7 @@ cell *deep_copy2_to_tmp(query *q, cell *p1, idx_t p1_ctx, unsigned depth, bool n
 			}
 		}
 
-		tmp->var_nbr = q->st.m->pl->varno;
+		tmp->var_nbr = g_tabs.varno;
 		tmp->flags = FLAG2_FRESH;
 		tmp->val_off = g_nil_s;
 		tmp->attrs = e->c.attrs;
@@ -153,9 +317,9 @@ cell *deep_copy2_to_tmp(query *q, cell *p1, idx_t p1_ctx, unsigned depth, bool n
 		if (is_anon(p1))
 			tmp->flags |= FLAG2_ANON;
 
-		q->st.m->pl->tab1[q->st.m->pl->tab_idx] = slot_nbr;
-		q->st.m->pl->tab2[q->st.m->pl->tab_idx] = q->st.m->pl->varno++;
-		q->st.m->pl->tab_idx++;
+		g_tabs.tab1[g_tabs.tab_idx] = slot_nbr;
+		g_tabs.tab2[g_tabs.tab_idx] = g_tabs.varno++;
+		g_tabs.tab_idx++;
 		return tmp;
 	}
 
@@ -180,12 +344,12 @@ cell *deep_copy_to_tmp(query *q, cell *p1, idx_t p1_ctx, bool nonlocals_only, bo
 		return NULL;
 
 	frame *g = GET_CURR_FRAME();
-	q->st.m->pl->varno = g->nbr_vars;
-	q->st.m->pl->tab_idx = 0;
+	g_tabs.varno = g->nbr_vars;
+	g_tabs.tab_idx = 0;
 	q->cycle_error = false;
 	cell* rec = deep_copy2_to_tmp(q, p1, p1_ctx, 0, nonlocals_only, copy_attrs);
 	if (!rec || (rec == ERR_CYCLE_CELL)) return rec;
-	int cnt = q->st.m->pl->varno - g->nbr_vars;
+	int cnt = g_tabs.varno - g->nbr_vars;
 
 	if (cnt) {
 		if (!create_vars(q, cnt)) {
@@ -228,7 +392,7 @@ cell *do_deep_copy_to_heap(query *q, bool prefix, cell *p1, idx_t p1_ctx, idx_t
 	return tmp2;
 }
 
-static cell *deep_clone2_to_tmp(query *q, cell *p1, idx_t p1_ctx, unsigned depth)
+cell *deep_clone2_to_tmp(query *q, cell *p1, idx_t p1_ctx, unsigned depth)
 {
 	if (depth >= 64000) {
 		q->cycle_error = true;
@@ -313,7 +477,7 @@ cell *clone_to_heap(query *q, bool prefix, cell *p1, idx_t suffix)
 	return tmp;
 }
 
-cell *copy_to_heap(query *q, bool prefix, cell *p1, idx_t p1_ctx, idx_t suffix)
+cell *copy_to_heap(query *q, bool prefix, cell *p1, __attribute__((unused)) idx_t p1_ctx, idx_t suffix)
 {
 	idx_t nbr_cells = p1->nbr_cells;
 	cell *tmp = alloc_on_heap(q, (prefix?1:0)+nbr_cells+suffix);
@@ -329,8 +493,8 @@ cell *copy_to_heap(query *q, bool prefix, cell *p1, idx_t p1_ctx, idx_t suffix)
 
 	cell *src = p1, *dst = tmp+(prefix?1:0);
 	frame *g = GET_CURR_FRAME();
-	q->st.m->pl->varno = g->nbr_vars;
-	q->st.m->pl->tab_idx = 0;
+	g_tabs.varno = g->nbr_vars;
+	g_tabs.tab_idx = 0;
 
 	for (idx_t i = 0; i < nbr_cells; i++, dst++, src++) {
 		*dst = *src;
@@ -343,25 +507,25 @@ cell *copy_to_heap(query *q, bool prefix, cell *p1, idx_t p1_ctx, idx_t suffix)
 		idx_t slot_nbr = e - q->slots;
 		int found = 0;
 
-		for (size_t i = 0; i < q->st.m->pl->tab_idx; i++) {
-			if (q->st.m->pl->tab1[i] == slot_nbr) {
-				dst->var_nbr = q->st.m->pl->tab2[i];
+		for (size_t i = 0; i < g_tabs.tab_idx; i++) {
+			if (g_tabs.tab1[i] == slot_nbr) {
+				dst->var_nbr = g_tabs.tab2[i];
 				break;
 			}
 		}
 
 		if (!found) {
-			dst->var_nbr = q->st.m->pl->varno;
-			q->st.m->pl->tab1[q->st.m->pl->tab_idx] = slot_nbr;
-			q->st.m->pl->tab2[q->st.m->pl->tab_idx] = q->st.m->pl->varno++;
-			q->st.m->pl->tab_idx++;
+			dst->var_nbr = g_tabs.varno;
+			g_tabs.tab1[g_tabs.tab_idx] = slot_nbr;
+			g_tabs.tab2[g_tabs.tab_idx] = g_tabs.varno++;
+			g_tabs.tab_idx++;
 		}
 
 		dst->flags = FLAG2_FRESH;
 	}
 
-	if (q->st.m->pl->varno != g->nbr_vars) {
-		if (!create_vars(q, q->st.m->pl->varno-g->nbr_vars)) {
+	if (g_tabs.varno != g->nbr_vars) {
+		if (!create_vars(q, g_tabs.varno-g->nbr_vars)) {
 			DISCARD_RESULT throw_error(q, p1, "resource_error", "too_many_vars");
 			return NULL;
 		}
@@ -370,6 +534,66 @@ cell *copy_to_heap(query *q, bool prefix, cell *p1, idx_t p1_ctx, idx_t suffix)
 	return tmp;
 }
 
+// Make a standalone copy of a term that can outlive the query, with
+// its variables numbered from zero, for handing to another query.
+
+term *detach_term(query *q, cell *p1, idx_t p1_ctx)
+{
+	frame *g = GET_CURR_FRAME();
+	unsigned save_vars = g->nbr_vars;
+	cell *tmp = deep_copy_to_tmp(q, p1, p1_ctx, false, false);
+	if (!tmp || (tmp == ERR_CYCLE_CELL)) return NULL;
+	idx_t nbr_cells = tmp->nbr_cells;
+	term *t = calloc(1, sizeof(term)+(sizeof(cell)*nbr_cells));
+	if (!t) return NULL;
+	t->cidx = safe_copy_cells(t->cells, tmp, nbr_cells);
+	t->nbr_cells = nbr_cells;
+
+	for (idx_t i = 0; i < nbr_cells; i++) {
+		cell *c = t->cells + i;
+
+		if (!is_variable(c))
+			continue;
+
+		c->var_nbr -= save_vars;
+		c->attrs = NULL;
+
+		if (c->var_nbr >= t->nbr_vars)
+			t->nbr_vars = c->var_nbr + 1;
+	}
+
+	return t;
+}
+
+// Copy a detached term onto the heap with fresh variables in the
+// current frame.
+
+cell *attach_term(query *q, const term *t)
+{
+	frame *g = GET_CURR_FRAME();
+	unsigned base = g->nbr_vars;
+
+	if (t->nbr_vars && !create_vars(q, t->nbr_vars)) {
+		DISCARD_RESULT throw_error(q, (cell*)t->cells, "resource_error", "too_many_vars");
+		return NULL;
+	}
+
+	cell *tmp = alloc_on_heap(q, t->cidx);
+	if (!tmp) return NULL;
+	safe_copy_cells(tmp, t->cells, t->cidx);
+
+	for (idx_t i = 0; i < t->cidx; i++) {
+		cell *c = tmp + i;
+
+		if (!is_variable(c))
+			continue;
+
+		c->var_nbr += base;
+	}
+
+	return tmp;
+}
+
 cell *alloc_on_queuen(query *q, int qnbr, const cell *c)
 {
 	if (!q->queue[qnbr]) {
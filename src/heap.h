@@ -9,6 +9,7 @@ cell *do_deep_copy_to_heap(query *q, bool prefix, cell *p1, idx_t p1_ctx, idx_t
 
 cell *deep_copy2_to_tmp(query *q, cell *p1, idx_t p1_ctx, unsigned depth, bool nonlocals_only, bool copy_attrs);
 cell *deep_copy_to_tmp(query *q, cell *p1, idx_t p1_ctx, bool nonlocals_only, bool copy_attrs);
+cell *deep_clone2_to_tmp(query *q, cell *p1, idx_t p1_ctx, unsigned depth);
 cell *deep_clone_to_tmp(query *q, cell *p1, idx_t p1_ctx);
 
 cell *clone2_to_tmp(query *q, cell *p1);
@@ -20,7 +21,12 @@ cell *copy_to_heap(query *q, bool prefix, cell *p1, idx_t p1_ctx, idx_t suffix);
 cell *deep_clone_to_tmp(query *q, cell *p1, idx_t p1_ctx);
 cell *deep_clone_to_heap(query *q, cell *p1, idx_t p1_ctx);
 
+term *detach_term(query *q, cell *p1, idx_t p1_ctx);
+cell *attach_term(query *q, const term *t);
+
 cell *alloc_on_heap(query *q, idx_t nbr_cells);
+void free_arena(query *q, arena *a);
+bool collect_heap(query *q);
 cell *alloc_on_tmp(query *q, idx_t nbr_cells);
 cell *alloc_on_queuen(query *q, int qnbr, const cell *c);
 
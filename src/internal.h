@@ -47,6 +47,52 @@ typedef uint64_t uint_t;
 #define atomic_t volatile
 #endif
 
+#if USE_THREADS
+#include <pthread.h>
+#define THREAD_LOCAL __thread
+typedef pthread_mutex_t lock;
+#else
+#define THREAD_LOCAL
+typedef int lock;
+#endif
+
+// Clause links are published with release stores so that readers
+// can walk them without taking the predicate lock...
+
+#if USE_THREADS
+#define load_link(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define store_link(p,v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#else
+#define load_link(p) (p)
+#define store_link(p,v) ((p) = (v))
+#endif
+
+// Locks are recursive, so a builtin holding one can call back into
+// code that takes it again...
+
+inline static void init_lock(lock *l)
+{
+#if USE_THREADS
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(l, &attr);
+	pthread_mutexattr_destroy(&attr);
+#else
+	*l = 0;
+#endif
+}
+
+#if USE_THREADS
+#define deinit_lock(l) pthread_mutex_destroy(l)
+#define acquire(l) pthread_mutex_lock(l)
+#define release(l) pthread_mutex_unlock(l)
+#else
+#define deinit_lock(l) (void)(l)
+#define acquire(l) (void)(l)
+#define release(l) (void)(l)
+#endif
+
 typedef uint32_t idx_t;
 
 #include "map.h"
@@ -92,9 +138,10 @@ typedef enum {
 #define MAX_OPS 250
 #define MAX_QUEUES 16
 #define MAX_STREAMS 1024
+#define MAX_THREADS 1024
 #define MAX_DEPTH 9000
 
-#define STREAM_BUFLEN 1024
+#define STREAM_BUFLEN (16*1024)		// a full TLS record
 #define CHECK_OVERFLOW 1
 
 #define GET_CHOICE(i) (q->choices+(i))
@@ -142,7 +189,7 @@ typedef enum {
 #define is_op(c) (c->flags && 0xFF00)
 
 typedef struct {
-	int64_t refcnt;
+	atomic_t int64_t refcnt;
 	size_t len;
 	char cstr[];
 } strbuf;
@@ -357,16 +404,42 @@ struct clause_ {
 	predicate *owner;
 	clause *prev, *next, *dirty;
 	uuid u;
+	uint64_t erased_by, ugen_unlinked;
 	term t;
 };
 
+// A bucket holds the clauses matching one key, in clause order.
+// Positions handed out to iterators are ordinals, which stay valid
+// when clauses are prepended (the array is regrown at the front) and
+// when they are deleted (the slot is left empty until it is safe).
+
+typedef struct {
+	cell key;
+	clause **clauses;
+	idx_t first, nbr, size, moved, dead;
+} bucket;
+
+// A per-argument index, built on demand the first time a call is
+// seen with that argument bound. Buckets are found by open-addressing
+// on the normalised key. Clauses with a variable (or a term that
+// can't be used as a key) in that position go in every bucket.
+
+typedef struct {
+	bucket **table;
+	bucket vars;
+	idx_t capacity, nbr_keys;
+	bool is_built:1;
+} arg_index;
+
 struct predicate_ {
 	predicate *next;
 	clause *head, *tail;
 	module *m;
 	map *index, *index_save;
+	arg_index *arg_idx;
 	cell key;
 	uint64_t cnt;
+	lock guard;
 	bool is_prebuilt:1;
 	bool is_public:1;
 	bool is_dynamic:1;
@@ -398,6 +471,44 @@ typedef struct {
 	uint16_t var_nbr;
 } trail;
 
+// Global variables are keyed on the atom's offset in the pool and
+// hold detached copies of their values, one table per thread. A
+// b_setval/2 made while there are choices pushes a trail entry with
+// no frame (ctx is ERR_IDX) whose attrs points at an undo record.
+
+typedef struct {
+	cell key;
+	term *val;
+} global_var;
+
+typedef struct {
+	global_var *vars;
+	idx_t size, cnt;
+} global_vars;
+
+typedef struct {
+	global_vars *gv;
+	term *val;
+	cell key;
+} global_undo;
+
+// Alarms live in slots that are reused via a free list, so an id is
+// a slot plus a generation. The pending ones are in a min-heap on
+// their due time (in msecs) and each knows its heap position, making
+// removal O(log n).
+
+typedef struct {
+	term *goal;
+	uint64_t due, gen;
+	unsigned pos;
+} alarm_slot;
+
+typedef struct {
+	alarm_slot *slots;
+	unsigned *heap;
+	unsigned cnt, nbr_slots, free_slot;
+} alarm_heap;
+
 typedef struct {
 	cell c;
 	idx_t ctx;
@@ -409,17 +520,28 @@ typedef struct {
 	uint64_t ugen;
 	idx_t prev_frame, ctx, overflow, cgen;
 	uint16_t nbr_vars, nbr_slots;
+	bool is_shared:1;				// bound to from an older frame
 } frame;
 
 enum { eof_action_eof_code, eof_action_error, eof_action_reset };
 
+// A read from a stream that can't seek, and the trail top when it
+// was made. Only a choice older than that can undo it.
+
+typedef struct {
+	idx_t tp;
+	size_t pos;
+} kept_mark;
+
 typedef struct {
 	FILE *fp;
-	char *mode, *filename, *name, *data, *src;
+	char *mode, *filename, *name, *data, *src, *srcbuf, *kept;
 	void *sslptr;
 	parser *p;
-	char srcbuf[STREAM_BUFLEN];
-	size_t data_len, alloc_nbytes;
+	kept_mark *marks;
+	size_t data_len, alloc_nbytes, kept_off, kept_len, kept_size;
+	idx_t kept_cp;
+	unsigned nbr_marks, marks_size;
 	int ungetch, srclen;
 	uint8_t level, eof_action;
 	bool at_end_of_file:1;
@@ -438,8 +560,10 @@ typedef struct {
 	cell *curr_cell;
 	clause *curr_clause, *curr_clause2;
 	miter *iter, *iter2;
+	bucket *bkt;
+	predicate *pr;
 	module *m;
-	idx_t curr_frame, fp, hp, tp, sp, cgen, anbr;
+	idx_t curr_frame, fp, hp, tp, sp, cgen, anbr, bkt_ord;
 	uint8_t qnbr;
 } prolog_state;
 
@@ -456,7 +580,6 @@ typedef struct {
 	bool register_cleanup:1;
 	bool register_term:1;
 	bool chk_is_det:1;
-	bool tail_rec:1;
 } choice;
 
 typedef struct arena_ arena;
@@ -485,7 +608,7 @@ typedef struct prolog_flags_ {
 } prolog_flags;
 
 struct query_ {
-	query *prev, *next, *parent;
+	query *prev, *next, *parent, *prev_pinned, *next_pinned, *next_waiter;
 	module *save_m, *current_m;
 	parser *p;
 	frame *frames;
@@ -500,13 +623,22 @@ struct query_ {
 	cell accum;
 	prolog_state st;
 	uint64_t tot_goals, tot_retries, tot_matches, tot_tcos;
-	uint64_t step, qid, time_started;
-	unsigned max_depth, tmo_msecs;
-	int nv_start;
+	uint64_t tot_gcs, gc_time;
+	uint64_t step, qid, time_started, trim_goals, tmo_msecs, pin_ugen;
+	uint64_t sleep_until;
+	alarm_heap alarms;
+	cell *sleep_cell;
+	idx_t sleep_cp;
+	unsigned max_depth;
+	atomic_t bool cancel;
+	int nv_start, wait_fd;
 	idx_t cp, tmphp, latest_ctx, popp, variable_names_ctx, save_cp;
 	idx_t frames_size, slots_size, trails_size, choices_size;
+	idx_t peak_frames_size, peak_slots_size, peak_trails_size, peak_choices_size;
 	idx_t max_choices, max_frames, max_slots, max_trails, save_tp;
+	idx_t hw_choices, hw_frames, hw_slots, hw_trails;
 	idx_t h_size, tmph_size, tot_heaps, tot_heapsize, undo_lo_tp, undo_hi_tp;
+	idx_t gc_threshold;
 	idx_t q_size[MAX_QUEUES], tmpq_size[MAX_QUEUES], qp[MAX_QUEUES];
 	uint8_t nv_mask[MAX_ARITY];
 	prolog_flags flag;
@@ -518,13 +650,13 @@ struct query_ {
 	bool do_dump_vars:1;
 	bool status:1;
 	bool resume:1;
-	bool no_tco:1;
 	bool error:1;
 	bool did_throw:1;
 	bool trace:1;
 	bool creep:1;
 	bool calc:1;
 	bool yielded:1;
+	bool wait_io:1;
 	bool is_task:1;
 	bool nl:1;
 	bool fullstop:1;
@@ -538,6 +670,9 @@ struct query_ {
 };
 
 struct parser_ {
+	parser *prev, *next;			// registered with the prolog for atom GC
+	prolog *pl;
+
 	struct {
 		char var_pool[MAX_VAR_POOL_SIZE];
 		unsigned var_used[MAX_ARITY];
@@ -579,10 +714,30 @@ struct loaded_file {
 	char filename[PATH_MAX];
 };
 
+// Tasks that are ready to run are kept in FIFO order, those that
+// are sleeping in a min-heap on their wake-up time. Tasks blocked
+// reading a socket are parked on an epoll set until it's readable,
+// chained per fd as several tasks may be waiting on the same one.
+
+typedef struct {
+	query **tasks;
+	unsigned head, cnt, size;
+} task_queue;
+
+typedef struct {
+	task_queue ready, pending;
+	query **timers, **waiters;
+	unsigned timers_cnt, timers_size, nbr_spawned, nbr_parked, waiters_size;
+	uint64_t slices, busy_usec, idle_usec;
+	int epoll_fd;
+	bool has_epoll;
+} scheduler;
+
 struct module_ {
 	module *next;
 	prolog *pl;
 	query *tasks;
+	scheduler sched;
 	char *name, *filename;
 	predicate *head, *tail;
 	parser *p;
@@ -603,20 +758,54 @@ struct module_ {
 	bool error:1;
 };
 
-struct prolog_ {
+typedef struct {
+	uint32_t hash;
+	idx_t val_off;
+} symbol;
+
+// Free space in the pool left behind by atom GC, binned by size...
+
+#define MAX_POOL_BINS 32
+
+typedef struct {
+	idx_t off, len;
+} pool_gap;
+
+// Scratch tables for copying terms and renaming their variables.
+// There is one set per OS thread...
+
+typedef struct {
 	idx_t tab1[64000];
 	idx_t tab3[64000];
 	idx_t tab2[64000];
 	idx_t tab4[64000];
 	uint8_t tab5[64000];
+	idx_t tab_idx;
+	unsigned varno;
+} var_tabs;
+
+extern THREAD_LOCAL var_tabs g_tabs;
+
+struct prolog_ {
 	module *modules;
 	module *user_m, *curr_m;
 	uint64_t s_last, s_cnt, seed;
-	map *symtab, *funtab, *keyval;
+	map *funtab, *keyval;
+	symbol *symtab;
+	parser *parsers;
+	query *pinned;
+	clause *dirty_list;
+	global_vars gvars;
+	pool_gap *pool_gaps[MAX_POOL_BINS];
 	char *pool;
-	uint64_t ugen;
-	idx_t pool_offset, pool_size, tab_idx;
-	unsigned varno;
+	lock pool_lock, db_lock, dirty_lock;
+	atomic_t uint64_t ugen;
+	uint64_t tot_atom_gcs, tot_atoms_freed;
+	idx_t pool_offset, pool_size;
+	idx_t symtab_size, symtab_count;
+	idx_t pool_fixed, pool_alloced, atom_gc_threshold;
+	idx_t pool_gaps_nbr[MAX_POOL_BINS], pool_gaps_size[MAX_POOL_BINS];
+	atomic_t unsigned nbr_queries, nbr_threads;
 	uint8_t current_input, current_output, current_error;
 	int8_t halt_code, opt;
 	bool halt:1;
@@ -633,7 +822,7 @@ extern idx_t g_empty_s, g_pair_s, g_dot_s, g_cut_s, g_nil_s, g_true_s, g_fail_s;
 extern idx_t g_anon_s, g_clause_s, g_eof_s, g_lt_s, g_false_s, g_once_s;
 extern idx_t g_gt_s, g_eq_s, g_sys_elapsed_s, g_sys_queue_s, g_braces_s;
 extern idx_t g_stream_property_s, g_unify_s, g_on_s, g_off_s, g_sys_var_s;
-extern idx_t g_call_s, g_braces_s, g_plus_s, g_minus_s, g_post_unify_hook_s;
+extern idx_t g_call_s, g_braces_s, g_plus_s, g_minus_s, g_post_unify_hook_s, g_alarm_hook_s;
 extern stream g_streams[MAX_STREAMS];
 extern unsigned g_cpu_count;
 
@@ -696,6 +885,13 @@ extern uint64_t get_time_in_usec(void);
 extern char *relative_to(const char *basefile, const char *relfile);
 extern size_t sprint_int(char *dst, size_t size, int_t n, int base);
 extern void format_property(char *tmpbuf, size_t buflen, const char *name, unsigned arity, const char *type);
+extern global_vars *get_global_vars(query *q);
+extern void walk_queued_terms(void (*fn)(const term *t, void *data), void *data);
+extern void clear_global_vars(global_vars *gv);
+extern void undo_global_var(global_undo *u);
+extern void drop_global_var(global_undo *u);
+extern bool next_alarm_due(const query *q, uint64_t *due);
+extern void clear_alarms(alarm_heap *ah);
 
 // A string builder...
 
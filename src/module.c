@@ -7,6 +7,10 @@
 #include <float.h>
 #include <sys/time.h>
 
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
 #include "internal.h"
 #include "history.h"
 #include "library.h"
@@ -92,9 +96,6 @@ predicate *create_predicate(module *m, cell *c)
 {
 	predicate *h = calloc(1, sizeof(predicate));
 	ensure(h);
-	h->next = m->head;
-	m->head = h;
-
 	h->m = m;
 	h->key = *c;
 	h->key.val_type = TYPE_LITERAL;
@@ -104,7 +105,12 @@ predicate *create_predicate(module *m, cell *c)
 	if (is_cstring(c))
 		h->key.val_off = index_from_pool(m->pl, MODULE_GET_STR(c));
 
+	init_lock(&h->guard);
+	acquire(&m->pl->db_lock);
+	h->next = m->head;
+	m->head = h;
 	m_app(m->index, &h->key, h);
+	release(&m->pl->db_lock);
 	return h;
 }
 
@@ -196,17 +202,23 @@ static int compkey2(const void *ptr1, const void *ptr2, const void *param)
 
 clause *find_in_db(module *m, uuid *ref)
 {
-	for (predicate *h = m->head; h; h = h->next) {
-		for (clause *r = h->head ; r; r = r->next) {
+	clause *found = NULL;
+	acquire(&m->pl->db_lock);
+
+	for (predicate *h = m->head; h && !found; h = h->next) {
+		for (clause *r = load_link(h->head); r; r = load_link(r->next)) {
 			if (r->t.ugen_erased)
 				continue;
 
-			if (!memcmp(&r->u, ref, sizeof(uuid)))
-				return r;
+			if (!memcmp(&r->u, ref, sizeof(uuid))) {
+				found = r;
+				break;
+			}
 		}
 	}
 
-	return NULL;
+	release(&m->pl->db_lock);
+	return found;
 }
 
 static void push_property(module *m, const char *name, unsigned arity, const char *type)
@@ -225,9 +237,16 @@ static void push_property(module *m, const char *name, unsigned arity, const cha
 
 clause *erase_from_db(module *m, uuid *ref)
 {
+	acquire(&m->pl->db_lock);
 	clause *r = find_in_db(m, ref);
-	if (!r) return 0;
-	r->t.ugen_erased = ++m->pl->ugen;
+
+	if (r) {
+		acquire(&r->owner->guard);
+		r->t.ugen_erased = ++m->pl->ugen;
+		release(&r->owner->guard);
+	}
+
+	release(&m->pl->db_lock);
 	return r;
 }
 
@@ -359,18 +378,21 @@ predicate *find_predicate(module *m, cell *c)
 	if (is_cstring(c))
 		tmp.val_off = index_from_pool(m->pl, MODULE_GET_STR(c));
 
+	acquire(&m->pl->db_lock);
 	miter *iter = m_findkey(m->index, &tmp);
-	predicate *h = NULL;
+	predicate *h = NULL, *found = NULL;
 
 	while (m_nextkey(iter, (void*)&h)) {
 		if (h->is_abolished)
 			continue;
 
 		m_done(iter);
-		return h;
+		found = h;
+		break;
 	}
 
-	return NULL;
+	release(&m->pl->db_lock);
+	return found;
 }
 
 predicate *find_functor(module *m, const char *name, unsigned arity)
@@ -516,6 +538,329 @@ static void reindex_predicate(module *m, predicate *h)
 	}
 }
 
+// Argument keys: integers, floats (not NaNs), atoms and the functor
+// of a compound. Anything else (variables, strings, rationals) is
+// treated as matching any key. Keys are normalised so that they can
+// be hashed and compared on (type, arity, value) alone, with atoms
+// (including quoted ones) by their offset in the pool.
+
+static bool make_arg_key(prolog *pl, const cell *c, cell *key, bool add)
+{
+	*key = (cell){0};
+	key->nbr_cells = 1;
+
+	if (is_integer(c)) {
+		key->val_type = TYPE_RATIONAL;
+		key->val_num = c->val_num;
+		key->val_den = 1;
+		return true;
+	}
+
+	if (is_float(c)) {
+		if (c->val_flt != c->val_flt)
+			return false;
+
+		key->val_type = TYPE_FLOAT;
+		key->val_flt = c->val_flt == 0.0 ? 0.0 : c->val_flt;
+		return true;
+	}
+
+	if (is_string(c) || (!is_atom(c) && !is_structure(c)))
+		return false;
+
+	key->val_type = TYPE_LITERAL;
+	key->arity = c->arity;
+
+	if (is_literal(c))
+		key->val_off = c->val_off;
+	else if (add)
+		key->val_off = index_from_pool(pl, _GET_STR(pl, c));
+	else if (!is_in_pool(pl, _GET_STR(pl, c), &key->val_off))
+		key->val_off = ERR_IDX;
+
+	return true;
+}
+
+static uint64_t hash_arg_key(const cell *key)
+{
+	uint64_t h;
+
+	if (is_float(key))
+		memcpy(&h, &key->val_flt, sizeof(h));
+	else if (is_rational(key))
+		h = (uint64_t)key->val_num;
+	else
+		h = ((uint64_t)key->arity << 32) | key->val_off;
+
+	h ^= (uint64_t)key->val_type << 56;
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+	return h;
+}
+
+static bool is_same_arg_key(const cell *k1, const cell *k2)
+{
+	if (k1->val_type != k2->val_type)
+		return false;
+
+	if (is_float(k1))
+		return k1->val_flt == k2->val_flt;
+
+	if (is_rational(k1))
+		return k1->val_num == k2->val_num;
+
+	return (k1->arity == k2->arity) && (k1->val_off == k2->val_off);
+}
+
+static bucket **find_key_slot(const arg_index *ai, const cell *key)
+{
+	idx_t mask = ai->capacity - 1;
+	idx_t i = hash_arg_key(key) & mask;
+
+	while (ai->table[i] && !is_same_arg_key(&ai->table[i]->key, key))
+		i = (i + 1) & mask;
+
+	return &ai->table[i];
+}
+
+static void grow_key_table(arg_index *ai)
+{
+	bucket **save = ai->table;
+	idx_t save_capacity = ai->capacity;
+	ai->capacity = ai->capacity ? ai->capacity * 2 : 16;
+	ai->table = calloc(ai->capacity, sizeof(bucket*));
+	ensure(ai->table);
+
+	for (idx_t i = 0; i < save_capacity; i++) {
+		if (save[i])
+			*find_key_slot(ai, &save[i]->key) = save[i];
+	}
+
+	free(save);
+}
+
+static void bucket_add(bucket *b, clause *r, bool append)
+{
+	if (append && ((b->first + b->nbr) == b->size)) {
+		b->size = b->size ? b->size * 2 : 4;
+		b->clauses = realloc(b->clauses, sizeof(clause*)*b->size);
+		ensure(b->clauses);
+	} else if (!append && !b->first) {
+		idx_t room = b->size ? b->size : 4;
+		clause **tmp = malloc(sizeof(clause*)*(b->size+room));
+		ensure(tmp);
+
+		if (b->nbr)
+			memcpy(tmp+room, b->clauses, sizeof(clause*)*b->nbr);
+
+		free(b->clauses);
+		b->clauses = tmp;
+		b->size += room;
+		b->first += room;
+		b->moved += room;
+	}
+
+	if (append)
+		b->clauses[b->first+b->nbr] = r;
+	else
+		b->clauses[--b->first] = r;
+
+	b->nbr++;
+}
+
+// Moving clauses down would shift them under an iterator holding an
+// ordinal past the deleted one, so deleting leaves a hole. Holes at
+// either end are trimmed, the rest are squeezed out only when no query
+// can be iterating.
+
+static void bucket_del(bucket *b, const clause *r, bool compact)
+{
+	for (idx_t i = b->first; i < (b->first + b->nbr); i++) {
+		if (b->clauses[i] != r)
+			continue;
+
+		b->clauses[i] = NULL;
+		b->dead++;
+		break;
+	}
+
+	if (compact && b->dead) {
+		idx_t j = b->first;
+
+		for (idx_t i = b->first; i < (b->first + b->nbr); i++) {
+			if (b->clauses[i])
+				b->clauses[j++] = b->clauses[i];
+		}
+
+		b->nbr = j - b->first;
+		b->dead = 0;
+		return;
+	}
+
+	while (b->nbr && !b->clauses[b->first]) {
+		b->first++;
+		b->nbr--;
+		b->dead--;
+	}
+
+	while (b->nbr && !b->clauses[b->first+b->nbr-1]) {
+		b->nbr--;
+		b->dead--;
+	}
+}
+
+static cell *get_arg(cell *c, unsigned arg)
+{
+	c++;
+
+	while (arg--)
+		c += c->nbr_cells;
+
+	return c;
+}
+
+static void arg_index_add(prolog *pl, arg_index *ai, cell *c, clause *r, bool append)
+{
+	cell key;
+
+	if (!make_arg_key(pl, c, &key, true)) {
+		bucket_add(&ai->vars, r, append);
+
+		for (idx_t i = 0; i < ai->capacity; i++) {
+			if (ai->table[i])
+				bucket_add(ai->table[i], r, append);
+		}
+
+		return;
+	}
+
+	if (((ai->nbr_keys + 1) * 2) > ai->capacity)
+		grow_key_table(ai);
+
+	bucket **slot = find_key_slot(ai, &key);
+
+	if (!*slot) {
+		bucket *b = calloc(1, sizeof(bucket));
+		ensure(b);
+		b->key = key;
+
+		for (idx_t i = 0; i < ai->vars.nbr; i++) {
+			if (ai->vars.clauses[ai->vars.first+i])
+				bucket_add(b, ai->vars.clauses[ai->vars.first+i], true);
+		}
+
+		*slot = b;
+		ai->nbr_keys++;
+	}
+
+	bucket_add(*slot, r, append);
+}
+
+static void build_arg_index(predicate *h, unsigned arg)
+{
+	arg_index *ai = &h->arg_idx[arg];
+	ai->is_built = true;
+	grow_key_table(ai);
+
+	for (clause *r = h->head; r; r = r->next) {
+		if (!r->t.ugen_erased)
+			arg_index_add(h->m->pl, ai, get_arg(get_head(r->t.cells), arg), r, true);
+	}
+}
+
+// Find the bucket of clauses that could match the given key in the
+// given argument position, building the index for it if needed.
+
+bucket *find_arg_bucket(predicate *h, unsigned arg, cell *c)
+{
+	cell key;
+
+	if (!make_arg_key(h->m->pl, c, &key, false))
+		return NULL;
+
+	acquire(&h->guard);
+
+	if (!h->arg_idx) {
+		h->arg_idx = calloc(h->key.arity, sizeof(arg_index));
+		ensure(h->arg_idx);
+	}
+
+	arg_index *ai = &h->arg_idx[arg];
+
+	// Building may intern atoms that the key is looking for...
+
+	if (!ai->is_built) {
+		build_arg_index(h, arg);
+		make_arg_key(h->m->pl, c, &key, false);
+	}
+
+	bucket *b = *find_key_slot(ai, &key);
+	release(&h->guard);
+	return b ? b : &ai->vars;
+}
+
+void unindex_clause(predicate *h, clause *r, bool compact)
+{
+	if (!h->arg_idx)
+		return;
+
+	acquire(&h->guard);
+
+	for (unsigned i = 0; i < h->key.arity; i++) {
+		arg_index *ai = &h->arg_idx[i];
+
+		if (!ai->is_built)
+			continue;
+
+		cell key;
+
+		if (make_arg_key(h->m->pl, get_arg(get_head(r->t.cells), i), &key, false)) {
+			bucket *b = *find_key_slot(ai, &key);
+
+			if (b)
+				bucket_del(b, r, compact);
+
+			continue;
+		}
+
+		bucket_del(&ai->vars, r, compact);
+
+		for (idx_t j = 0; j < ai->capacity; j++) {
+			if (ai->table[j])
+				bucket_del(ai->table[j], r, compact);
+		}
+	}
+
+	release(&h->guard);
+}
+
+static void destroy_arg_indexes(predicate *h)
+{
+	if (!h->arg_idx)
+		return;
+
+	for (unsigned i = 0; i < h->key.arity; i++) {
+		arg_index *ai = &h->arg_idx[i];
+
+		for (idx_t j = 0; j < ai->capacity; j++) {
+			if (!ai->table[j])
+				continue;
+
+			free(ai->table[j]->clauses);
+			free(ai->table[j]);
+		}
+
+		free(ai->table);
+		free(ai->vars.clauses);
+	}
+
+	free(h->arg_idx);
+	h->arg_idx = NULL;
+}
+
 static void assert_commit(module *m, term *t, clause *r, predicate *h, bool append)
 {
 	cell *c = get_head(r->t.cells);
@@ -545,6 +890,13 @@ static void assert_commit(module *m, term *t, clause *r, predicate *h, bool appe
 			else
 				m_app(h->index, c, r);
 		}
+
+		for (unsigned i = 0; h->arg_idx && (i < h->key.arity); i++) {
+			arg_index *ai = &h->arg_idx[i];
+
+			if (ai->is_built)
+				arg_index_add(m->pl, ai, get_arg(c, i), r, append);
+		}
 	}
 
 	t->cidx = 0;
@@ -552,59 +904,81 @@ static void assert_commit(module *m, term *t, clause *r, predicate *h, bool appe
 
 clause *asserta_to_db(module *m, term *t, bool consulting)
 {
+	acquire(&m->pl->db_lock);
 	clause *r = assert_begin(m, t, consulting);
-	if (!r) return NULL;
+
+	if (!r) {
+		release(&m->pl->db_lock);
+		return NULL;
+	}
+
 	predicate *h = r->owner;
+	acquire(&h->guard);
+	r->next = h->head;
 
 	if (h->head)
 		h->head->prev = r;
 
-	r->next = h->head;
-	h->head = r;
-	h->cnt++;
-
 	if (!h->tail)
 		h->tail = r;
 
+	store_link(h->head, r);
+	h->cnt++;
 	assert_commit(m, t, r, h, false);
+	release(&h->guard);
+	release(&m->pl->db_lock);
 	return r;
 }
 
 clause *assertz_to_db(module *m, term *t, bool consulting)
 {
+	acquire(&m->pl->db_lock);
 	clause *r = assert_begin(m, t, consulting);
-	if (!r) return NULL;
+
+	if (!r) {
+		release(&m->pl->db_lock);
+		return NULL;
+	}
+
 	predicate *h = r->owner;
+	acquire(&h->guard);
+	r->prev = h->tail;
 
 	if (h->tail)
-		h->tail->next = r;
+		store_link(h->tail->next, r);
 
-	r->prev = h->tail;
 	h->tail = r;
 	h->cnt++;
 
 	if (!h->head)
-		h->head = r;
+		store_link(h->head, r);
 
 	assert_commit(m, t, r, h, true);
+	release(&h->guard);
+	release(&m->pl->db_lock);
 	return r;
 }
 
 bool retract_from_db(module *m, clause *r)
 {
-	if (r->t.ugen_erased)
-		return false;
-
 	predicate *h = r->owner;
+	acquire(&h->guard);
+
+	if (r->t.ugen_erased) {
+		release(&h->guard);
+		return false;
+	}
 
 	if (!--h->cnt) {
 		m_destroy(h->index);
 		m_destroy(h->index_save);
 		h->index = h->index_save = NULL;
-		h->head = h->tail = NULL;
+		store_link(h->head, NULL);
+		h->tail = NULL;
 	}
 
 	r->t.ugen_erased = ++m->pl->ugen;
+	release(&h->guard);
 	return true;
 }
 
@@ -855,6 +1229,16 @@ void destroy_module(module *m)
 		m->tasks = task;
 	}
 
+	free(m->sched.ready.tasks);
+	free(m->sched.pending.tasks);
+	free(m->sched.timers);
+	free(m->sched.waiters);
+
+#ifdef __linux__
+	if (m->sched.has_epoll)
+		close(m->sched.epoll_fd);
+#endif
+
 	m_destroy(m->index);
 
 	for (predicate *h = m->head; h;) {
@@ -869,6 +1253,8 @@ void destroy_module(module *m)
 
 		m_destroy(h->index);
 		m_destroy(h->index_save);
+		destroy_arg_indexes(h);
+		deinit_lock(&h->guard);
 		free(h);
 		h = save;
 	}
@@ -24,6 +24,8 @@ extern clause *asserta_to_db(module *m, term *t, bool consulting);
 extern clause *assertz_to_db(module *m, term *t, bool consulting);
 extern bool retract_from_db(module *m, clause *r);
 extern clause *erase_from_db(module *m, uuid *ref);
+extern bucket *find_arg_bucket(predicate *h, unsigned arg, cell *key);
+extern void unindex_clause(predicate *h, clause *r, bool compact);
 
 extern void set_noindex_in_db(module *m, const char *name, unsigned arity);
 extern void set_discontiguous_in_db(module *m, const char *name, unsigned arity);
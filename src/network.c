@@ -33,6 +33,7 @@
 
 #include "internal.h"
 #include "network.h"
+#include "utf8.h"
 
 #if USE_OPENSSL
 static int g_ctx_use_cnt = 0;
@@ -190,6 +191,23 @@ void net_set_nonblocking(stream *str)
 	ioctl(fileno(str->fp), FIONBIO, &flag);
 }
 
+int net_port(stream *str)
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+
+	if (!str->fp || getsockname(fileno(str->fp), (struct sockaddr*)&addr, &len))
+		return -1;
+
+	if (addr.ss_family == AF_INET)
+		return ntohs(((struct sockaddr_in*)&addr)->sin_port);
+
+	if (addr.ss_family == AF_INET6)
+		return ntohs(((struct sockaddr_in6*)&addr)->sin6_port);
+
+	return -1;
+}
+
 void *net_enable_ssl(int fd, const char *hostname, int is_server, int level, const char *certfile)
 {
 #if USE_OPENSSL
@@ -258,51 +276,77 @@ size_t net_write(const void *ptr, size_t nbytes, stream *str)
 	return fwrite(ptr, 1, nbytes, str->fp);
 }
 
+#if USE_OPENSSL
+// TLS data is read a whole record at a time into the stream's buffer.
+
+static bool fill_ssl_buffer(stream *str)
+{
+	if (!str->srcbuf) {
+		str->srcbuf = malloc(STREAM_BUFLEN);
+
+		if (!str->srcbuf)
+			return false;
+	}
+
+	int rlen = SSL_read((SSL*)str->sslptr, str->srcbuf, STREAM_BUFLEN);
+
+	if (rlen <= 0)
+		return false;
+
+	str->src = str->srcbuf;
+	str->srclen = rlen;
+	return true;
+}
+#endif
+
 int net_getc(stream *str)
 {
 #if USE_OPENSSL
 	if (str->ssl) {
-		size_t len = 1;
-		char ptr[2];
-		char *dst = ptr;
-
-		while (len && str->srclen) {
-			*dst++ = *str->src++;
-			str->srclen--;
-			len--;
-		}
-
-		if (dst != ptr) {
-			return ptr[0];
-		}
-
-		if (SSL_read((SSL*)str->sslptr, ptr, len) == 0)
+		if (!str->srclen && !fill_ssl_buffer(str))
 			return EOF;
 
-		return ptr[0];
+		str->srclen--;
+		return (unsigned char)*str->src++;
 	}
 #endif
 
 	return getc(str->fp);
 }
 
+// The rest of a multi-byte character, given its first byte (as per
+// xgetc_utf8).
+
+int net_getc_utf8(stream *str, int ch)
+{
+	unsigned n = 0;
+	int expect = 0;
+	decode_utf8((unsigned char)ch, &n, &expect);
+
+	while (expect--) {
+		if ((ch = stream_getc(str)) == EOF)
+			return EOF;
+
+		decode_utf8((unsigned char)ch, &n, &expect);
+	}
+
+	return (int)n;
+}
+
 size_t net_read(void *ptr, size_t len, stream *str)
 {
 #if USE_OPENSSL
 	if (str->ssl) {
-		char *dst = ptr;
-
-		while (len && str->srclen) {
-			*dst++ = *str->src++;
-			str->srclen--;
-			len--;
-		}
-
-		if (dst != ptr) {
-			return dst - (char*)ptr;
+		if (str->srclen) {
+			size_t nbytes = len < (size_t)str->srclen ? len : (size_t)str->srclen;
+			memcpy(ptr, str->src, nbytes);
+			str->src += nbytes;
+			str->srclen -= nbytes;
+			return nbytes;
 		}
 
-		return SSL_read((SSL*)str->sslptr, ptr, len);
+		int rlen = SSL_read((SSL*)str->sslptr, ptr, len);
+		return rlen > 0 ? (size_t)rlen : 0;
 	}
 #endif
 
@@ -318,44 +362,38 @@ int net_getline(char **lineptr, size_t *n, stream *str)
 			ensure(*lineptr);
 		}
 
-		char *dst = *lineptr;
-		size_t dstlen = *n;
-		int done = 0;
+		size_t used = 0;
 
-		while (!done) {
-			if (str->srclen <= 0) {
-				int rlen = SSL_read((SSL*)str->sslptr, str->srcbuf, STREAM_BUFLEN);
-
-				if (rlen <= 0)
+		for (;;) {
+			if (!str->srclen && !fill_ssl_buffer(str)) {
+				if (!used)
 					return -1;
 
-				str->srcbuf[rlen] = '\0';
-				str->src = str->srcbuf;
-				str->srclen = rlen;
+				break;
 			}
 
-			while (str->srclen-- > 0) {
-				int ch = *str->src++;
-				*dst++ = ch;
+			const char *nl = memchr(str->src, '\n', str->srclen);
+			size_t len = nl ? (size_t)(nl - str->src) + 1 : (size_t)str->srclen;
 
-				if (dstlen-- <= 1) {
-					size_t savelen = dst - *lineptr;
+			if ((used + len + 1) > *n) {
+				while ((used + len + 1) > *n)
 					*n *= 2;
-					*lineptr = realloc(*lineptr, *n);
-					ensure(*lineptr);
-					dst = *lineptr + savelen;
-					dstlen = *n - savelen;
-				}
-
-				if (ch == '\n') {
-					*dst = '\0';
-					done = 1;
-					break;
-				}
+
+				*lineptr = realloc(*lineptr, *n);
+				ensure(*lineptr);
 			}
+
+			memcpy(*lineptr + used, str->src, len);
+			used += len;
+			str->src += len;
+			str->srclen -= len;
+
+			if (nl)
+				break;
 		}
 
-		return dst - *lineptr;
+		(*lineptr)[used] = '\0';
+		return used;
 	}
 #endif
 
@@ -376,5 +414,8 @@ void net_close(stream *str)
 	}
 #endif
 
+	free(str->srcbuf);
+	free(str->kept);
+	free(str->marks);
 	fclose(str->fp);
 }
@@ -4,6 +4,7 @@ extern int net_server(const char *hostname, unsigned port, int udp, const char *
 extern int net_accept(stream *str);
 extern int net_connect(const char *hostname, unsigned port, int udp, int nodelay);
 extern void net_set_nonblocking(stream *str);
+extern int net_port(stream *str);
 
 extern void *net_enable_ssl(int fd, const char *hostname, int server, int level, const char *certfile);
 extern size_t net_read(void *ptr, size_t len, stream *str);
@@ -11,3 +12,37 @@ extern int net_getline(char **lineptr, size_t *n, stream *str);
 extern int net_getc(stream *str);
 extern size_t net_write(const void *ptr, size_t nbytes, stream *str);
 extern void net_close(stream *str);
+
+extern int net_getc_utf8(stream *str, int ch);
+
+// Character input reads straight from the stdio buffer, and ASCII
+// needs no decoding. Only TLS streams call out. Streams can be shared
+// between OS threads, so the stdio lock is only skipped without them.
+
+#ifdef _WIN32
+#define getc_unlocked _getc_nolock
+#endif
+
+static inline int stream_getc(stream *str)
+{
+#if USE_OPENSSL
+	if (str->ssl)
+		return net_getc(str);
+#endif
+
+#if USE_THREADS
+	return getc(str->fp);
+#else
+	return getc_unlocked(str->fp);
+#endif
+}
+
+static inline int stream_getc_utf8(stream *str)
+{
+	int ch = stream_getc(str);
+
+	if (ch < 0x80)			// ASCII or EOF
+		return ch;
+
+	return net_getc_utf8(str, ch);
+}
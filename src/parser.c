@@ -215,6 +215,7 @@ cell *list_tail(cell *l, cell *tmp)
 	}
 
 	if (is_static(l)) {
+		tmp->val_type = TYPE_CSTRING;
 		tmp->flags = FLAG_BLOB | FLAG_STATIC | FLAG_STRING;
 		tmp->nbr_cells = 1;
 		tmp->arity = 2;
@@ -346,6 +347,16 @@ static cell *make_cell(parser *p)
 
 void destroy_parser(parser *p)
 {
+	if (p->pl) {
+		if (p->prev)
+			p->prev->next = p->next;
+		else
+			p->pl->parsers = p->next;
+
+		if (p->next)
+			p->next->prev = p->prev;
+	}
+
 	free(p->save_line);
 	free(p->token);
 	clear_term(p->t);
@@ -369,9 +380,16 @@ parser *create_parser(module *m)
 
 	if (!p->token || !p->t) {
 		destroy_parser(p);
-		p = NULL;
+		return NULL;
 	}
 
+	p->pl = m->pl;
+	p->next = p->pl->parsers;
+
+	if (p->next)
+		p->next->prev = p;
+
+	p->pl->parsers = p;
 	return p;
 }
 
@@ -28,6 +28,10 @@
 #include <dirent.h>
 #endif
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
 #include "trealla.h"
 #include "internal.h"
 #include "network.h"
@@ -140,6 +144,21 @@ static pl_status do_yield_0(query *q, int msecs)
 	return pl_failure;
 }
 
+// A task whose socket read would block waits for the fd to become
+// readable, falling back to polling where there is no epoll.
+
+static pl_status do_yield_fd(query *q, stream *str, int msecs)
+{
+	do_yield_0(q, msecs);
+#ifdef __linux__
+	q->wait_fd = fileno(str->fp);
+	q->wait_io = true;
+#else
+	(void) str;
+#endif
+	return pl_failure;
+}
+
 static void set_params(query *q, idx_t p1, idx_t p2)
 {
 	choice *ch = GET_CURR_CHOICE();
@@ -311,6 +330,23 @@ USE_RESULT cell *end_list(query *q)
 	return tmp;
 }
 
+// As end_list() but with the given (atomic or variable) tail
+
+static USE_RESULT cell *end_partial_list(query *q, const cell *tail)
+{
+	cell *tmp = alloc_on_tmp(q, 1);
+	if (!tmp) return NULL;
+	*tmp = *tail;
+	idx_t nbr_cells = tmp_heap_used(q);
+
+	tmp = alloc_on_heap(q, nbr_cells);
+	if (!tmp) return NULL;
+	safe_copy_cells(tmp, get_tmp_heap(q, 0), nbr_cells);
+	tmp->nbr_cells = nbr_cells;
+	fix_list(tmp);
+	return tmp;
+}
+
 static USE_RESULT cell *end_list_unsafe(query *q)
 {
 	cell *tmp = alloc_on_tmp(q, 1);
@@ -366,6 +402,16 @@ static USE_RESULT pl_status make_string(cell *d, const char *s)
 	return make_stringn(d, s, strlen(s));
 }
 
+// A static string (such as an mmap'd file) is never freed, so a
+// slice of it can just point into it.
+
+static void make_static_slice(cell *d, const cell *orig, size_t off, size_t n)
+{
+	*d = *orig;
+	d->val_str += off;
+	d->str_len = n;
+}
+
 static USE_RESULT pl_status make_slice(query *q, cell *d, cell *orig, size_t off, size_t n)
 {
 #if 0
@@ -391,6 +437,11 @@ static USE_RESULT pl_status make_slice(query *q, cell *d, cell *orig, size_t off
 
 	return make_cstringn(d, s+off, n);
 #else
+	if (is_static(orig)) {
+		make_static_slice(d, orig, off, n);
+		return pl_success;
+	}
+
 	const char *s = GET_STR(orig);
 
 	if (is_string(orig))
@@ -1091,7 +1142,7 @@ static USE_RESULT pl_status fn_iso_number_codes_2(query *q)
 	return unify(q, p2, p2_ctx, l, q->st.curr_frame);
 }
 
-#define LEN_STR_UTF8(c) strlen_utf8(GET_STR(c))
+#define LEN_STR_UTF8(c) substrlen_utf8(GET_STR(c), LEN_STR(c))
 
 static USE_RESULT pl_status fn_iso_sub_atom_5(query *q)
 {
@@ -1651,9 +1702,14 @@ static pl_status do_retract(query *q, cell *p1, idx_t p1_ctx, enum clause_type i
 		return match;
 
 	clause *r = q->st.curr_clause2;
+
+	// Another thread may have got there first...
+
+	if (!add_to_dirty_list(q, r))
+		return pl_failure;
+
 	bool last_match = !q->st.curr_clause2->next && (is_retract == DO_RETRACT);
 	stash_me(q, &r->t, last_match);
-	add_to_dirty_list(q, r);
 
 	if (!q->st.m->loading && r->t.persist)
 		db_log(q, r, LOG_ERASE);
@@ -1678,7 +1734,7 @@ static void add_stream_properties(query *q, int n)
 			}
 		}
 
-		int ch = str->ungetch ? str->ungetch : net_getc(str);
+		int ch = str->ungetch ? str->ungetch : stream_getc(str);
 
 		if (str->ungetch)
 			;
@@ -1701,6 +1757,11 @@ static void add_stream_properties(query *q, int n)
 	dst += snprintf(dst, sizeof(tmpbuf)-strlen(tmpbuf), "'$stream_property'(%d, end_of_stream(%s)).\n", n, str->at_end_of_file ? "past" : at_end_of_file ? "at" : "not");
 	dst += snprintf(dst, sizeof(tmpbuf)-strlen(tmpbuf), "'$stream_property'(%d, eof_action(%s)).\n", n, str->eof_action == eof_action_eof_code ? "eof_code" : str->eof_action == eof_action_error ? "error" : str->eof_action == eof_action_reset ? "reset" : "none");
 
+	int port = net_port(str);
+
+	if (port >= 0)
+		dst += snprintf(dst, sizeof(tmpbuf)-strlen(tmpbuf), "'$stream_property'(%d, port(%d)).\n", n, port);
+
 	if (!str->binary) {
 		dst += snprintf(dst, sizeof(tmpbuf)-strlen(tmpbuf), "'$stream_property'(%d, bom(%s)).\n", n, str->bom ? "true" : "false");
 		dst += snprintf(dst, sizeof(tmpbuf)-strlen(tmpbuf), "'$stream_property'(%d, encoding('%s')).\n", n, "UTF-8");
@@ -1862,7 +1923,7 @@ static pl_status do_stream_property(query *q)
 				}
 			}
 
-			int ch = str->ungetch ? str->ungetch : net_getc(str);
+			int ch = str->ungetch ? str->ungetch : stream_getc(str);
 
 			if (str->ungetch)
 				;
@@ -1899,6 +1960,17 @@ static pl_status do_stream_property(query *q)
 		return unify(q, c, q->latest_ctx, &tmp, q->st.curr_frame);
 	}
 
+	if (!slicecmp2(GET_STR(p1), LEN_STR(p1), "port") && !is_variable(pstr)) {
+		int port = net_port(str);
+
+		if (port < 0)
+			return pl_failure;
+
+		cell tmp;
+		make_int(&tmp, port);
+		return unify(q, c, q->latest_ctx, &tmp, q->st.curr_frame);
+	}
+
 	return pl_failure;
 }
 
@@ -1926,7 +1998,7 @@ static void clear_streams_properties(query *q)
 static const char *s_properties =
 	"alias,file_name,mode,encoding,type,line_count,"			\
 	"position,reposition,end_of_stream,eof_action,"				\
-	"input,output,newline";
+	"input,output,newline,port";
 
 static USE_RESULT pl_status fn_iso_stream_property_2(query *q)
 {
@@ -1985,6 +2057,40 @@ static USE_RESULT pl_status fn_iso_stream_property_2(query *q)
 	return pl_success;
 }
 
+#if USE_MMAP
+// Map a file as a static string, skipping offset bytes (a BOM). The
+// mapping is never unmapped as slices of it can end up anywhere.
+
+static bool map_file(int fd, int prot, size_t offset, cell *d)
+{
+	struct stat st = {0};
+
+	if (fstat(fd, &st))
+		return false;
+
+	size_t len = st.st_size;
+
+	if (len <= offset) {
+		make_literal(d, g_nil_s);
+		return true;
+	}
+
+	char *addr = mmap(0, len, prot, MAP_PRIVATE, fd, 0);
+
+	if (addr == MAP_FAILED)
+		return false;
+
+	*d = (cell){0};
+	d->val_type = TYPE_CSTRING;
+	d->flags = FLAG_BLOB | FLAG_STRING | FLAG_STATIC;
+	d->nbr_cells = 1;
+	d->arity = 2;
+	d->val_str = addr + offset;
+	d->str_len = len - offset;
+	return true;
+}
+#endif
+
 static USE_RESULT pl_status fn_iso_open_4(query *q)
 {
 	GET_FIRST_ARG(p1,atom_or_structure);
@@ -2144,7 +2250,7 @@ static USE_RESULT pl_status fn_iso_open_4(query *q)
 	size_t offset = 0;
 
 	if (!strcmp(mode, "read") && !binary && (!bom_specified || use_bom)) {
-		int ch = xgetc_utf8(net_getc, str);
+		int ch = stream_getc_utf8(str);
 
 		if (feof(str->fp))
 			clearerr(str->fp);
@@ -2152,8 +2258,8 @@ static USE_RESULT pl_status fn_iso_open_4(query *q)
 		if ((unsigned)ch == 0xFEFF) {
 			str->bom = true;
 			offset = 3;
-		} else
-			fseek(str->fp, 0, SEEK_SET);
+		} else if (fseek(str->fp, 0, SEEK_SET) && (ch != EOF))
+			str->ungetch = ch;		// a pipe can't seek back
 	} else if (!strcmp(mode, "write") && !binary && use_bom) {
 		int ch = 0xFEFF;
 		char tmpbuf[10];
@@ -2171,18 +2277,11 @@ static USE_RESULT pl_status fn_iso_open_4(query *q)
 		prot = PROT_WRITE;
 
 	if (mmap_var && is_variable(mmap_var)) {
-		int fd = fileno(str->fp);
-		struct stat st = {0};
-		fstat(fd, &st);
-		size_t len = st.st_size;
-		void *addr = mmap(0, len, prot, MAP_PRIVATE, fd, offset);
-		cell tmp = {0};
-		tmp.val_type = TYPE_CSTRING;
-		tmp.flags = FLAG_BLOB | FLAG_STRING | FLAG_STATIC;
-		tmp.nbr_cells = 1;
-		tmp.arity = 2;
-		tmp.val_str = addr;
-		tmp.str_len = len;
+		cell tmp;
+
+		if (!map_file(fileno(str->fp), prot, offset, &tmp))
+			return throw_error(q, p1, "resource_error", "cannot_map_file");
+
 		set_var(q, mmap_var, mmap_ctx, &tmp, q->st.curr_frame);
 	}
 #endif
@@ -2195,6 +2294,8 @@ static USE_RESULT pl_status fn_iso_open_4(query *q)
 	return pl_success;
 }
 
+static void unpark_fd(prolog *pl, int fd);
+
 static USE_RESULT pl_status fn_iso_close_1(query *q)
 {
 	GET_FIRST_ARG(pstr,stream);
@@ -2221,6 +2322,9 @@ static USE_RESULT pl_status fn_iso_close_1(query *q)
 	if (!str->socket)
 		del_stream_properties(q, n);
 
+	if (str->fp)
+		unpark_fd(q->st.m->pl, fileno(str->fp));
+
 	net_close(str);
 	free(str->filename);
 	free(str->mode);
@@ -2273,7 +2377,7 @@ static USE_RESULT pl_status fn_iso_at_end_of_stream_0(query *q)
 	}
 
 	if (!str->socket) {
-		int ch = str->ungetch ? str->ungetch : xgetc_utf8(net_getc, str);
+		int ch = str->ungetch ? str->ungetch : stream_getc_utf8(str);
 		str->ungetch = ch;
 	}
 
@@ -2303,7 +2407,7 @@ static USE_RESULT pl_status fn_iso_at_end_of_stream_1(query *q)
 	}
 
 	if (!str->socket) {
-		int ch = str->ungetch ? str->ungetch : xgetc_utf8(net_getc, str);
+		int ch = str->ungetch ? str->ungetch : stream_getc_utf8(str);
 		str->ungetch = ch;
 	}
 
@@ -2372,21 +2476,21 @@ static bool collect_vars(query *q, cell *p1, idx_t p1_ctx, idx_t nbr_cells, int
 		if (is_structure(c)) {
 			collect_vars(q, c+1, q->latest_ctx, c->nbr_cells-1, depth+1);
 		} else if (is_variable(c)) {
-			for (unsigned idx = 0; idx < q->st.m->pl->tab_idx; idx++) {
-				if ((q->st.m->pl->tab1[idx] == q->latest_ctx) && (q->st.m->pl->tab2[idx] == c->var_nbr)) {
-					q->st.m->pl->tab4[idx]++;
+			for (unsigned idx = 0; idx < g_tabs.tab_idx; idx++) {
+				if ((g_tabs.tab1[idx] == q->latest_ctx) && (g_tabs.tab2[idx] == c->var_nbr)) {
+					g_tabs.tab4[idx]++;
 					found = 1;
 					break;
 				}
 			}
 
 			if (!found) {
-				q->st.m->pl->tab1[q->st.m->pl->tab_idx] = q->latest_ctx;
-				q->st.m->pl->tab2[q->st.m->pl->tab_idx] = c->var_nbr;
-				q->st.m->pl->tab3[q->st.m->pl->tab_idx] = c->val_off;
-				q->st.m->pl->tab4[q->st.m->pl->tab_idx] = 1;
-				q->st.m->pl->tab5[q->st.m->pl->tab_idx] = is_anon(c) ? 1 : 0;
-				q->st.m->pl->tab_idx++;
+				g_tabs.tab1[g_tabs.tab_idx] = q->latest_ctx;
+				g_tabs.tab2[g_tabs.tab_idx] = c->var_nbr;
+				g_tabs.tab3[g_tabs.tab_idx] = c->val_off;
+				g_tabs.tab4[g_tabs.tab_idx] = 1;
+				g_tabs.tab5[g_tabs.tab_idx] = is_anon(c) ? 1 : 0;
+				g_tabs.tab_idx++;
 			}
 		}
 
@@ -2508,7 +2612,7 @@ static pl_status do_read_term(query *q, stream *str, cell *p1, idx_t p1_ctx, cel
 			if (getline(&p->save_line, &p->n_line, str->fp) == -1) {
 				if (q->is_task && !feof(str->fp) && ferror(str->fp)) {
 					clearerr(str->fp);
-					do_yield_0(q, 1);
+					do_yield_fd(q, str, 1);
 					return pl_failure;
 				}
 
@@ -2581,13 +2685,13 @@ static pl_status do_read_term(query *q, stream *str, cell *p1, idx_t p1_ctx, cel
 			return throw_error(q, p1, "resource_error", "too_many_vars");
 	}
 
-	q->st.m->pl->tab_idx = 0;
+	g_tabs.tab_idx = 0;
 
 	if (p->nbr_vars)
 		collect_vars(q, p->t->cells, q->st.curr_frame, p->t->cidx-1, 0);
 
 	if (vars) {
-		unsigned cnt = q->st.m->pl->tab_idx;
+		unsigned cnt = g_tabs.tab_idx;
 		may_ptr_error(init_tmp_heap(q));
 		cell *tmp = alloc_on_tmp(q, (cnt*2)+1);
 		may_ptr_error(tmp);
@@ -2596,13 +2700,13 @@ static pl_status do_read_term(query *q, stream *str, cell *p1, idx_t p1_ctx, cel
 		if (cnt) {
 			unsigned done = 0;
 
-			for (unsigned i = 0; i < q->st.m->pl->tab_idx; i++) {
+			for (unsigned i = 0; i < g_tabs.tab_idx; i++) {
 				make_literal(tmp+idx, g_dot_s);
 				tmp[idx].arity = 2;
 				tmp[idx++].nbr_cells = ((cnt-done)*2)+1;
 				cell v;
-				make_variable(&v, q->st.m->pl->tab3[i]);
-				v.var_nbr = q->st.m->pl->tab2[i];
+				make_variable(&v, g_tabs.tab3[i]);
+				v.var_nbr = g_tabs.tab2[i];
 				tmp[idx++] = v;
 				done++;
 			}
@@ -2631,8 +2735,8 @@ static pl_status do_read_term(query *q, stream *str, cell *p1, idx_t p1_ctx, cel
 		may_ptr_error(tmp);
 		unsigned idx = 0;
 
-		for (unsigned i = 0; i < q->st.m->pl->tab_idx; i++) {
-			if (q->st.m->pl->tab5[i])
+		for (unsigned i = 0; i < g_tabs.tab_idx; i++) {
+			if (g_tabs.tab5[i])
 				continue;
 
 			cnt++;
@@ -2641,8 +2745,8 @@ static pl_status do_read_term(query *q, stream *str, cell *p1, idx_t p1_ctx, cel
 		if (cnt) {
 			unsigned done = 0;
 
-			for (unsigned i = 0; i < q->st.m->pl->tab_idx; i++) {
-				if (q->st.m->pl->tab5[i])
+			for (unsigned i = 0; i < g_tabs.tab_idx; i++) {
+				if (g_tabs.tab5[i])
 					continue;
 
 				make_literal(tmp+idx, g_dot_s);
@@ -2656,10 +2760,10 @@ static pl_status do_read_term(query *q, stream *str, cell *p1, idx_t p1_ctx, cel
 				v.nbr_cells = 3;
 				SET_OP(&v,OP_XFX);
 				tmp[idx++] = v;
-				make_literal(&v, q->st.m->pl->tab3[i]);
+				make_literal(&v, g_tabs.tab3[i]);
 				tmp[idx++] = v;
-				make_variable(&v, q->st.m->pl->tab3[i]);
-				v.var_nbr = q->st.m->pl->tab2[i];
+				make_variable(&v, g_tabs.tab3[i]);
+				v.var_nbr = g_tabs.tab2[i];
 				tmp[idx++] = v;
 				done++;
 			}
@@ -2688,11 +2792,11 @@ static pl_status do_read_term(query *q, stream *str, cell *p1, idx_t p1_ctx, cel
 		may_ptr_error(tmp);
 		unsigned idx = 0;
 
-		for (unsigned i = 0; i < q->st.m->pl->tab_idx; i++) {
-			if (q->st.m->pl->tab4[i] != 1)
+		for (unsigned i = 0; i < g_tabs.tab_idx; i++) {
+			if (g_tabs.tab4[i] != 1)
 				continue;
 
-			if (varnames && (q->st.m->pl->tab5[i]))
+			if (varnames && (g_tabs.tab5[i]))
 				continue;
 
 			cnt++;
@@ -2701,11 +2805,11 @@ static pl_status do_read_term(query *q, stream *str, cell *p1, idx_t p1_ctx, cel
 		if (cnt) {
 			unsigned done = 0;
 
-			for (unsigned i = 0; i < q->st.m->pl->tab_idx; i++) {
-				if (q->st.m->pl->tab4[i] != 1)
+			for (unsigned i = 0; i < g_tabs.tab_idx; i++) {
+				if (g_tabs.tab4[i] != 1)
 					continue;
 
-				if (varnames && (q->st.m->pl->tab5[i]))
+				if (varnames && (g_tabs.tab5[i]))
 					continue;
 
 				make_literal(tmp+idx, g_dot_s);
@@ -2719,10 +2823,10 @@ static pl_status do_read_term(query *q, stream *str, cell *p1, idx_t p1_ctx, cel
 				v.nbr_cells = 3;
 				SET_OP(&v,OP_XFX);
 				tmp[idx++] = v;
-				make_literal(&v, q->st.m->pl->tab3[i]);
+				make_literal(&v, g_tabs.tab3[i]);
 				tmp[idx++] = v;
-				make_variable(&v, q->st.m->pl->tab3[i]);
-				v.var_nbr = q->st.m->pl->tab2[i];
+				make_variable(&v, g_tabs.tab3[i]);
+				v.var_nbr = g_tabs.tab2[i];
 				tmp[idx++] = v;
 				done++;
 			}
@@ -3365,16 +3469,16 @@ static USE_RESULT pl_status fn_iso_get_char_1(query *q)
 		}
 	}
 
-	if (isatty(fileno(str->fp)) && !str->did_getc && !str->ungetch) {
+	if (!str->did_getc && !str->ungetch && isatty(fileno(str->fp))) {
 		printf("| ");
 		fflush(str->fp);
 	}
 
-	int ch = str->ungetch ? str->ungetch : xgetc_utf8(net_getc, str);
+	int ch = str->ungetch ? str->ungetch : stream_getc_utf8(str);
 
 	if (q->is_task && !feof(str->fp) && ferror(str->fp)) {
 		clearerr(str->fp);
-		do_yield_0(q, 1);
+		do_yield_fd(q, str, 1);
 		return pl_failure;
 	}
 
@@ -3435,16 +3539,16 @@ static USE_RESULT pl_status fn_iso_get_char_2(query *q)
 		}
 	}
 
-	if (isatty(fileno(str->fp)) && !str->did_getc && !str->ungetch) {
+	if (!str->did_getc && !str->ungetch && isatty(fileno(str->fp))) {
 		printf("| ");
 		fflush(str->fp);
 	}
 
-	int ch = str->ungetch ? str->ungetch : xgetc_utf8(net_getc, str);
+	int ch = str->ungetch ? str->ungetch : stream_getc_utf8(str);
 
 	if (q->is_task && !feof(str->fp) && ferror(str->fp)) {
 		clearerr(str->fp);
-		do_yield_0(q, 1);
+		do_yield_fd(q, str, 1);
 		return pl_failure;
 	}
 
@@ -3504,16 +3608,16 @@ static USE_RESULT pl_status fn_iso_get_code_1(query *q)
 		}
 	}
 
-	if (isatty(fileno(str->fp)) && !str->did_getc && !str->ungetch) {
+	if (!str->did_getc && !str->ungetch && isatty(fileno(str->fp))) {
 		printf("| ");
 		fflush(str->fp);
 	}
 
-	int ch = str->ungetch ? str->ungetch : xgetc_utf8(net_getc, str);
+	int ch = str->ungetch ? str->ungetch : stream_getc_utf8(str);
 
 	if (q->is_task && !feof(str->fp) && ferror(str->fp)) {
 		clearerr(str->fp);
-		do_yield_0(q, 1);
+		do_yield_fd(q, str, 1);
 		return pl_failure;
 	}
 
@@ -3575,16 +3679,16 @@ static USE_RESULT pl_status fn_iso_get_code_2(query *q)
 		}
 	}
 
-	if (isatty(fileno(str->fp)) && !str->did_getc && !str->ungetch) {
+	if (!str->did_getc && !str->ungetch && isatty(fileno(str->fp))) {
 		printf("| ");
 		fflush(str->fp);
 	}
 
-	int ch = str->ungetch ? str->ungetch : xgetc_utf8(net_getc, str);
+	int ch = str->ungetch ? str->ungetch : stream_getc_utf8(str);
 
 	if (q->is_task && !feof(str->fp) && ferror(str->fp)) {
 		clearerr(str->fp);
-		do_yield_0(q, 1);
+		do_yield_fd(q, str, 1);
 		return pl_failure;
 	}
 
@@ -3639,16 +3743,16 @@ static USE_RESULT pl_status fn_iso_get_byte_1(query *q)
 		}
 	}
 
-	if (isatty(fileno(str->fp)) && !str->did_getc && !str->ungetch) {
+	if (!str->did_getc && !str->ungetch && isatty(fileno(str->fp))) {
 		printf("| ");
 		fflush(str->fp);
 	}
 
-	int ch = str->ungetch ? str->ungetch : net_getc(str);
+	int ch = str->ungetch ? str->ungetch : stream_getc(str);
 
 	if (q->is_task && !feof(str->fp) && ferror(str->fp)) {
 		clearerr(str->fp);
-		do_yield_0(q, 1);
+		do_yield_fd(q, str, 1);
 		return pl_failure;
 	}
 
@@ -3704,16 +3808,16 @@ static USE_RESULT pl_status fn_iso_get_byte_2(query *q)
 		}
 	}
 
-	if (isatty(fileno(str->fp)) && !str->did_getc && !str->ungetch) {
+	if (!str->did_getc && !str->ungetch && isatty(fileno(str->fp))) {
 		printf("| ");
 		fflush(str->fp);
 	}
 
-	int ch = str->ungetch ? str->ungetch : net_getc(str);
+	int ch = str->ungetch ? str->ungetch : stream_getc(str);
 
 	if (q->is_task && !feof(str->fp) && ferror(str->fp)) {
 		clearerr(str->fp);
-		do_yield_0(q, 1);
+		do_yield_fd(q, str, 1);
 		return pl_failure;
 	}
 
@@ -3764,11 +3868,11 @@ static USE_RESULT pl_status fn_iso_peek_char_1(query *q)
 		}
 	}
 
-	int ch = str->ungetch ? str->ungetch : xgetc_utf8(net_getc, str);
+	int ch = str->ungetch ? str->ungetch : stream_getc_utf8(str);
 
 	if (q->is_task && !feof(str->fp) && ferror(str->fp)) {
 		clearerr(str->fp);
-		do_yield_0(q, 1);
+		do_yield_fd(q, str, 1);
 		return pl_failure;
 	}
 
@@ -3820,11 +3924,11 @@ static USE_RESULT pl_status fn_iso_peek_char_2(query *q)
 		}
 	}
 
-	int ch = str->ungetch ? str->ungetch : xgetc_utf8(net_getc, str);
+	int ch = str->ungetch ? str->ungetch : stream_getc_utf8(str);
 
 	if (q->is_task && !feof(str->fp) && ferror(str->fp)) {
 		clearerr(str->fp);
-		do_yield_0(q, 1);
+		do_yield_fd(q, str, 1);
 		return pl_failure;
 	}
 
@@ -3874,11 +3978,11 @@ static USE_RESULT pl_status fn_iso_peek_code_1(query *q)
 		}
 	}
 
-	int ch = str->ungetch ? str->ungetch : xgetc_utf8(net_getc, str);
+	int ch = str->ungetch ? str->ungetch : stream_getc_utf8(str);
 
 	if (q->is_task && !feof(str->fp) && ferror(str->fp)) {
 		clearerr(str->fp);
-		do_yield_0(q, 1);
+		do_yield_fd(q, str, 1);
 		return pl_failure;
 	}
 
@@ -3930,11 +4034,11 @@ static USE_RESULT pl_status fn_iso_peek_code_2(query *q)
 		}
 	}
 
-	int ch = str->ungetch ? str->ungetch : xgetc_utf8(net_getc, str);
+	int ch = str->ungetch ? str->ungetch : stream_getc_utf8(str);
 
 	if (q->is_task && !feof(str->fp) && ferror(str->fp)) {
 		clearerr(str->fp);
-		do_yield_0(q, 1);
+		do_yield_fd(q, str, 1);
 		return pl_failure;
 	}
 
@@ -3979,11 +4083,11 @@ static USE_RESULT pl_status fn_iso_peek_byte_1(query *q)
 		}
 	}
 
-	int ch = str->ungetch ? str->ungetch : net_getc(str);
+	int ch = str->ungetch ? str->ungetch : stream_getc(str);
 
 	if (q->is_task && !feof(str->fp) && ferror(str->fp)) {
 		clearerr(str->fp);
-		do_yield_0(q, 1);
+		do_yield_fd(q, str, 1);
 		return pl_failure;
 	}
 
@@ -4031,11 +4135,11 @@ static USE_RESULT pl_status fn_iso_peek_byte_2(query *q)
 		}
 	}
 
-	int ch = str->ungetch ? str->ungetch : net_getc(str);
+	int ch = str->ungetch ? str->ungetch : stream_getc(str);
 
 	if (q->is_task && !feof(str->fp) && ferror(str->fp)) {
 		clearerr(str->fp);
-		do_yield_0(q, 1);
+		do_yield_fd(q, str, 1);
 		return pl_failure;
 	}
 
@@ -4245,10 +4349,10 @@ static USE_RESULT pl_status fn_iso_univ_2(query *q)
 static cell *do_term_variables(query *q, cell *p1, idx_t p1_ctx)
 {
 	frame *g = GET_CURR_FRAME();
-	q->st.m->pl->varno = g->nbr_vars;
-	q->st.m->pl->tab_idx = 0;
+	g_tabs.varno = g->nbr_vars;
+	g_tabs.tab_idx = 0;
 	collect_vars(q, p1, p1_ctx, p1->nbr_cells, 0);
-	const unsigned cnt = q->st.m->pl->tab_idx;
+	const unsigned cnt = g_tabs.tab_idx;
 	init_tmp_heap(q);
 	cell *tmp = alloc_on_tmp(q, (cnt*2)+1);
 	ensure(tmp);
@@ -4263,13 +4367,13 @@ static cell *do_term_variables(query *q, cell *p1, idx_t p1_ctx)
 			tmp[idx].nbr_cells = ((cnt-done)*2)+1;
 			idx++;
 			cell v;
-			make_variable(&v, q->st.m->pl->tab3[i]);
+			make_variable(&v, g_tabs.tab3[i]);
 
-			if (q->st.m->pl->tab1[i] != q->st.curr_frame) {
+			if (g_tabs.tab1[i] != q->st.curr_frame) {
 				v.flags |= FLAG2_FRESH;
-				v.var_nbr = q->st.m->pl->varno++;
+				v.var_nbr = g_tabs.varno++;
 			} else
-				v.var_nbr = q->st.m->pl->tab2[i];
+				v.var_nbr = g_tabs.tab2[i];
 
 			tmp[idx++] = v;
 			done++;
@@ -4282,8 +4386,8 @@ static cell *do_term_variables(query *q, cell *p1, idx_t p1_ctx)
 		make_literal(tmp, g_nil_s);
 
 	if (cnt) {
-		unsigned new_vars = q->st.m->pl->varno - g->nbr_vars;
-		q->st.m->pl->varno = g->nbr_vars;
+		unsigned new_vars = g_tabs.varno - g->nbr_vars;
+		g_tabs.varno = g->nbr_vars;
 
 		if (new_vars) {
 			if (!create_vars(q, new_vars))
@@ -4291,17 +4395,17 @@ static cell *do_term_variables(query *q, cell *p1, idx_t p1_ctx)
 		}
 
 		for (unsigned i = 0; i < cnt; i++) {
-			if (q->st.m->pl->tab1[i] == q->st.curr_frame)
+			if (g_tabs.tab1[i] == q->st.curr_frame)
 				continue;
 
 			cell v, tmp2;
 			make_variable(&v, g_anon_s);
 			v.flags |= FLAG2_FRESH;
-			v.var_nbr = q->st.m->pl->varno++;
+			v.var_nbr = g_tabs.varno++;
 			make_variable(&tmp2, g_anon_s);
 			tmp2.flags |= FLAG2_FRESH;
-			tmp2.var_nbr = q->st.m->pl->tab2[i];
-			set_var(q, &v, q->st.curr_frame, &tmp2, q->st.m->pl->tab1[i]);
+			tmp2.var_nbr = g_tabs.tab2[i];
+			set_var(q, &v, q->st.curr_frame, &tmp2, g_tabs.tab1[i]);
 		}
 	}
 
@@ -4574,7 +4678,7 @@ static void do_term_assign_vars(parser *p, idx_t nbr_cells)
 	}
 }
 
-static USE_RESULT pl_status fn_iso_asserta_1(query *q)
+static USE_RESULT pl_status do_asserta_1(query *q)
 {
 	GET_FIRST_ARG(p1,callable);
 
@@ -4637,7 +4741,7 @@ static USE_RESULT pl_status fn_iso_asserta_1(query *q)
 	return pl_success;
 }
 
-static USE_RESULT pl_status fn_iso_assertz_1(query *q)
+static USE_RESULT pl_status do_assertz_1(query *q)
 {
 	GET_FIRST_ARG(p1,callable);
 
@@ -4700,6 +4804,25 @@ static USE_RESULT pl_status fn_iso_assertz_1(query *q)
 	return pl_success;
 }
 
+// The module parser is used as scratch space when asserting, so
+// hold the database lock for the whole operation.
+
+static USE_RESULT pl_status fn_iso_asserta_1(query *q)
+{
+	acquire(&q->st.m->pl->db_lock);
+	pl_status ok = do_asserta_1(q);
+	release(&q->st.m->pl->db_lock);
+	return ok;
+}
+
+static USE_RESULT pl_status fn_iso_assertz_1(query *q)
+{
+	acquire(&q->st.m->pl->db_lock);
+	pl_status ok = do_assertz_1(q);
+	release(&q->st.m->pl->db_lock);
+	return ok;
+}
+
 USE_RESULT pl_status fn_call_0(query *q, cell *p1)
 {
 	if (q->retry)
@@ -5063,6 +5186,12 @@ static USE_RESULT bool find_exception_handler(query *q, cell *e)
 	while (retry_choice(q)) {
 		choice *ch = GET_CHOICE(q->cp);
 
+		// Unwinding past a sleep abandons it, so a later sleep
+		// at the same cell must not pick up its wake-up time.
+
+		if (q->cp < q->sleep_cp)
+			q->sleep_until = 0;
+
 		if (!ch->catchme_retry)
 			continue;
 
@@ -5085,6 +5214,7 @@ static USE_RESULT bool find_exception_handler(query *q, cell *e)
 		return true;
 	}
 
+	q->sleep_until = 0;
 	fprintf(stdout, "uncaught exception: ");
 	q->quoted = 1;
 	print_term(q, stdout, e, q->st.curr_frame, 1);
@@ -6400,14 +6530,20 @@ static USE_RESULT pl_status fn_asserta_2(query *q)
 {
 	GET_FIRST_ARG(p1,nonvar);
 	GET_NEXT_ARG(p2,variable);
-	return do_asserta_2(q);
+	acquire(&q->st.m->pl->db_lock);
+	pl_status ok = do_asserta_2(q);
+	release(&q->st.m->pl->db_lock);
+	return ok;
 }
 
 static USE_RESULT pl_status fn_sys_asserta_2(query *q)
 {
 	GET_FIRST_ARG(p1,nonvar);
 	GET_NEXT_ARG(p2,atom);
-	return do_asserta_2(q);
+	acquire(&q->st.m->pl->db_lock);
+	pl_status ok = do_asserta_2(q);
+	release(&q->st.m->pl->db_lock);
+	return ok;
 }
 
 static pl_status do_assertz_2(query *q)
@@ -6498,14 +6634,20 @@ static USE_RESULT pl_status fn_assertz_2(query *q)
 {
 	GET_FIRST_ARG(p1,nonvar);
 	GET_NEXT_ARG(p2,variable);
-	return do_assertz_2(q);
+	acquire(&q->st.m->pl->db_lock);
+	pl_status ok = do_assertz_2(q);
+	release(&q->st.m->pl->db_lock);
+	return ok;
 }
 
 static USE_RESULT pl_status fn_sys_assertz_2(query *q)
 {
 	GET_FIRST_ARG(p1,nonvar);
 	GET_NEXT_ARG(p2,atom);
-	return do_assertz_2(q);
+	acquire(&q->st.m->pl->db_lock);
+	pl_status ok = do_assertz_2(q);
+	release(&q->st.m->pl->db_lock);
+	return ok;
 }
 
 static void save_db(FILE *fp, query *q, int logging)
@@ -6640,6 +6782,12 @@ static USE_RESULT pl_status fn_statistics_0(__attribute__((unused)) query *q)
 	return pl_success;
 }
 
+static USE_RESULT pl_status fn_garbage_collect_atoms_0(query *q)
+{
+	may_error(collect_atoms(q));
+	return pl_success;
+}
+
 static USE_RESULT pl_status fn_statistics_2(query *q)
 {
 	GET_FIRST_ARG(p1,atom);
@@ -6656,7 +6804,7 @@ static USE_RESULT pl_status fn_statistics_2(query *q)
 
 	if (!slicecmp2(GET_STR(p1), LEN_STR(p1), "gctime") && is_variable(p2)) {
 		cell tmp;
-		make_float(&tmp, 0);
+		make_float(&tmp, (double)q->gc_time/1000/1000);
 		set_var(q, p2, p2_ctx, &tmp, q->st.curr_frame);
 		return pl_success;
 	}
@@ -6674,7 +6822,117 @@ static USE_RESULT pl_status fn_statistics_2(query *q)
 		return unify(q, p2, p2_ctx, l, q->st.curr_frame);
 	}
 
-	return pl_failure;
+	if (!slicecmp2(GET_STR(p1), LEN_STR(p1), "atoms") && is_variable(p2)) {
+		cell tmp;
+		make_int(&tmp, q->st.m->pl->symtab_count);
+		set_var(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+		return pl_success;
+	}
+
+	if (!slicecmp2(GET_STR(p1), LEN_STR(p1), "atom_space") && is_variable(p2)) {
+		cell tmp;
+		make_int(&tmp, q->st.m->pl->pool_offset);
+		set_var(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+		return pl_success;
+	}
+
+	// Symbol table: [Used, Capacity] in entries...
+
+	if (!slicecmp2(GET_STR(p1), LEN_STR(p1), "symtab")) {
+		cell tmp;
+		make_int(&tmp, q->st.m->pl->symtab_count);
+		allocate_list(q, &tmp);
+		make_int(&tmp, q->st.m->pl->symtab_size);
+		append_list(q, &tmp);
+		cell *l = end_list(q);
+		may_ptr_error(l);
+		return unify(q, p2, p2_ctx, l, q->st.curr_frame);
+	}
+
+	// Atom GC: [Collections, AtomsFreed]...
+
+	if (!slicecmp2(GET_STR(p1), LEN_STR(p1), "atom_gc")) {
+		cell tmp;
+		make_int(&tmp, q->st.m->pl->tot_atom_gcs);
+		allocate_list(q, &tmp);
+		make_int(&tmp, q->st.m->pl->tot_atoms_freed);
+		append_list(q, &tmp);
+		cell *l = end_list(q);
+		may_ptr_error(l);
+		return unify(q, p2, p2_ctx, l, q->st.curr_frame);
+	}
+
+	// Tasks: [Slices, BusyMsecs, IdleMsecs] for the scheduler...
+
+	if (!slicecmp2(GET_STR(p1), LEN_STR(p1), "tasks")) {
+		scheduler *s = &q->st.m->sched;
+		cell tmp;
+		make_int(&tmp, s->slices);
+		allocate_list(q, &tmp);
+		make_int(&tmp, s->busy_usec / 1000);
+		append_list(q, &tmp);
+		make_int(&tmp, s->idle_usec / 1000);
+		append_list(q, &tmp);
+		cell *l = end_list(q);
+		may_ptr_error(l);
+		return unify(q, p2, p2_ctx, l, q->st.curr_frame);
+	}
+
+	// Stacks: [Allocated, PeakAllocated] in entries...
+
+	idx_t size, peak;
+
+	if (!slicecmp2(GET_STR(p1), LEN_STR(p1), "frames")) {
+		size = q->frames_size; peak = q->peak_frames_size;
+	} else if (!slicecmp2(GET_STR(p1), LEN_STR(p1), "slots")) {
+		size = q->slots_size; peak = q->peak_slots_size;
+	} else if (!slicecmp2(GET_STR(p1), LEN_STR(p1), "choices")) {
+		size = q->choices_size; peak = q->peak_choices_size;
+	} else if (!slicecmp2(GET_STR(p1), LEN_STR(p1), "trails")) {
+		size = q->trails_size; peak = q->peak_trails_size;
+	} else
+		return pl_failure;
+
+	cell tmp;
+	make_int(&tmp, size);
+	allocate_list(q, &tmp);
+	make_int(&tmp, peak);
+	append_list(q, &tmp);
+	make_literal(&tmp, g_nil_s);
+	cell *l = end_list(q);
+	may_ptr_error(l);
+	return unify(q, p2, p2_ctx, l, q->st.curr_frame);
+}
+
+// Sleep, running any alarms that fall due on the way. The alarm hook
+// returns to the sleeping goal, which picks up the original wake-up
+// time and sleeps for the rest. An alarm that throws out of the sleep
+// drops the wake-up time (see find_exception_handler).
+
+static pl_status do_sleep(query *q, int_t msecs)
+{
+	uint64_t now = get_time_in_usec() / 1000, due;
+	uint64_t wake = now + (msecs > 0 ? msecs : 0);
+
+	if (q->sleep_until && (q->sleep_cell == q->st.curr_cell))
+		wake = q->sleep_until;
+
+	q->sleep_until = 0;
+
+	if (next_alarm_due(q, &due) && (due < wake)) {
+		if (due > now)
+			msleep(due - now);
+
+		q->sleep_until = wake;
+		q->sleep_cell = q->st.curr_cell;
+		q->sleep_cp = q->cp;
+		return do_alarm_hook(q, q->st.curr_cell);
+	}
+
+	if (wake > now)
+		msleep(wake - now);
+
+	return pl_success;
 }
 
 static USE_RESULT pl_status fn_sleep_1(query *q)
@@ -6689,8 +6947,7 @@ static USE_RESULT pl_status fn_sleep_1(query *q)
 		return pl_failure;
 	}
 
-	sleep((unsigned)p1->val_num);
-	return pl_success;
+	return do_sleep(q, p1->val_num*1000);
 }
 
 static USE_RESULT pl_status fn_delay_1(query *q)
@@ -6705,8 +6962,7 @@ static USE_RESULT pl_status fn_delay_1(query *q)
 		return pl_failure;
 	}
 
-	msleep((unsigned)p1->val_num);
-	return pl_success;
+	return do_sleep(q, p1->val_num);
 }
 
 static USE_RESULT pl_status fn_busy_1(query *q)
@@ -6838,20 +7094,20 @@ static USE_RESULT pl_status fn_split_atom_4(query *q)
 	GET_NEXT_ARG(p2,atom);
 	GET_NEXT_ARG(p3,atom);
 	GET_NEXT_ARG(p4,any);
-	const char *src = GET_STR(p1);
+	const char *start = GET_STR(p1), *ptr;
+	const char *end = start + LEN_STR(p1);
 	int ch = peek_char_utf8(GET_STR(p2));
 	int pad = peek_char_utf8(GET_STR(p3));
-	const char *start = src, *ptr;
 	cell *l = NULL;
 	int nbr = 1, in_list = 0;
 
-	if (!*start) {
+	if (start == end) {
 		cell tmp;
 		make_literal(&tmp, g_nil_s);
 		return unify(q, p4, p4_ctx, &tmp, q->st.curr_frame);
 	}
 
-	while ((ptr = strchr_utf8(start, ch)) != NULL) {
+	while ((ptr = memchr_utf8(start, ch, end-start)) != NULL) {
 		while ((peek_char_utf8(start) == pad) && (pad != ch))
 			get_char_utf8(&start);
 
@@ -6867,12 +7123,12 @@ static USE_RESULT pl_status fn_split_atom_4(query *q)
 		in_list = 1;
 	}
 
-	if (*start) {
-		while (peek_char_utf8(start) == pad)
+	if (start < end) {
+		while ((start < end) && (peek_char_utf8(start) == pad))
 			get_char_utf8(&start);
 
 		cell tmp;
-		may_error(make_cstring(&tmp, start));
+		may_error(make_cstringn(&tmp, start, end-start));
 
 		if (!in_list)
 			allocate_list(q, &tmp);
@@ -6903,16 +7159,22 @@ static USE_RESULT pl_status fn_split_4(query *q)
 		return unify(q, p4, p4_ctx, &tmp, q->st.curr_frame);
 	}
 
+	// A static string (an mmap'd file) isn't NULL-terminated and is
+	// split into slices of itself rather than copies.
+
 	const char *start = GET_STR(p1), *ptr;
+	const char *end = start + LEN_STR(p1);
 	int ch = peek_char_utf8(GET_STR(p2));
 
-	if ((ptr = strchr_utf8(start, ch)) != NULL) {
+	if ((ptr = memchr_utf8(start, ch, end-start)) != NULL) {
 		cell tmp;
 
-		if (ptr != start)
-			may_error(make_stringn(&tmp, start, ptr-start));
-		else
+		if (ptr == start)
 			make_literal(&tmp, g_nil_s);
+		else if (is_static(p1))
+			make_static_slice(&tmp, p1, 0, ptr-start);
+		else
+			may_error(make_stringn(&tmp, start, ptr-start));
 
 		if (!unify(q, p3, p3_ctx, &tmp, q->st.curr_frame)) {
 			unshare_cell(&tmp);
@@ -6920,15 +7182,17 @@ static USE_RESULT pl_status fn_split_4(query *q)
 		}
 
 		unshare_cell(&tmp);
-		ptr = ptr+1;
+		ptr += len_char_utf8(ptr);
 
-		while (iswspace(*ptr))
+		while ((ptr < end) && iswspace(*ptr))
 			ptr++;
 
-		if (*ptr)
-			may_error(make_stringn(&tmp, ptr, LEN_STR(p1)-(ptr-start)));
-		else
+		if (ptr == end)
 			make_literal(&tmp, g_nil_s);
+		else if (is_static(p1))
+			make_static_slice(&tmp, p1, ptr-start, end-ptr);
+		else
+			may_error(make_stringn(&tmp, ptr, end-ptr));
 
 		pl_status ok = unify(q, p4, p4_ctx, &tmp, q->st.curr_frame);
 		unshare_cell(&tmp);
@@ -6958,7 +7222,9 @@ static USE_RESULT pl_status fn_savefile_2(query *q)
 
 		src = chars_list_to_string(q, p1, p1_ctx, len);
 		filename = src;
-	} else
+	} else if (is_blob(p1))
+		filename = src = slicedup(GET_STR(p1), LEN_STR(p1));
+	else
 		filename = GET_STR(p1);
 
 	FILE *fp = fopen(filename, "wb");
@@ -6969,7 +7235,7 @@ static USE_RESULT pl_status fn_savefile_2(query *q)
 	return pl_success;
 }
 
-static USE_RESULT pl_status fn_loadfile_2(query *q)
+static USE_RESULT pl_status do_loadfile(query *q, bool use_mmap)
 {
 	GET_FIRST_ARG(p1,atom_or_list);
 	GET_NEXT_ARG(p2,variable);
@@ -6984,7 +7250,9 @@ static USE_RESULT pl_status fn_loadfile_2(query *q)
 
 		src = chars_list_to_string(q, p1, p1_ctx, len);
 		filename = src;
-	} else
+	} else if (is_blob(p1))
+		filename = src = slicedup(GET_STR(p1), LEN_STR(p1));
+	else
 		filename = GET_STR(p1);
 
 	FILE *fp = fopen(filename, "rb");
@@ -7002,6 +7270,20 @@ static USE_RESULT pl_status fn_loadfile_2(query *q)
 	else
 		offset = 3;
 
+#if USE_MMAP
+	if (use_mmap) {
+		cell tmp;
+		bool ok = map_file(fileno(fp), PROT_READ, offset, &tmp);
+		fclose(fp);
+
+		if (!ok)
+			return throw_error(q, p1, "resource_error", "cannot_map_file");
+
+		set_var(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+		return pl_success;
+	}
+#endif
+
 	struct stat st = {0};
 
 	if (fstat(fileno(fp), &st)) {
@@ -7018,7 +7300,7 @@ static USE_RESULT pl_status fn_loadfile_2(query *q)
 		return throw_error(q, p1, "domain_error", "cannot_read");
 	}
 
-	s[st.st_size] = '\0';
+	s[len] = '\0';
 	fclose(fp);
 	cell tmp;
 	may_error(make_stringn(&tmp, s, len), free(s));
@@ -7028,6 +7310,46 @@ static USE_RESULT pl_status fn_loadfile_2(query *q)
 	return pl_success;
 }
 
+static USE_RESULT pl_status fn_loadfile_2(query *q)
+{
+	return do_loadfile(q, false);
+}
+
+static USE_RESULT pl_status fn_loadfile_3(query *q)
+{
+	GET_FIRST_ARG(p1,atom_or_list);
+	GET_NEXT_ARG(p2,variable);
+	GET_NEXT_ARG(p3,list_or_nil);
+	bool use_mmap = false;
+	LIST_HANDLER(p3);
+
+	while (is_list(p3)) {
+		cell *h = LIST_HEAD(p3);
+		cell *c = deref(q, h, p3_ctx);
+
+		if (is_variable(c))
+			return throw_error(q, c, "instantiation_error", "args_not_sufficiently_instantiated");
+
+		if (!is_structure(c) || (c->arity != 1) || slicecmp2(GET_STR(c), LEN_STR(c), "mmap"))
+			return throw_error(q, c, "domain_error", "loadfile_option");
+
+		cell *name = deref(q, c+1, q->latest_ctx);
+
+		if (is_atom(name) && !slicecmp2(GET_STR(name), LEN_STR(name), "true"))
+			use_mmap = true;
+		else if (is_atom(name) && !slicecmp2(GET_STR(name), LEN_STR(name), "false"))
+			use_mmap = false;
+		else
+			return throw_error(q, c, "domain_error", "loadfile_option");
+
+		p3 = LIST_TAIL(p3);
+		p3 = deref(q, p3, p3_ctx);
+		p3_ctx = q->latest_ctx;
+	}
+
+	return do_loadfile(q, use_mmap);
+}
+
 static USE_RESULT pl_status fn_getfile_2(query *q)
 {
 	GET_FIRST_ARG(p1,atom_or_list);
@@ -7044,7 +7366,9 @@ static USE_RESULT pl_status fn_getfile_2(query *q)
 		src = chars_list_to_string(q, p1, p1_ctx, len);
 		may_ptr_error(src);
 		filename = src;
-	} else
+	} else if (is_blob(p1))
+		filename = src = slicedup(GET_STR(p1), LEN_STR(p1));
+	else
 		filename = GET_STR(p1);
 
 	FILE *fp = fopen(filename, "r");
@@ -7256,7 +7580,7 @@ static USE_RESULT pl_status fn_accept_2(query *q)
 
 	if (fd == -1) {
 		if (q->is_task) {
-			do_yield_0(q, 10);
+			do_yield_fd(q, str, 10);
 			return pl_failure;
 		}
 
@@ -7513,7 +7837,7 @@ static USE_RESULT pl_status fn_getline_2(query *q)
 
 		if (q->is_task && !feof(str->fp) && ferror(str->fp)) {
 			clearerr(str->fp);
-			do_yield_0(q, 1);
+			do_yield_fd(q, str, 1);
 			return pl_failure;
 		}
 
@@ -7572,7 +7896,7 @@ static USE_RESULT pl_status fn_bread_3(query *q)
 
 			if (q->is_task) {
 				clearerr(str->fp);
-				do_yield_0(q, 1);
+				do_yield_fd(q, str, 1);
 				return pl_failure;
 			}
 		}
@@ -7799,7 +8123,10 @@ static USE_RESULT pl_status fn_write_term_to_chars_3(query *q)
 	while (is_list(p2)) {
 		cell *h = LIST_HEAD(p2);
 		cell *c = deref(q, h, p2_ctx);
-		parse_write_params(q, c, NULL, NULL);
+
+		if (!parse_write_params(q, c, NULL, NULL))
+			return pl_success;
+
 		p2 = LIST_TAIL(p2);
 		p2 = deref(q, p2, p2_ctx);
 		p2_ctx = q->latest_ctx;
@@ -7828,7 +8155,10 @@ static USE_RESULT pl_status fn_write_canonical_to_chars_3(query *q)
 	while (is_list(p2)) {
 		cell *h = LIST_HEAD(p2);
 		cell *c = deref(q, h, p2_ctx);
-		parse_write_params(q, c, NULL, NULL);
+
+		if (!parse_write_params(q, c, NULL, NULL))
+			return pl_success;
+
 		p2 = LIST_TAIL(p2);
 		p2 = deref(q, p2, p2_ctx);
 		p2_ctx = q->latest_ctx;
@@ -7946,116 +8276,351 @@ static USE_RESULT pl_status fn_is_stream_1(query *q)
 	return is_stream(p1);
 }
 
-static void push_task(module *m, query *task)
+static void queue_push(task_queue *tq, query *task)
 {
-	task->next = m->tasks;
+	if (tq->cnt == tq->size) {
+		unsigned size = tq->size ? tq->size * 2 : 16;
+		query **tasks = malloc(sizeof(query*)*size);
+		ensure(tasks);
 
-	if (m->tasks)
-		m->tasks->prev = task;
+		for (unsigned i = 0; i < tq->cnt; i++)
+			tasks[i] = tq->tasks[(tq->head+i) % tq->size];
 
-	m->tasks = task;
+		free(tq->tasks);
+		tq->tasks = tasks;
+		tq->size = size;
+		tq->head = 0;
+	}
+
+	tq->tasks[(tq->head+tq->cnt++) % tq->size] = task;
 }
 
-static query *pop_task(module *m, query *task)
+static query *queue_pop(task_queue *tq)
 {
-	if (task->prev)
-		task->prev->next = task->next;
-
-	if (task->next)
-		task->next->prev = task->prev;
-
-	if (task == m->tasks)
-		m->tasks = task->next;
+	if (!tq->cnt)
+		return NULL;
 
-	return task->next;
+	query *task = tq->tasks[tq->head];
+	tq->head = (tq->head + 1) % tq->size;
+	tq->cnt--;
+	return task;
 }
 
-static USE_RESULT pl_status fn_wait_0(query *q)
+static void timer_push(scheduler *s, query *task)
 {
-	while (!g_tpl_interrupt && q->st.m->tasks) {
-		uint_t now = get_time_in_usec() / 1000;
-		query *task = q->st.m->tasks;
-		unsigned did_something = 0, spawn_cnt = 0;
-
-		while (!g_tpl_interrupt && task) {
-			if (task->spawned) {
-				spawn_cnt++;
-
-				if (spawn_cnt >= g_cpu_count)
-					break;
-			}
-
-			if (task->tmo_msecs) {
-				if (now <= task->tmo_msecs) {
-					task = task->next;
-					continue;
-				}
-
-				task->tmo_msecs = 0;
-			}
+	if (s->timers_cnt == s->timers_size) {
+		s->timers_size = s->timers_size ? s->timers_size * 2 : 16;
+		s->timers = realloc(s->timers, sizeof(query*)*s->timers_size);
+		ensure(s->timers);
+	}
 
-			if (!task->yielded || !task->st.curr_cell) {
-				query *save = task;
-				task = pop_task(q->st.m, task);
-				destroy_query(save);
-				continue;
-			}
+	unsigned i = s->timers_cnt++;
 
-			DISCARD_RESULT start(task);
+	while (i) {
+		unsigned parent = (i - 1) / 2;
 
-			task = task->next;
-			did_something = 1;
-		}
+		if (s->timers[parent]->tmo_msecs <= task->tmo_msecs)
+			break;
 
-		if (!did_something)
-			msleep(1);
+		s->timers[i] = s->timers[parent];
+		i = parent;
 	}
 
-	return pl_success;
+	s->timers[i] = task;
 }
 
-static USE_RESULT pl_status fn_await_0(query *q)
+static query *timer_pop(scheduler *s)
 {
-	while (!g_tpl_interrupt && q->st.m->tasks) {
-		uint_t now = get_time_in_usec() / 1000;
-		query *task = q->st.m->tasks;
-		unsigned did_something = 0, spawn_cnt = 0;
+	query *task = s->timers[0];
+	query *last = s->timers[--s->timers_cnt];
+	unsigned i = 0;
 
-		while (!g_tpl_interrupt && task) {
-			if (task->spawned) {
-				spawn_cnt++;
+	while (true) {
+		unsigned child = (i * 2) + 1;
 
-				if (spawn_cnt >= g_cpu_count)
-					break;
-			}
+		if (child >= s->timers_cnt)
+			break;
 
-			if (task->tmo_msecs) {
-				if (now <= task->tmo_msecs) {
-					task = task->next;
-					continue;
-				}
+		if (((child + 1) < s->timers_cnt)
+			&& (s->timers[child+1]->tmo_msecs < s->timers[child]->tmo_msecs))
+			child++;
 
-				task->tmo_msecs = 0;
-			}
+		if (last->tmo_msecs <= s->timers[child]->tmo_msecs)
+			break;
 
-			if (!task->yielded || !q->st.curr_cell) {
-				query *save = task;
-				task = pop_task(q->st.m, task);
-				destroy_query(save);
-				continue;
-			}
+		s->timers[i] = s->timers[child];
+		i = child;
+	}
 
-			DISCARD_RESULT start(task);
+	if (s->timers_cnt)
+		s->timers[i] = last;
 
-			if (!task->tmo_msecs && task->yielded) {
-				did_something = 1;
-				break;
-			}
+	return task;
+}
+
+// At most g_cpu_count spawned tasks are runnable at once, the rest
+// wait their turn.
+
+static void schedule_task(module *m, query *task)
+{
+	scheduler *s = &m->sched;
+
+	if (task->spawned) {
+		if (s->nbr_spawned >= g_cpu_count) {
+			queue_push(&s->pending, task);
+			return;
+		}
+
+		s->nbr_spawned++;
+	}
+
+	queue_push(&s->ready, task);
+}
+
+static void push_task(module *m, query *task)
+{
+	task->next = m->tasks;
+
+	if (m->tasks)
+		m->tasks->prev = task;
+
+	m->tasks = task;
+	schedule_task(m, task);
+}
+
+static void pop_task(module *m, query *task)
+{
+	if (task->prev)
+		task->prev->next = task->next;
+
+	if (task->next)
+		task->next->prev = task->prev;
+
+	if (task == m->tasks)
+		m->tasks = task->next;
+
+	scheduler *s = &m->sched;
+
+	if (task->spawned) {
+		s->nbr_spawned--;
+
+		if (s->pending.cnt)
+			schedule_task(m, queue_pop(&s->pending));
+	}
+
+	destroy_query(task);
+}
+
+// Park a task on the epoll set until its fd is readable. Returns
+// false if the fd can't be polled (e.g. a regular file).
+
+static bool park_task(scheduler *s, query *task)
+{
+#ifdef __linux__
+	int fd = task->wait_fd;
+
+	if (!s->has_epoll) {
+		s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+		if (s->epoll_fd == -1)
+			return false;
+
+		s->has_epoll = true;
+	}
+
+	if ((unsigned)fd >= s->waiters_size) {
+		unsigned size = s->waiters_size ? s->waiters_size : 64;
+
+		while (size <= (unsigned)fd)
+			size *= 2;
+
+		query **waiters = realloc(s->waiters, sizeof(query*)*size);
+		ensure(waiters);
+		memset(waiters+s->waiters_size, 0, sizeof(query*)*(size-s->waiters_size));
+		s->waiters = waiters;
+		s->waiters_size = size;
+	}
+
+	// One-shot leaves the fd registered but disarmed after it fires,
+	// so re-arm it with a modify, adding it the first time round...
+
+	if (!s->waiters[fd]) {
+		struct epoll_event ev = {0};
+		ev.events = EPOLLIN | EPOLLONESHOT;
+		ev.data.fd = fd;
+
+		if (epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+			if ((errno != ENOENT)
+				|| (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1))
+				return false;
+		}
+	}
+
+	task->next_waiter = s->waiters[fd];
+	s->waiters[fd] = task;
+	s->nbr_parked++;
+	return true;
+#else
+	(void) s;
+	(void) task;
+	return false;
+#endif
+}
+
+// Wait for parked tasks to become readable, or for the timeout (in
+// msecs, -1 for none) to expire, moving woken tasks to the ready queue.
+// All the tasks waiting on an fd are woken, any that lose the race
+// for the data just park again.
+
+static void wake_waiters(scheduler *s, int fd)
+{
+	query *task = s->waiters[fd];
+	s->waiters[fd] = NULL;
+
+	while (task) {
+		query *next = task->next_waiter;
+		task->next_waiter = NULL;
+		task->wait_io = false;
+		task->tmo_msecs = 0;
+		s->nbr_parked--;
+		queue_push(&s->ready, task);
+		task = next;
+	}
+}
+
+static void wait_parked(scheduler *s, int timeout)
+{
+#ifdef __linux__
+	struct epoll_event events[64];
+	int cnt = epoll_wait(s->epoll_fd, events, sizeof(events)/sizeof(events[0]), timeout);
+
+	for (int i = 0; i < cnt; i++)
+		wake_waiters(s, events[i].data.fd);
+#else
+	(void) s;
+	(void) timeout;
+#endif
+}
+
+// Closing an fd silently drops it from the epoll set, so take it out
+// first and let any tasks parked on it run (their read then fails).
+
+static void unpark_fd(prolog *pl, int fd)
+{
+#ifdef __linux__
+	for (module *m = pl->modules; m; m = m->next) {
+		scheduler *s = &m->sched;
+
+		if (!s->has_epoll || ((unsigned)fd >= s->waiters_size) || !s->waiters[fd])
+			continue;
+
+		epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+		wake_waiters(s, fd);
+	}
+#else
+	(void) pl;
+	(void) fd;
+#endif
+}
+
+// Get the next task to run, sleeping until the earliest timer is due
+// or a parked task is readable if nothing is ready. Returns NULL when
+// there are no tasks left.
+
+static query *next_task(query *q)
+{
+	module *m = q->st.m;
+	scheduler *s = &m->sched;
+
+	while (!g_tpl_interrupt) {
+		uint64_t now = get_time_in_usec() / 1000;
+
+		while (s->timers_cnt && (s->timers[0]->tmo_msecs <= now)) {
+			query *task = timer_pop(s);
+			task->tmo_msecs = 0;
+			queue_push(&s->ready, task);
 		}
 
-		if (!did_something)
-			msleep(1);
+		if (s->ready.cnt)
+			return queue_pop(&s->ready);
+
+		if (!s->timers_cnt && !s->nbr_parked)
+			return NULL;
+
+		uint64_t started = get_time_in_usec();
+
+		if (s->nbr_parked)
+			wait_parked(s, s->timers_cnt ? (int)(s->timers[0]->tmo_msecs - now) : -1);
 		else
+			msleep(s->timers[0]->tmo_msecs - now);
+
+		s->idle_usec += get_time_in_usec() - started;
+	}
+
+	return NULL;
+}
+
+// Run a task for one slice. Returns false if it has finished.
+
+static bool run_task(query *q, query *task)
+{
+	module *m = q->st.m;
+	scheduler *s = &m->sched;
+	uint64_t started = get_time_in_usec();
+	DISCARD_RESULT start(task);
+	s->busy_usec += get_time_in_usec() - started;
+	s->slices++;
+
+	if (!task->yielded || !task->st.curr_cell) {
+		pop_task(m, task);
+		return false;
+	}
+
+	if (task->wait_io) {
+		if (park_task(s, task))
+			return true;
+
+		task->wait_io = false;
+	}
+
+	if (task->tmo_msecs)
+		timer_push(s, task);
+	else
+		queue_push(&s->ready, task);
+
+	return true;
+}
+
+static USE_RESULT pl_status fn_wait_0(query *q)
+{
+	query *task;
+
+	while ((task = next_task(q)) != NULL) {
+		if (!task->yielded || !task->st.curr_cell) {
+			pop_task(q->st.m, task);
+			continue;
+		}
+
+		run_task(q, task);
+	}
+
+	return pl_success;
+}
+
+// Run tasks until one yields without sleeping (i.e. it has sent a
+// message), or until they have all finished.
+
+static USE_RESULT pl_status fn_await_0(query *q)
+{
+	query *task;
+
+	while ((task = next_task(q)) != NULL) {
+		if (!task->yielded || !task->st.curr_cell) {
+			pop_task(q->st.m, task);
+			continue;
+		}
+
+		if (run_task(q, task) && !task->tmo_msecs && !task->wait_io)
 			break;
 	}
 
@@ -8268,7 +8833,9 @@ static USE_RESULT pl_status fn_absolute_file_name_3(query *q)
 
 		src = chars_list_to_string(q, p1, p1_ctx, len);
 		filename = src;
-	} else
+	} else if (is_blob(p1))
+		filename = src = slicedup(GET_STR(p1), LEN_STR(p1));
+	else
 		filename = GET_STR(p1);
 
 	LIST_HANDLER(p_opts);
@@ -8673,7 +9240,7 @@ static pl_status do_format(query *q, cell *str, idx_t str_ctx, cell* p1, cell* p
 			else
 				len = print_term_to_buf(q, NULL, 0, c, c_ctx, 1, false, 0);
 
-			while (nbytes < len) {
+			while (nbytes <= len) {
 				size_t save = dst - tmpbuf;
 				tmpbuf = realloc(tmpbuf, bufsiz*=2);
 				may_ptr_error(tmpbuf);
@@ -8906,16 +9473,19 @@ static char *url_encode(const char *src, int len, char *dstbuf)
 	return dstbuf;
 }
 
-char *url_decode(const char *src, char *dstbuf)
+char *url_decode(const char *src, int len, char *dstbuf)
 {
 	char *dst = dstbuf;
+	const char *end = src + len;
 
-	while (*src) {
+	while (src < end) {
 		if (*src == '%') {
 			src++;
 			unsigned ch = 0;
-			sscanf(src, "%02X", &ch);
-			src += 2;
+
+			for (int i = 0; (i < 2) && (src < end) && isxdigit(*src); i++, src++)
+				ch = (ch * 16) + (isdigit(*src) ? *src - '0' : (toupper(*src) - 'A' + 10));
+
 			*dst++ = (unsigned char)ch;
 		} else if (*src == '+') {
 			*dst++ = ' ';
@@ -8958,7 +9528,7 @@ static pl_status do_urldecode_2(query *q)
 	size_t len = LEN_STR(p2);
 	char *dstbuf = malloc(len+1);
 	may_ptr_error(dstbuf);
-	url_decode(str, dstbuf);
+	url_decode(str, len, dstbuf);
 	cell tmp;
 
 	if (is_string(p1))
@@ -9106,7 +9676,9 @@ static USE_RESULT pl_status fn_access_file_2(query *q)
 
 		src = chars_list_to_string(q, p1, p1_ctx, len);
 		filename = src;
-	} else
+	} else if (is_blob(p1))
+		filename = src = slicedup(GET_STR(p1), LEN_STR(p1));
+	else
 		filename = GET_STR(p1);
 
 	const char *mode = GET_STR(p2);
@@ -9158,7 +9730,9 @@ static USE_RESULT pl_status fn_exists_file_1(query *q)
 
 		src = chars_list_to_string(q, p1, p1_ctx, len);
 		filename = src;
-	} else
+	} else if (is_blob(p1))
+		filename = src = slicedup(GET_STR(p1), LEN_STR(p1));
+	else
 		filename = GET_STR(p1);
 
 	struct stat st = {0};
@@ -9191,7 +9765,9 @@ static USE_RESULT pl_status fn_directory_files_2(query *q)
 
 		src = chars_list_to_string(q, p1, p1_ctx, len);
 		filename = src;
-	} else
+	} else if (is_blob(p1))
+		filename = src = slicedup(GET_STR(p1), LEN_STR(p1));
+	else
 		filename = GET_STR(p1);
 
 	struct stat st = {0};
@@ -9248,7 +9824,9 @@ static USE_RESULT pl_status fn_delete_file_1(query *q)
 
 		src = chars_list_to_string(q, p1, p1_ctx, len);
 		filename = src;
-	} else
+	} else if (is_blob(p1))
+		filename = src = slicedup(GET_STR(p1), LEN_STR(p1));
+	else
 		filename = GET_STR(p1);
 
 	struct stat st = {0};
@@ -9321,7 +9899,9 @@ static USE_RESULT pl_status fn_time_file_2(query *q)
 
 		src = chars_list_to_string(q, p1, p1_ctx, len);
 		filename = src;
-	} else
+	} else if (is_blob(p1))
+		filename = src = slicedup(GET_STR(p1), LEN_STR(p1));
+	else
 		filename = GET_STR(p1);
 
 	struct stat st = {0};
@@ -9352,7 +9932,9 @@ static USE_RESULT pl_status fn_size_file_2(query *q)
 
 		src = chars_list_to_string(q, p1, p1_ctx, len);
 		filename = src;
-	} else
+	} else if (is_blob(p1))
+		filename = src = slicedup(GET_STR(p1), LEN_STR(p1));
+	else
 		filename = GET_STR(p1);
 
 	struct stat st = {0};
@@ -9382,7 +9964,9 @@ static USE_RESULT pl_status fn_exists_directory_1(query *q)
 
 		src = chars_list_to_string(q, p1, p1_ctx, len);
 		filename = src;
-	} else
+	} else if (is_blob(p1))
+		filename = src = slicedup(GET_STR(p1), LEN_STR(p1));
+	else
 		filename = GET_STR(p1);
 
 	struct stat st = {0};
@@ -9414,7 +9998,9 @@ static USE_RESULT pl_status fn_make_directory_1(query *q)
 
 		src = chars_list_to_string(q, p1, p1_ctx, len);
 		filename = src;
-	} else
+	} else if (is_blob(p1))
+		filename = src = slicedup(GET_STR(p1), LEN_STR(p1));
+	else
 		filename = GET_STR(p1);
 
 	struct stat st = {0};
@@ -9530,7 +10116,9 @@ static USE_RESULT pl_status fn_chdir_1(query *q)
 		size_t len = scan_is_chars_list(q, p1, p1_ctx, true);
 		src = chars_list_to_string(q, p1, p1_ctx, len);
 		filename = src;
-	} else
+	} else if (is_blob(p1))
+		filename = src = slicedup(GET_STR(p1), LEN_STR(p1));
+	else
 		filename = GET_STR(p1);
 
 	pl_status ok = !chdir(filename);
@@ -9544,14 +10132,14 @@ static USE_RESULT pl_status fn_edin_skip_1(query *q)
 	int n = q->st.m->pl->current_input;
 	stream *str = &g_streams[n];
 
-	if (isatty(fileno(str->fp)) && !str->did_getc && !str->ungetch) {
+	if (!str->did_getc && !str->ungetch && isatty(fileno(str->fp))) {
 		printf("| ");
 		fflush(str->fp);
 	}
 
 	for (;;) {
 		str->did_getc = true;
-		int ch = str->ungetch ? str->ungetch : xgetc_utf8(net_getc, str);
+		int ch = str->ungetch ? str->ungetch : stream_getc_utf8(str);
 		str->ungetch = 0;
 
 		if (feof(str->fp)) {
@@ -9574,14 +10162,14 @@ static USE_RESULT pl_status fn_edin_skip_2(query *q)
 	stream *str = &g_streams[n];
 	GET_NEXT_ARG(p1,integer);
 
-	if (isatty(fileno(str->fp)) && !str->did_getc && !str->ungetch) {
+	if (!str->did_getc && !str->ungetch && isatty(fileno(str->fp))) {
 		printf("| ");
 		fflush(str->fp);
 	}
 
 	for (;;) {
 		str->did_getc = true;
-		int ch = str->ungetch ? str->ungetch : xgetc_utf8(net_getc, str);
+		int ch = str->ungetch ? str->ungetch : stream_getc_utf8(str);
 		str->ungetch = 0;
 
 		if (feof(str->fp)) {
@@ -9696,37 +10284,167 @@ static USE_RESULT pl_status fn_edin_telling_1(query *q)
 	return pl_success;
 }
 
-static idx_t do_jenkins_one_at_a_time_hash(const char *key)
+// Hash the cell structure directly, atoms and functors by name so the
+// result doesn't depend on what happens to be interned. Lists (and so
+// strings) go through list_head/list_tail so "ab" hashes as [a,b].
+
+static uint64_t hash_mix(uint64_t h, uint64_t v)
+{
+	h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+	return h;
+}
+
+static uint64_t hash_name(uint64_t h, const char *src, size_t len, unsigned arity)
 {
-	idx_t hash = 0;
+	uint64_t v = 0xcbf29ce484222325ULL;
 
-	while (*key != 0) {
-		hash += *key++;
-		hash += (hash << 10);
-		hash ^= (hash >> 6);
+	while (len--) {
+		v ^= (uint8_t)*src++;
+		v *= 0x100000001b3ULL;
 	}
 
-	hash += (hash << 3);
-	hash ^= (hash >> 11);
-	hash += (hash << 15);
-	return hash;
+	return hash_mix(h, v ^ ((uint64_t)arity << 56));
 }
 
-static USE_RESULT pl_status fn_term_hash_2(query *q)
+// Returns false if a variable was found within the depth limit, or the
+// term nests too deeply or is cyclic. A negative depth is unlimited.
+// Only argument recursion counts towards MAX_DEPTH: the last argument
+// (and so a list's tail) is followed by iteration, with Brent's method
+// catching cycles through it.
+
+static bool hash_term(query *q, cell *c, idx_t c_ctx, int depth, unsigned level, uint64_t *h)
 {
-	GET_FIRST_ARG(p1,any);
-	GET_NEXT_ARG(p2,integer_or_var);
+	if (level >= MAX_DEPTH)
+		return false;
 
-	if (is_variable(p1))
+	cell *seen = NULL;
+	idx_t seen_ctx = 0;
+	size_t steps = 0, lap = 1;
+	LIST_HANDLER(c);
+
+	while (depth) {
+		int next = depth > 0 ? depth - 1 : depth;
+
+		if (is_variable(c))
+			return false;
+
+		if (is_list(c)) {
+			*h = hash_name(*h, ".", 1, 2);
+			cell *head = LIST_HEAD(c);
+			head = deref(q, head, c_ctx);
+
+			if (next && !hash_term(q, head, q->latest_ctx, next, level+1, h))
+				return false;
+
+			c = LIST_TAIL(c);
+		} else if (is_structure(c)) {
+			*h = hash_name(*h, GET_STR(c), LEN_STR(c), c->arity);
+			unsigned arity = c->arity;
+			c++;
+
+			if (!next)
+				return true;
+
+			while (--arity) {
+				cell *c2 = deref(q, c, c_ctx);
+
+				if (!hash_term(q, c2, q->latest_ctx, next, level+1, h))
+					return false;
+
+				c += c->nbr_cells;
+			}
+		} else if (is_float(c)) {
+			double d = c->val_flt == 0.0 ? 0.0 : c->val_flt;
+			uint64_t v;
+			memcpy(&v, &d, sizeof(v));
+			*h = hash_mix(*h, TYPE_FLOAT);
+			*h = hash_mix(*h, v);
+			return true;
+		} else if (is_rational(c)) {
+			*h = hash_mix(*h, TYPE_RATIONAL);
+			*h = hash_mix(*h, (uint64_t)c->val_num);
+			*h = hash_mix(*h, (uint64_t)c->val_den);
+			return true;
+		} else {
+			*h = hash_name(*h, GET_STR(c), LEN_STR(c), 0);
+			return true;
+		}
+
+		// The last arg (or list tail) is done by iteration...
+
+		c = deref(q, c, c_ctx);
+		c_ctx = q->latest_ctx;
+		depth = next;
+
+		// Strings can't be cyclic and their tails live in c_t_tmp...
+
+		if ((depth > 0) || is_string(c))
+			continue;
+
+		if ((c == seen) && (c_ctx == seen_ctx))
+			return false;
+
+		if (++steps == lap) {
+			seen = c;
+			seen_ctx = c_ctx;
+			lap *= 2;
+			steps = 0;
+		}
+	}
+
+	return true;
+}
+
+static USE_RESULT pl_status do_term_hash(query *q, cell *p1, idx_t p1_ctx, int depth, int_t range, cell *p2, idx_t p2_ctx)
+{
+	uint64_t h = 0;
+
+	if (!hash_term(q, p1, p1_ctx, depth, 0, &h))
 		return pl_success;
 
-	char *dst = print_term_to_strbuf(q, p1, p1_ctx, 1);
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+
+	if (sizeof(int_t) < sizeof(uint64_t))
+		h &= 0x7fffffff;
+	else
+		h &= INT64_MAX;
+
+	if (range > 0)
+		h %= (uint64_t)range;
+
 	cell tmp;
-	make_int(&tmp, do_jenkins_one_at_a_time_hash(dst));
-	free(dst);
+	make_int(&tmp, (int_t)h);
 	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
 }
 
+static USE_RESULT pl_status fn_term_hash_2(query *q)
+{
+	GET_FIRST_ARG(p1,any);
+	GET_NEXT_ARG(p2,integer_or_var);
+	return do_term_hash(q, p1, p1_ctx, -1, 0, p2, p2_ctx);
+}
+
+static USE_RESULT pl_status fn_term_hash_4(query *q)
+{
+	GET_FIRST_ARG(p1,any);
+	GET_NEXT_ARG(p2,integer);
+	GET_NEXT_ARG(p3,integer);
+	GET_NEXT_ARG(p4,integer_or_var);
+
+	if (p2->val_num < -1)
+		return throw_error(q, p2, "domain_error", "depth");
+
+	if (p3->val_num < 1)
+		return throw_error(q, p3, "domain_error", "not_less_than_one");
+
+	int depth = p2->val_num > INT_MAX ? INT_MAX : (int)p2->val_num;
+	return do_term_hash(q, p1, p1_ctx, depth, p3->val_num, p4, p4_ctx);
+}
+
 static USE_RESULT pl_status fn_hex_chars_2(query *q)
 {
 	GET_FIRST_ARG(p2,integer_or_var);
@@ -9745,8 +10463,9 @@ static USE_RESULT pl_status fn_hex_chars_2(query *q)
 		return pl_success;
 	}
 
-	const char *src = GET_STR(p1);
-	int_t p1_val = strtoull(src, NULL, 16);
+	char tmpbuf[256];
+	snprintf(tmpbuf, sizeof(tmpbuf), "%.*s", (int)LEN_STR(p1), GET_STR(p1));
+	int_t p1_val = strtoull(tmpbuf, NULL, 16);
 
 	if (is_variable(p2)) {
 		cell tmp;
@@ -9776,8 +10495,9 @@ static USE_RESULT pl_status fn_octal_chars_2(query *q)
 		return pl_success;
 	}
 
-	const char *src = GET_STR(p1);
-	int_t p1_val = strtoull(src, NULL, 8);
+	char tmpbuf[256];
+	snprintf(tmpbuf, sizeof(tmpbuf), "%.*s", (int)LEN_STR(p1), GET_STR(p1));
+	int_t p1_val = strtoull(tmpbuf, NULL, 8);
 
 	if (is_variable(p2)) {
 		cell tmp;
@@ -10668,7 +11388,7 @@ static USE_RESULT pl_status fn_iso_length_2(query *q)
 		unsigned cnt = 0;
 
 		if (is_string(p1)) {
-			cnt = strlen_utf8(GET_STR(p1));
+			cnt = substrlen_utf8(GET_STR(p1), LEN_STR(p1));
 		} else {
 			cell *l = p1;
 			LIST_HANDLER(l);
@@ -10701,7 +11421,7 @@ static USE_RESULT pl_status fn_iso_length_2(query *q)
 		int cnt = 0;
 
 		if (is_string(p1)) {
-			cnt = strlen_utf8(GET_STR(p1));
+			cnt = substrlen_utf8(GET_STR(p1), LEN_STR(p1));
 		} else {
 			cell *l = p1;
 			LIST_HANDLER(l);
@@ -10875,31 +11595,235 @@ static USE_RESULT pl_status fn_sys_put_chars_2(query *q)
 	return !ferror(str->fp);
 }
 
-static USE_RESULT pl_status fn_kv_set_3(query *q)
+// Bytes read from a stream that can't seek (a pipe, say) are kept, so
+// a chunk undone by backtracking can still be read again. What is kept
+// starts at byte position kept_off.
+
+static int kept_getc_utf8(stream *str, size_t *pos, char *dst)
 {
-	GET_FIRST_ARG(p1,atomic);
-	GET_NEXT_ARG(p2,atomic);
-	GET_NEXT_ARG(p3,list_or_nil);
-	bool do_create = false;
-	LIST_HANDLER(p3);
+	if ((*pos - str->kept_off) < str->kept_len) {
+		const char *src = str->kept + (*pos - str->kept_off);
+		size_t len = len_char_utf8(src);
+		memcpy(dst, src, len);
+		dst[len] = '\0';
+		*pos += len;
+		return 1;
+	}
 
-	while (is_list(p3)) {
-		cell *h = LIST_HEAD(p3);
-		h = deref(q, h, p3_ctx);
+	int ch = str->ungetch ? str->ungetch : stream_getc_utf8(str);
+	str->ungetch = 0;
 
-		if (is_variable(h))
-			return throw_error(q, p3, "instantiation_error", "read_option");
+	if (ch == EOF)
+		return 0;
 
-		if (is_structure(h) && (h->arity == 1)) {
-			cell *n = h + 0;
-			if (!strcmp(GET_STR(n), "create")) {
-				cell *v = n + 1;
-				v = deref(q, v, q->latest_ctx);
+	size_t len = put_char_utf8(dst, ch);
 
-				if (is_variable(v))
-					return throw_error(q, p3, "instantiation_error", "read_option");
+	if ((str->kept_len + len) > str->kept_size) {
+		size_t size = str->kept_size ? str->kept_size * 2 : 4096;
+		char *kept = realloc(str->kept, size);
 
-				if (is_atom(v) && !strcmp(GET_STR(v), "true"))
+		if (!kept)
+			return -1;
+
+		str->kept = kept;
+		str->kept_size = size;
+	}
+
+	memcpy(str->kept+str->kept_len, dst, len);
+	str->kept_len += len;
+	*pos += len;
+	return 1;
+}
+
+// Note a read at pos and drop what is kept before the oldest read a
+// live choice could still undo. Choices older than kept_cp belong to
+// the caller: retrying one of them abandons the lazy list anyway.
+
+static bool keep_from(query *q, stream *str, size_t pos)
+{
+	if (q->cp <= str->kept_cp)
+		str->nbr_marks = 0;
+	else {
+		const choice *ch = GET_CHOICE(str->kept_cp);
+		unsigned n = 0;
+
+		// Reading pos again means every later read was undone...
+
+		while (str->nbr_marks && (str->marks[str->nbr_marks-1].pos >= pos))
+			str->nbr_marks--;
+
+		// and reads made before the oldest choice can't be undone.
+
+		while ((n < str->nbr_marks) && (str->marks[n].tp <= ch->st.tp))
+			n++;
+
+		memmove(str->marks, str->marks+n, sizeof(kept_mark)*(str->nbr_marks-n));
+		str->nbr_marks -= n;
+
+		if (q->st.tp > ch->st.tp) {
+			if (str->nbr_marks == str->marks_size) {
+				unsigned size = str->marks_size ? str->marks_size * 2 : 16;
+				kept_mark *marks = realloc(str->marks, sizeof(kept_mark)*size);
+
+				if (!marks)
+					return false;
+
+				str->marks = marks;
+				str->marks_size = size;
+			}
+
+			str->marks[str->nbr_marks++] = (kept_mark){q->st.tp, pos};
+		}
+	}
+
+	size_t keep = str->nbr_marks ? str->marks[0].pos : pos;
+
+	if (keep <= str->kept_off)
+		return true;
+
+	size_t drop = keep - str->kept_off;
+
+	// Only shuffle down once at least half can go...
+
+	if (drop > str->kept_len)
+		drop = str->kept_len;
+	else if (drop < (str->kept_len / 2))
+		return true;
+
+	memmove(str->kept, str->kept+drop, str->kept_len-drop);
+	str->kept_len -= drop;
+	str->kept_off += drop;
+	return true;
+}
+
+// Read up to N chars starting at byte position Pos as a partial list
+// [C1,...,Cn|Tail]. At the end of the stream List is []. Seeking only
+// happens when Pos isn't where the stream already is, which lets a
+// lazy list re-read a chunk after backtracking. A stream that can't
+// seek (its position is -1) is read via what was kept of it instead,
+// see keep_from().
+
+static USE_RESULT pl_status fn_sys_get_chars_6(query *q)
+{
+	idx_t var_nbr = create_vars(q, 1);
+
+	if (!var_nbr)
+		return throw_error(q, q->st.curr_cell, "resource_error", "too_many_vars");
+
+	GET_FIRST_ARG(pstr,stream);
+	int n = get_stream(q, pstr);
+	stream *str = &g_streams[n];
+	GET_NEXT_ARG(p1,integer);
+	GET_NEXT_ARG(p2,integer);
+	GET_NEXT_ARG(p3,variable);
+	GET_NEXT_ARG(p4,variable);
+	GET_NEXT_ARG(p5,variable);
+	off_t here = ftello(str->fp);
+	bool seekable = here != -1;
+	size_t pos = p1->val_num < 0 ? 0 : p1->val_num;
+
+	if (seekable && (here != p1->val_num)) {
+		if (fseeko(str->fp, p1->val_num, SEEK_SET))
+			return throw_error(q, p1, "domain_error", "position");
+
+		str->ungetch = 0;
+	}
+
+	if (!seekable && (pos < str->kept_off))
+		return throw_error(q, p1, "domain_error", "position");
+
+	if (!seekable && !keep_from(q, str, pos))
+		return throw_error(q, p1, "resource_error", "memory");
+
+	int_t nbr = 0;
+
+	while (nbr < p2->val_num) {
+		char tmpbuf[20];
+
+		if (seekable) {
+			int ch = stream_getc_utf8(str);
+
+			if (ch == EOF)
+				break;
+
+			put_char_utf8(tmpbuf, ch);
+		} else {
+			int ok = kept_getc_utf8(str, &pos, tmpbuf);
+
+			if (ok < 0)
+				return throw_error(q, p1, "resource_error", "memory");
+
+			if (!ok)
+				break;
+		}
+
+		cell tmp;
+		make_small(&tmp, tmpbuf);
+
+		if (!nbr++)
+			allocate_list(q, &tmp);
+		else
+			append_list(q, &tmp);
+	}
+
+	cell tmp;
+	make_int(&tmp, seekable ? ftello(str->fp) : (off_t)pos);
+	set_var(q, p5, p5_ctx, &tmp, q->st.curr_frame);
+
+	if (!nbr) {
+		clearerr(str->fp);
+		make_literal(&tmp, g_nil_s);
+		set_var(q, p3, p3_ctx, &tmp, q->st.curr_frame);
+		return pl_success;
+	}
+
+	make_variable(&tmp, g_anon_s);
+	tmp.var_nbr = var_nbr;
+	cell *l = end_partial_list(q, &tmp);
+	may_ptr_error(l);
+	set_var(q, p3, p3_ctx, l, q->st.curr_frame);
+	set_var(q, p4, p4_ctx, &tmp, q->st.curr_frame);
+	return pl_success;
+}
+
+// The grammar reading a lazy list from the stream starts here, see
+// keep_from().
+
+static USE_RESULT pl_status fn_sys_lazy_start_1(query *q)
+{
+	GET_FIRST_ARG(pstr,stream);
+	int n = get_stream(q, pstr);
+	stream *str = &g_streams[n];
+	str->kept_cp = q->cp;
+	str->nbr_marks = 0;
+	return pl_success;
+}
+
+static USE_RESULT pl_status fn_kv_set_3(query *q)
+{
+	GET_FIRST_ARG(p1,atomic);
+	GET_NEXT_ARG(p2,atomic);
+	GET_NEXT_ARG(p3,list_or_nil);
+	bool do_create = false;
+	LIST_HANDLER(p3);
+
+	while (is_list(p3)) {
+		cell *h = LIST_HEAD(p3);
+		h = deref(q, h, p3_ctx);
+
+		if (is_variable(h))
+			return throw_error(q, p3, "instantiation_error", "read_option");
+
+		if (is_structure(h) && (h->arity == 1)) {
+			cell *n = h + 0;
+			if (!strcmp(GET_STR(n), "create")) {
+				cell *v = n + 1;
+				v = deref(q, v, q->latest_ctx);
+
+				if (is_variable(v))
+					return throw_error(q, p3, "instantiation_error", "read_option");
+
+				if (is_atom(v) && !strcmp(GET_STR(v), "true"))
 					do_create = true;
 			}
 		}
@@ -11221,31 +12145,53 @@ static USE_RESULT pl_status fn_sys_chk_is_det_0(query *q)
 	return pl_success;
 }
 
+// The trailed vars may belong to any frame, so each Var-Val pair is
+// made of two fresh vars in this frame bound to the original var and
+// to its value, each in their own context.
+
 pl_status fn_sys_undo_trail_1(query *q)
 {
+	idx_t cnt = q->undo_hi_tp - q->undo_lo_tp;
+	unsigned var_nbr = 0;
+
+	if (cnt && !(var_nbr = create_vars(q, cnt*2)))
+		return throw_error(q, q->st.curr_cell, "resource_error", "too_many_vars");
+
 	GET_FIRST_ARG(p1,variable);
 	q->in_hook = true;
-	frame *g = GET_CURR_FRAME();
 
-	q->save_e = malloc(sizeof(slot)*(q->undo_hi_tp - q->undo_lo_tp));
+	q->save_e = malloc(sizeof(slot)*cnt);
 	may_ptr_error(q->save_e);
 	bool first = true;
 
 	// Unbind our vars
 
 	for (idx_t i = q->undo_lo_tp, j = 0; i < q->undo_hi_tp; i++, j++) {
-		const trail *tr = q->trails + i;
-		const frame *g = GET_FRAME(tr->ctx);
-		slot *e = GET_SLOT(g, tr->var_nbr);
-		//printf("*** unbind [%u:%u] ctx=%u, var=%u\n", j, i, tr->ctx, tr->var_nbr);
+		// Binding below can grow the trail, so take a copy
+
+		const trail tr = q->trails[i];
+
+		if (tr.ctx == ERR_IDX)
+			continue;
+
+		const frame *g = GET_FRAME(tr.ctx);
+		slot *e = GET_SLOT(g, tr.var_nbr);
+		//printf("*** unbind [%u:%u] ctx=%u, var=%u\n", j, i, tr.ctx, tr.var_nbr);
 		q->save_e[j] = *e;
 
 		cell tmp[3];
 		make_structure(tmp, g_minus_s, NULL, 2, 2);
 		SET_OP(&tmp[0], OP_YFX);
 		make_variable(&tmp[1], g_anon_s);
-		tmp[1].var_nbr = tr->var_nbr;
-		tmp[2] = e->c;
+		tmp[1].var_nbr = var_nbr + (j * 2);
+		make_variable(&tmp[2], g_anon_s);
+		tmp[2].var_nbr = var_nbr + (j * 2) + 1;
+
+		cell v, *val = is_indirect(&e->c) ? e->c.val_ptr : &e->c;
+		make_variable(&v, g_anon_s);
+		v.var_nbr = tr.var_nbr;
+		set_var(q, &tmp[1], q->st.curr_frame, &v, tr.ctx);
+		set_var(q, &tmp[2], q->st.curr_frame, val, e->ctx);
 
 		if (first) {
 			allocate_list(q, tmp);
@@ -11254,12 +12200,12 @@ pl_status fn_sys_undo_trail_1(query *q)
 			append_list(q, tmp);
 
 		e->c.val_type = TYPE_EMPTY;
-		e->c.attrs = tr->attrs;
+		e->c.attrs = tr.attrs;
 	}
 
 	cell *tmp = end_list(q);
 	may_ptr_error(tmp);
-	set_var(q, p1, p1_ctx, tmp, g->prev_frame);
+	set_var(q, p1, p1_ctx, tmp, q->st.curr_frame);
 	return pl_success;
 }
 
@@ -11267,6 +12213,10 @@ pl_status fn_sys_redo_trail_0(query * q)
 {
 	for (idx_t i = q->undo_lo_tp, j = 0; i < q->undo_hi_tp; i++, j++) {
 		const trail *tr = q->trails + i;
+
+		if (tr->ctx == ERR_IDX)
+			continue;
+
 		const frame *g = GET_FRAME(tr->ctx);
 		slot *e = GET_SLOT(g, tr->var_nbr);
 		//printf("*** rebind [%u:%u:%u] ctx=%u, var=%u\n", j, i, q->undo_hi_tp, tr->ctx, tr->var_nbr);
@@ -11303,6 +12253,366 @@ pl_status do_post_unification_hook(query *q)
 	return pl_success;
 }
 
+typedef struct {
+	cell *c, *key;
+	idx_t c_ctx, key_ctx;
+	bool nonground;
+} sort_item;
+
+static int sort_cmp(query *q, const sort_item *a, const sort_item *b, bool desc)
+{
+	int status = compare(q, a->key, a->key_ctx, b->key, b->key_ctx, 0);
+
+	if (status == ERR_CYCLE_CMP)
+		return 0;
+
+	return desc ? -status : status;
+}
+
+// A stable merge sort, msort/2 and keysort/2 need equal elements
+// (or keys) to keep their original order...
+
+static void sort_items(query *q, sort_item *base, sort_item *tmp, size_t nbr, bool desc)
+{
+	if (nbr < 2)
+		return;
+
+	size_t mid = nbr / 2;
+	sort_items(q, base, tmp, mid, desc);
+	sort_items(q, base+mid, tmp, nbr-mid, desc);
+
+	if (sort_cmp(q, base+mid-1, base+mid, desc) <= 0)
+		return;
+
+	memcpy(tmp, base, sizeof(sort_item)*mid);
+	size_t i = 0, j = mid, k = 0;
+
+	while ((i < mid) && (j < nbr)) {
+		if (sort_cmp(q, base+j, tmp+i, desc) < 0)
+			base[k++] = base[j++];
+		else
+			base[k++] = tmp[i++];
+	}
+
+	while (i < mid)
+		base[k++] = tmp[i++];
+}
+
+// Collect the (dereferenced) elements of a proper list into an array,
+// with the sort key being the whole element (key=0) or its Nth arg.
+
+static USE_RESULT pl_status get_sort_items(query *q, cell *l, idx_t l_ctx, unsigned key, bool pairs, sort_item **items, size_t *nbr)
+{
+	if (is_variable(l))
+		return throw_error(q, l, "instantiation_error", "not_sufficiently_instantiated");
+
+	if (is_valid_list(q, l, l_ctx, true) && !is_valid_list(q, l, l_ctx, false))
+		return throw_error(q, l, "instantiation_error", "tail_is_a_variable");
+
+	if (!is_valid_list(q, l, l_ctx, false))
+		return throw_error(q, l, "type_error", "list");
+
+	size_t cnt = 0, max = 1000;
+	sort_item *base = malloc(sizeof(sort_item)*max);
+	may_ptr_error(base);
+	LIST_HANDLER(l);
+
+	while (is_list(l)) {
+		cell *h = LIST_HEAD(l);
+		h = deref(q, h, l_ctx);
+		idx_t h_ctx = q->latest_ctx;
+
+		if (pairs && is_variable(h)) {
+			free(base);
+			return throw_error(q, h, "instantiation_error", "not_sufficiently_instantiated");
+		}
+
+		if (pairs && (!is_literal(h) || (h->arity != 2) || (h->val_off != g_minus_s))) {
+			free(base);
+			return throw_error(q, h, "type_error", "pair");
+		}
+
+		if (key && (!is_structure(h) || (h->arity < key))) {
+			free(base);
+			return throw_error(q, h, "type_error", "compound");
+		}
+
+		if (cnt == max) {
+			max = alloc_grow((void**)&base, sizeof(sort_item), cnt+1, max*2);
+			may_error(max, free(base));
+		}
+
+		sort_item *it = base + cnt++;
+		it->c = h;
+		it->c_ctx = h_ctx;
+
+		if (key) {
+			cell *c = h + 1;
+
+			for (unsigned i = 1; i < key; i++)
+				c += c->nbr_cells;
+
+			it->key = deref(q, c, h_ctx);
+			it->key_ctx = q->latest_ctx;
+		} else {
+			it->key = h;
+			it->key_ctx = h_ctx;
+		}
+
+		l = LIST_TAIL(l);
+		l = deref(q, l, l_ctx);
+		l_ctx = q->latest_ctx;
+	}
+
+	*items = base;
+	*nbr = cnt;
+	return pl_success;
+}
+
+// Build the result list on the heap. Atomic and ground elements are
+// copied in, anything with variables is referenced through a fresh
+// variable bound to the original so that sharing is preserved. When
+// the caller's frame can't take that many more variables they go in
+// frames of their own, each holding a run of the list and a tail
+// variable linking to the next.
+
+static USE_RESULT pl_status unify_sorted(query *q, cell *p2, idx_t p2_ctx, sort_item *base, size_t nbr)
+{
+	if (!nbr) {
+		cell tmp;
+		make_literal(&tmp, g_nil_s);
+		return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+	}
+
+	size_t total = 0;
+
+	for (size_t i = 0; i < nbr; i++) {
+		cell *c = base[i].c;
+		base[i].nonground = is_variable(c) || (is_structure(c) && has_vars(q, c, base[i].c_ctx, 0));
+		total += base[i].nonground;
+	}
+
+	frame *g = GET_CURR_FRAME();
+	bool in_frame = (g->nbr_vars + total) < MAX_VARS;
+	cell *l = NULL;
+	idx_t l_ctx = q->st.curr_frame;
+	size_t end = nbr;
+
+	// Runs are built from the back, so each links to the one after...
+
+	while (end) {
+		size_t start = end;
+		unsigned cnt = 0;
+
+		while (start && (in_frame || ((cnt + base[start-1].nonground) < MAX_VARS)))
+			cnt += base[--start].nonground;
+
+		unsigned nbr_vars = cnt + (l ? 1 : 0), first_var = 0;
+		idx_t ctx = q->st.curr_frame;
+
+		if (in_frame) {
+			first_var = create_vars(q, cnt);
+
+			if (q->error)
+				return pl_error;
+		} else if (!(ctx = create_var_frame(q, nbr_vars)))
+			return throw_error(q, base[start].c, "resource_error", "too_many_vars");
+
+		may_ptr_error(init_tmp_heap(q));
+		unsigned var_nbr = first_var;
+
+		for (size_t i = start; i < end; i++) {
+			cell *tmp = alloc_on_tmp(q, 1);
+			may_ptr_error(tmp);
+			tmp->val_type = TYPE_LITERAL;
+			tmp->nbr_cells = 1;
+			tmp->val_off = g_dot_s;
+			tmp->arity = 2;
+			tmp->flags = 0;
+			cell *c = base[i].c;
+
+			if (base[i].nonground) {
+				tmp = alloc_on_tmp(q, 1);
+				may_ptr_error(tmp);
+				tmp->val_type = TYPE_VARIABLE;
+				tmp->nbr_cells = 1;
+				tmp->arity = 0;
+				tmp->flags = FLAG2_FRESH | FLAG2_ANON;
+				tmp->val_off = g_anon_s;
+				tmp->var_nbr = var_nbr++;
+			} else if (is_structure(c)) {
+				cell *rec = deep_clone2_to_tmp(q, c, base[i].c_ctx, 0);
+				may_ptr_error(rec);
+				if (rec == ERR_CYCLE_CELL)
+					return throw_error(q, c, "resource_error", "cyclic_term");
+			} else {
+				tmp = alloc_on_tmp(q, 1);
+				may_ptr_error(tmp);
+				copy_cells(tmp, c, 1);
+			}
+		}
+
+		cell tail;
+
+		if (l) {
+			tail.val_type = TYPE_VARIABLE;
+			tail.nbr_cells = 1;
+			tail.arity = 0;
+			tail.flags = FLAG2_FRESH | FLAG2_ANON;
+			tail.val_off = g_anon_s;
+			tail.var_nbr = cnt;
+		} else
+			make_literal(&tail, g_nil_s);
+
+		cell *run = end_partial_list(q, &tail);
+		may_ptr_error(run);
+		var_nbr = first_var;
+
+		for (size_t i = start; i < end; i++) {
+			if (!base[i].nonground)
+				continue;
+
+			cell tmp;
+			tmp.val_type = TYPE_VARIABLE;
+			tmp.nbr_cells = 1;
+			tmp.arity = 0;
+			tmp.flags = 0;
+			tmp.val_off = g_anon_s;
+			tmp.var_nbr = var_nbr++;
+			set_var(q, &tmp, ctx, base[i].c, base[i].c_ctx);
+		}
+
+		if (l)
+			set_var(q, &tail, ctx, l, l_ctx);
+
+		l = run;
+		l_ctx = ctx;
+		end = start;
+	}
+
+	return unify(q, p2, p2_ctx, l, l_ctx);
+}
+
+static USE_RESULT pl_status check_sort_result(query *q, cell *p2, idx_t p2_ctx, bool pairs)
+{
+	if (is_variable(p2))
+		return pl_success;
+
+	if (!is_valid_list(q, p2, p2_ctx, true))
+		return throw_error(q, p2, "type_error", "list");
+
+	if (!pairs)
+		return pl_success;
+
+	LIST_HANDLER(p2);
+
+	while (is_list(p2)) {
+		cell *h = LIST_HEAD(p2);
+		h = deref(q, h, p2_ctx);
+
+		if (!is_variable(h) && (!is_literal(h) || (h->arity != 2) || (h->val_off != g_minus_s)))
+			return throw_error(q, h, "type_error", "pair");
+
+		p2 = LIST_TAIL(p2);
+		p2 = deref(q, p2, p2_ctx);
+		p2_ctx = q->latest_ctx;
+	}
+
+	return pl_success;
+}
+
+static USE_RESULT pl_status do_sort(query *q, cell *p1, idx_t p1_ctx, cell *p2, idx_t p2_ctx, unsigned key, bool pairs, bool desc, bool dedup)
+{
+	sort_item *base = NULL;
+	size_t nbr = 0;
+	pl_status ok = get_sort_items(q, p1, p1_ctx, key, pairs, &base, &nbr);
+
+	if (!ok || q->did_throw)
+		return ok;
+
+	ok = check_sort_result(q, p2, p2_ctx, pairs);
+
+	if (!ok || q->did_throw) {
+		free(base);
+		return ok;
+	}
+
+	sort_item *tmp = malloc(sizeof(sort_item)*(nbr/2+1));
+	may_ptr_error(tmp, free(base));
+	sort_items(q, base, tmp, nbr, desc);
+	free(tmp);
+
+	if (dedup && nbr) {
+		size_t j = 0;
+
+		for (size_t i = 1; i < nbr; i++) {
+			if (sort_cmp(q, base+j, base+i, desc))
+				base[++j] = base[i];
+		}
+
+		nbr = j + 1;
+	}
+
+	ok = unify_sorted(q, p2, p2_ctx, base, nbr);
+	free(base);
+	return ok;
+}
+
+static USE_RESULT pl_status fn_iso_sort_2(query *q)
+{
+	GET_FIRST_ARG(p1,any);
+	GET_NEXT_ARG(p2,any);
+	return do_sort(q, p1, p1_ctx, p2, p2_ctx, 0, false, false, true);
+}
+
+static USE_RESULT pl_status fn_msort_2(query *q)
+{
+	GET_FIRST_ARG(p1,any);
+	GET_NEXT_ARG(p2,any);
+	return do_sort(q, p1, p1_ctx, p2, p2_ctx, 0, false, false, false);
+}
+
+static USE_RESULT pl_status fn_iso_keysort_2(query *q)
+{
+	GET_FIRST_ARG(p1,any);
+	GET_NEXT_ARG(p2,any);
+	return do_sort(q, p1, p1_ctx, p2, p2_ctx, 1, true, false, false);
+}
+
+static USE_RESULT pl_status fn_sort_4(query *q)
+{
+	GET_FIRST_ARG(p1,integer_or_var);
+	GET_NEXT_ARG(p2,atom_or_var);
+	GET_NEXT_ARG(p3,any);
+	GET_NEXT_ARG(p4,any);
+
+	if (is_variable(p1) || is_variable(p2))
+		return throw_error(q, is_variable(p1)?p1:p2, "instantiation_error", "not_sufficiently_instantiated");
+
+	if (p1->val_num < 0)
+		return throw_error(q, p1, "domain_error", "not_less_than_zero");
+
+	if (p1->val_num > MAX_ARITY)
+		return throw_error(q, p1, "domain_error", "arg");
+
+	const char *src = GET_STR(p2);
+	size_t len = LEN_STR(p2);
+	bool desc, dedup;
+
+	if (!slicecmp2(src, len, "@<")) {
+		desc = false; dedup = true;
+	} else if (!slicecmp2(src, len, "@=<")) {
+		desc = false; dedup = false;
+	} else if (!slicecmp2(src, len, "@>")) {
+		desc = true; dedup = true;
+	} else if (!slicecmp2(src, len, "@>=")) {
+		desc = true; dedup = false;
+	} else
+		return throw_error(q, p2, "domain_error", "order");
+
+	return do_sort(q, p3, p3_ctx, p4, p4_ctx, (unsigned)p1->val_num, false, desc, dedup);
+}
+
 static USE_RESULT pl_status fn_iso_compare_3(query *q)
 {
 	GET_FIRST_ARG(p1,atom_or_var);
@@ -11371,6 +12681,8 @@ static const struct builtins g_predicates_iso[] =
 	{"number_codes", 2, fn_iso_number_codes_2, NULL},
 	{"clause", 2, fn_iso_clause_2, NULL},
 	{"length", 2, fn_iso_length_2, NULL},
+	{"sort", 2, fn_iso_sort_2, NULL},
+	{"keysort", 2, fn_iso_keysort_2, NULL},
 	{"arg", 3, fn_iso_arg_3, NULL},
 	{"functor", 3, fn_iso_functor_3, NULL},
 	{"copy_term", 2, fn_iso_copy_term_2, NULL},
@@ -11481,8 +12793,12 @@ static const struct builtins g_predicates_other[] =
 
 	{"ignore", 1, fn_ignore_1, "+callable"},
 	{"memberchk", 2, fn_memberchk_2, "?term,+list"},
+	{"msort", 2, fn_msort_2, "+list,?list"},
+	{"sort", 4, fn_sort_4, "+integer,+atom,+list,?list"},
 
 	{"$put_chars", 2, fn_sys_put_chars_2, "+stream,+chars"},
+	{"$get_chars", 6, fn_sys_get_chars_6, "+stream,+integer,+integer,-list,-variable,-integer"},
+	{"$lazy_start", 1, fn_sys_lazy_start_1, "+stream"},
 	{"$undo_trail", 1, fn_sys_undo_trail_1, NULL},
 	{"$redo_trail", 0, fn_sys_redo_trail_0, NULL},
 
@@ -11520,6 +12836,7 @@ static const struct builtins g_predicates_other[] =
 	{"getline", 2, fn_getline_2, "+stream,-string"},
 	{"getfile", 2, fn_getfile_2, "+string,-list"},
 	{"loadfile", 2, fn_loadfile_2, "+string,-string"},
+	{"loadfile", 3, fn_loadfile_3, "+string,-string,+list"},
 	{"savefile", 2, fn_savefile_2, "+string,+string"},
 	{"split_atom", 4, fn_split_atom_4, "+string,+sep,+pad,-list"},
 	{"split", 4, fn_split_4, "+string,+string,?left,?right"},
@@ -11534,6 +12851,7 @@ static const struct builtins g_predicates_other[] =
 	{"is_stream", 1, fn_is_stream_1, "+term"},
 	//{"forall", 2, fn_forall_2, "+term,+term"},
 	{"term_hash", 2, fn_term_hash_2, "+term,?integer"},
+	{"term_hash", 4, fn_term_hash_4, "+term,+integer,+integer,?integer"},
 	{"rename_file", 2, fn_rename_file_2, "+string,+string"},
 	{"directory_files", 2, fn_directory_files_2, "+pathname,-list"},
 	{"delete_file", 1, fn_delete_file_1, "+string"},
@@ -11585,6 +12903,7 @@ static const struct builtins g_predicates_other[] =
 	{"unsetenv", 1, fn_unsetenv_1, NULL},
 	{"statistics", 0, fn_statistics_0, NULL},
 	{"statistics", 2, fn_statistics_2, "+string,-variable"},
+	{"garbage_collect_atoms", 0, fn_garbage_collect_atoms_0, NULL},
 	{"duplicate_term", 2, fn_iso_copy_term_2, "+term,-variable"},
 	{"call_nth", 2, fn_call_nth_2, "+callable,+integer"},
 	{"limit", 2, fn_limit_2, "+integer,+callable"},
@@ -11655,6 +12974,9 @@ void *get_builtin(prolog *pl, const char *name, unsigned arity, bool *found)
 
 extern const struct builtins g_functions[];
 extern const struct builtins g_contrib_funcs[];
+extern const struct builtins g_thread_funcs[];
+extern const struct builtins g_global_funcs[];
+extern const struct builtins g_alarm_funcs[];
 
 void load_builtins(prolog *pl)
 {
@@ -11673,6 +12995,18 @@ void load_builtins(prolog *pl)
 	for (const struct builtins *ptr = g_contrib_funcs; ptr->name; ptr++) {
 		m_app(pl->funtab, ptr->name, ptr);
 	}
+
+	for (const struct builtins *ptr = g_thread_funcs; ptr->name; ptr++) {
+		m_app(pl->funtab, ptr->name, ptr);
+	}
+
+	for (const struct builtins *ptr = g_global_funcs; ptr->name; ptr++) {
+		m_app(pl->funtab, ptr->name, ptr);
+	}
+
+	for (const struct builtins *ptr = g_alarm_funcs; ptr->name; ptr++) {
+		m_app(pl->funtab, ptr->name, ptr);
+	}
 }
 
 void format_property(char *tmpbuf, size_t buflen, const char *name, unsigned arity, const char *type)
@@ -11829,6 +13163,33 @@ static void load_properties(module *m)
 		format_property(tmpbuf, sizeof(tmpbuf), ptr->name, ptr->arity, "native_code"); STRING_strcat(pr, tmpbuf);
 	}
 
+	for (const struct builtins *ptr = g_thread_funcs; ptr->name; ptr++) {
+		m_app(m->pl->funtab, ptr->name, ptr);
+		if (ptr->name[0] == '$') continue;
+		format_property(tmpbuf, sizeof(tmpbuf), ptr->name, ptr->arity, "built_in"); STRING_strcat(pr, tmpbuf);
+		format_property(tmpbuf, sizeof(tmpbuf), ptr->name, ptr->arity, "static"); STRING_strcat(pr, tmpbuf);
+		format_property(tmpbuf, sizeof(tmpbuf), ptr->name, ptr->arity, "private"); STRING_strcat(pr, tmpbuf);
+		format_property(tmpbuf, sizeof(tmpbuf), ptr->name, ptr->arity, "native_code"); STRING_strcat(pr, tmpbuf);
+	}
+
+	for (const struct builtins *ptr = g_global_funcs; ptr->name; ptr++) {
+		m_app(m->pl->funtab, ptr->name, ptr);
+		if (ptr->name[0] == '$') continue;
+		format_property(tmpbuf, sizeof(tmpbuf), ptr->name, ptr->arity, "built_in"); STRING_strcat(pr, tmpbuf);
+		format_property(tmpbuf, sizeof(tmpbuf), ptr->name, ptr->arity, "static"); STRING_strcat(pr, tmpbuf);
+		format_property(tmpbuf, sizeof(tmpbuf), ptr->name, ptr->arity, "private"); STRING_strcat(pr, tmpbuf);
+		format_property(tmpbuf, sizeof(tmpbuf), ptr->name, ptr->arity, "native_code"); STRING_strcat(pr, tmpbuf);
+	}
+
+	for (const struct builtins *ptr = g_alarm_funcs; ptr->name; ptr++) {
+		m_app(m->pl->funtab, ptr->name, ptr);
+		if (ptr->name[0] == '$') continue;
+		format_property(tmpbuf, sizeof(tmpbuf), ptr->name, ptr->arity, "built_in"); STRING_strcat(pr, tmpbuf);
+		format_property(tmpbuf, sizeof(tmpbuf), ptr->name, ptr->arity, "static"); STRING_strcat(pr, tmpbuf);
+		format_property(tmpbuf, sizeof(tmpbuf), ptr->name, ptr->arity, "private"); STRING_strcat(pr, tmpbuf);
+		format_property(tmpbuf, sizeof(tmpbuf), ptr->name, ptr->arity, "native_code"); STRING_strcat(pr, tmpbuf);
+	}
+
 	parser *p = create_parser(m);
 	p->srcptr = STRING_cstr(pr);
 	p->consulting = true;
@@ -6,6 +6,7 @@
 #include <math.h>
 #include <float.h>
 #include <inttypes.h>
+#include <stdarg.h>
 
 #ifdef _WIN32
 #define snprintf _snprintf
@@ -140,14 +141,66 @@ size_t formatted(char *dst, size_t dstlen, const char *src, int srclen, bool dq)
 	return len;
 }
 
-static size_t plain(char *dst, size_t dstlen, const char *src, int srclen)
+// Terms are written in a single pass to a buffer that grows as
+// needed.
+
+static size_t buf_len(const STRING *b)
 {
-	if (dstlen) {
-		memcpy(dst, src, srclen);
-		dst[srclen] = '\0';
-	}
+	return b->dst - b->buf;
+}
+
+static void buf_check(STRING *b, size_t len)
+{
+	size_t used = buf_len(b);
+
+	if ((used + len) < b->size)
+		return;
+
+	size_t size = b->size ? b->size : 256;
+
+	while (size <= (used + len))
+		size *= 2;
+
+	b->buf = realloc(b->buf, size+1);
+	ensure(b->buf);
+	b->dst = b->buf + used;
+	b->size = size;
+}
+
+static void buf_strcatn(STRING *b, const char *src, size_t len)
+{
+	buf_check(b, len);
+	memcpy(b->dst, src, len);
+	b->dst += len;
+	*b->dst = '\0';
+}
+
+static void buf_strcat(STRING *b, const char *src)
+{
+	buf_strcatn(b, src, strlen(src));
+}
+
+static void buf_printf(STRING *b, const char *fmt, ...)
+{
+	buf_check(b, 64);
+	va_list ap;
+	va_start(ap, fmt);
+	b->dst += vsnprintf(b->dst, 64, fmt, ap);
+	va_end(ap);
+}
+
+static void buf_int(STRING *b, int_t n, int base)
+{
+	buf_check(b, 256);
+	b->dst += sprint_int(b->dst, 256, n, base);
+}
+
+// An escaped char takes at most 5 bytes (\xNN\)
 
-	return srclen;
+static void buf_formatted(STRING *b, const char *src, int srclen, bool dq)
+{
+	buf_check(b, (srclen*5)+1);
+	b->dst += formatted(b->dst, (srclen*5)+1, src, srclen, dq);
 }
 
 static size_t sprint_int_(char *dst, size_t size, int_t n, int base)
@@ -245,7 +298,9 @@ static int find_binding(query *q, idx_t var_nbr, idx_t var_ctx)
 	return ERR_IDX;
 }
 
-static uint8_t s_mask1[MAX_ARITY] = {0}, s_mask2[MAX_ARITY] = {0};
+static THREAD_LOCAL uint8_t s_mask1[MAX_ARITY] = {0}, s_mask2[MAX_ARITY] = {0};
+
+static ssize_t print_term_(query *q, STRING *b, cell *c, idx_t c_ctx, int running, bool cons, unsigned depth);
 
 static unsigned count_non_anons(const uint8_t *mask, unsigned bit)
 {
@@ -259,54 +314,100 @@ static unsigned count_non_anons(const uint8_t *mask, unsigned bit)
 	return bits;
 }
 
-ssize_t print_canonical_to_buf(query *q, char *dst, size_t dstlen, cell *c, idx_t c_ctx, int running, bool cons, unsigned depth)
+// A variable bound in the current frame is named after its binding,
+// or printed as '_' if it only occurs once in the term.
+
+static bool canonical_var(query *q, const cell *c, idx_t c_ctx, int running, idx_t *var_nbr)
 {
-	if (!running)
-		return print_term_to_buf(q, dst, dstlen, c, c_ctx, running, cons, depth);
+	if (!is_variable(c) || (running <= 0) || (q->nv_start != -1))
+		return false;
+
+	idx_t nbr = find_binding(q, c->var_nbr, c_ctx);
+
+	if (nbr == ERR_IDX)
+		return false;
+
+	for (unsigned i = 0; i < MAX_ARITY; i++) {
+		if (q->nv_mask[i])
+			break;
+
+		nbr--;
+	}
+
+	*var_nbr = nbr;
+	return true;
+}
+
+// Count occurrences up front so the term can be written in one pass.
+
+static void mark_canonical_vars(query *q, cell *c, idx_t c_ctx, unsigned depth)
+{
+	idx_t var_nbr;
+
+	if (depth > MAX_DEPTH)
+		return;
+
+	if (canonical_var(q, c, c_ctx, 1, &var_nbr)) {
+		if (!(s_mask1[var_nbr]))
+			s_mask1[var_nbr] = 1;
+		else
+			s_mask2[var_nbr] = 1;
+
+		return;
+	}
+
+	if (!is_structure(c) || is_string(c))
+		return;
+
+	idx_t arity = c->arity;
 
-	if (!depth && !dst && !dstlen) {
-		fake_numbervars(q, c, c_ctx, 0);
-		memset(s_mask1, 0, MAX_ARITY);
-		memset(s_mask2, 0, MAX_ARITY);
-		q->nv_start = -1;
+	for (c++; arity--; c += c->nbr_cells) {
+		cell *tmp = deref(q, c, c_ctx);
+		mark_canonical_vars(q, tmp, q->latest_ctx, depth+1);
 	}
+}
+
+static ssize_t print_canonical_(query *q, STRING *b, cell *c, idx_t c_ctx, int running, bool cons, unsigned depth)
+{
+	if (!running)
+		return print_term_(q, b, c, c_ctx, running, cons, depth);
 
-	char *save_dst = dst;
+	const size_t save_len = buf_len(b);
 
 	if (depth > MAX_DEPTH)
 		return -1;
 
 	if (is_rational(c)) {
 		if (((c->flags & FLAG_HEX) || (c->flags & FLAG_BINARY))) {
-			dst += snprintf(dst, dstlen, "%s0x", c->val_num<0?"-":"");
-			dst += sprint_int(dst, dstlen, c->val_num, 16);
+			buf_printf(b, "%s0x", c->val_num<0?"-":"");
+			buf_int(b, c->val_num, 16);
 		} else if ((c->flags & FLAG_OCTAL) && !running) {
-			dst += snprintf(dst, dstlen, "%s0o", c->val_num<0?"-":"");
-			dst += sprint_int(dst, dstlen, c->val_num, 8);
+			buf_printf(b, "%s0o", c->val_num<0?"-":"");
+			buf_int(b, c->val_num, 8);
 		} else if (c->val_den != 1) {
 			if (q->flag.rational_syntax_natural) {
-				dst += sprint_int(dst, dstlen, c->val_num, 10);
-				dst += snprintf(dst, dstlen, "%s", "/");
-				dst += sprint_int(dst, dstlen, c->val_den, 10);
+				buf_int(b, c->val_num, 10);
+				buf_strcat(b, "/");
+				buf_int(b, c->val_den, 10);
 			} else {
-				dst += sprint_int(dst, dstlen, c->val_num, 10);
-				dst += snprintf(dst, dstlen, "%s", " rdiv ");
-				dst += sprint_int(dst, dstlen, c->val_den, 10);
+				buf_int(b, c->val_num, 10);
+				buf_strcat(b, " rdiv ");
+				buf_int(b, c->val_den, 10);
 			}
 		} else
-			dst += sprint_int(dst, dstlen, c->val_num, 10);
+			buf_int(b, c->val_num, 10);
 
-		return dst - save_dst;
+		return buf_len(b) - save_len;
 	}
 
 	if (is_float(c) && (c->val_flt == M_PI)) {
-		dst += snprintf(dst, dstlen, "3.141592653589793");
-		return dst - save_dst;
+		buf_strcat(b, "3.141592653589793");
+		return buf_len(b) - save_len;
 	}
 
 	if (is_float(c) && (c->val_flt == M_E)) {
-		dst += snprintf(dst, dstlen, "2.718281828459045");
-		return dst - save_dst;
+		buf_strcat(b, "2.718281828459045");
+		return buf_len(b) - save_len;
 	}
 
 	if (is_float(c)) {
@@ -318,52 +419,35 @@ ssize_t print_canonical_to_buf(query *q, char *dst, size_t dstlen, cell *c, idx_
 			sprintf(tmpbuf, "%.*g", DBL_DECIMAL_DIG, c->val_flt);
 
 		reformat_float(tmpbuf);
-		dst += snprintf(dst, dstlen, "%s", tmpbuf);
-		return dst - save_dst;
+		buf_strcat(b, tmpbuf);
+		return buf_len(b) - save_len;
 	}
 
 	idx_t var_nbr = 0;
 
-	if (is_variable(c)
-		&& (running>0) && (q->nv_start == -1)
-		&& ((var_nbr = find_binding(q, c->var_nbr, c_ctx)) != ERR_IDX)) {
-
-		for (unsigned i = 0; i < MAX_ARITY; i++) {
-			if (q->nv_mask[i])
-				break;
-
-			var_nbr--;
-		}
-
-		if (!dstlen) {
-			if (!(s_mask1[var_nbr]))
-				s_mask1[var_nbr] = 1;
-			else
-				s_mask2[var_nbr] = 1;
-		}
-
+	if (canonical_var(q, c, c_ctx, running, &var_nbr)) {
 		unsigned nbr = count_non_anons(s_mask2, var_nbr);
 
 		char ch = 'A';
 		ch += nbr % 26;
 		unsigned n = (unsigned)nbr / 26;
 
-		if (dstlen && !(s_mask2[var_nbr]))
-			dst += snprintf(dst, dstlen, "%s", "_");
+		if (!(s_mask2[var_nbr]))
+			buf_strcat(b, "_");
 		else if (nbr < 26)
-			dst += snprintf(dst, dstlen, "%c", ch);
+			buf_printf(b, "%c", ch);
 		else
-			dst += snprintf(dst, dstlen, "%c%u", ch, n);
+			buf_printf(b, "%c%u", ch, n);
 
-		return dst - save_dst;
+		return buf_len(b) - save_len;
 	}
 
 	if (is_variable(c) && (running>0)) {
 		frame *g = GET_FRAME(c_ctx);
 		slot *e = GET_SLOT(g, c->var_nbr);
 		idx_t slot_nbr = e - q->slots;
-		dst += snprintf(dst, dstlen, "_%u", (unsigned)slot_nbr);
-		return dst - save_dst;
+		buf_printf(b, "_%u", (unsigned)slot_nbr);
+		return buf_len(b) - save_len;
 	}
 
 	if (is_string(c)) {
@@ -374,8 +458,8 @@ ssize_t print_canonical_to_buf(query *q, char *dst, size_t dstlen, cell *c, idx_
 
 		while (is_list(l)) {
 			if ((cnt > 256) && (running < 0)) {
-				dst += snprintf(dst, dstlen, "|...");
-				return dst - save_dst;
+				buf_strcat(b, "|...");
+				return buf_len(b) - save_len;
 			}
 
 			cell *h = LIST_HEAD(l);
@@ -394,79 +478,78 @@ ssize_t print_canonical_to_buf(query *q, char *dst, size_t dstlen, cell *c, idx_
 	const char *src = GET_STR(c);
 	int dq = 0, quote = !is_variable(c) && needs_quoting(q->st.m, src, LEN_STR(c));
 	if (is_string(c)) dq = quote = 1;
-	dst += snprintf(dst, dstlen, "%s", quote?dq?"\"":"'":"");
+	buf_strcat(b, quote?dq?"\"":"'":"");
 
 	if (quote || q->quoted)
-		dst += formatted(dst, dstlen, src, LEN_STR(c), dq);
+		buf_formatted(b, src, LEN_STR(c), dq);
 	else
-		dst += plain(dst, dstlen, src, LEN_STR(c));
+		buf_strcatn(b, src, LEN_STR(c));
 
-	dst += snprintf(dst, dstlen, "%s", quote?dq?"\"":"'":"");
+	buf_strcat(b, quote?dq?"\"":"'":"");
 
 	if (!is_structure(c))
-		return dst - save_dst;
+		return buf_len(b) - save_len;
 
 	idx_t arity = c->arity;
-	dst += snprintf(dst, dstlen, "(");
+	buf_strcat(b, "(");
 
 	for (c++; arity--; c += c->nbr_cells) {
 		cell *tmp = running ? deref(q, c, c_ctx) : c;
-		ssize_t res = print_canonical_to_buf(q, dst, dstlen, tmp, q->latest_ctx, running, cons, depth+1);
-		if (res < 0) return -1;
-		dst += res;
+		if (print_canonical_(q, b, tmp, q->latest_ctx, running, cons, depth+1) < 0)
+			return -1;
 
 		if (arity)
-			dst += snprintf(dst, dstlen, ",");
+			buf_strcat(b, ",");
 	}
 
-	dst += snprintf(dst, dstlen, ")");
-	return dst - save_dst;
+	buf_strcat(b, ")");
+	return buf_len(b) - save_len;
 }
 
 static char *varformat(unsigned nbr)
 {
-	static char tmpbuf[80];
+	static THREAD_LOCAL char tmpbuf[80];
 	char *dst = tmpbuf;
 	dst += sprintf(dst, "%c", 'A'+nbr%26);
 	if ((nbr/26) > 0) sprintf(dst, "%u", nbr/26);
 	return tmpbuf;
 }
 
-ssize_t print_term_to_buf(query *q, char *dst, size_t dstlen, cell *c, idx_t c_ctx, int running, bool cons, unsigned depth)
+static ssize_t print_term_(query *q, STRING *b, cell *c, idx_t c_ctx, int running, bool cons, unsigned depth)
 {
-	char *save_dst = dst;
+	const size_t save_len = buf_len(b);
 
 	if (depth > MAX_DEPTH)
 		return -1;
 
 	if (is_rational(c)) {
 		if (((c->flags & FLAG_HEX) || (c->flags & FLAG_BINARY))) {
-			dst += snprintf(dst, dstlen, "%s0x", c->val_num<0?"-":"");
-			dst += sprint_int(dst, dstlen, c->val_num, 16);
+			buf_printf(b, "%s0x", c->val_num<0?"-":"");
+			buf_int(b, c->val_num, 16);
 		} else if (c->val_den != 1) {
 			if (q->flag.rational_syntax_natural) {
-				dst += sprint_int(dst, dstlen, c->val_num, 10);
-				dst += snprintf(dst, dstlen, "/");
-				dst += sprint_int(dst, dstlen, c->val_den, 10);
+				buf_int(b, c->val_num, 10);
+				buf_strcat(b, "/");
+				buf_int(b, c->val_den, 10);
 			} else {
-				dst += sprint_int(dst, dstlen, c->val_num, 10);
-				dst += snprintf(dst, dstlen, " rdiv ");
-				dst += sprint_int(dst, dstlen, c->val_den, 10);
+				buf_int(b, c->val_num, 10);
+				buf_strcat(b, " rdiv ");
+				buf_int(b, c->val_den, 10);
 			}
 		} else
-			dst += sprint_int(dst, dstlen, c->val_num, 10);
+			buf_int(b, c->val_num, 10);
 
-		return dst - save_dst;
+		return buf_len(b) - save_len;
 	}
 
 	if (is_float(c) && (c->val_flt == M_PI)) {
-		dst += snprintf(dst, dstlen, "3.141592653589793");
-		return dst - save_dst;
+		buf_strcat(b, "3.141592653589793");
+		return buf_len(b) - save_len;
 	}
 
 	if (is_float(c) && (c->val_flt == M_E)) {
-		dst += snprintf(dst, dstlen, "2.718281828459045");
-		return dst - save_dst;
+		buf_strcat(b, "2.718281828459045");
+		return buf_len(b) - save_len;
 	}
 
 	if (is_float(c)) {
@@ -478,28 +561,28 @@ ssize_t print_term_to_buf(query *q, char *dst, size_t dstlen, cell *c, idx_t c_c
 			sprintf(tmpbuf, "%.*g", DBL_DECIMAL_DIG, c->val_flt);
 
 		reformat_float(tmpbuf);
-		dst += snprintf(dst, dstlen, "%s", tmpbuf);
-		return dst - save_dst;
+		buf_strcat(b, tmpbuf);
+		return buf_len(b) - save_len;
 	}
 
 	int is_chars_list = scan_is_chars_list(q, c, c_ctx, false);
 
 	if (is_chars_list) {
 		cell *l = c;
-		dst += snprintf(dst, dstlen, "%s", "\"");
+		buf_strcat(b, "\"");
 		LIST_HANDLER(l);
 
 		while (is_list(l)) {
 			cell *h = LIST_HEAD(l);
 			cell *c = deref(q, h, c_ctx);
-			dst += formatted(dst, dstlen, GET_STR(c), LEN_STR(c), false);
+			buf_formatted(b, GET_STR(c), LEN_STR(c), false);
 			l = LIST_TAIL(l);
 			l = deref(q, l, c_ctx);
 			c_ctx = q->latest_ctx;
 		}
 
-		dst += snprintf(dst, dstlen, "%s", "\"");
-		return dst - save_dst;
+		buf_strcat(b, "\"");
+		return buf_len(b) - save_len;
 	}
 
 	// FIXME make non-recursive
@@ -509,12 +592,12 @@ ssize_t print_term_to_buf(query *q, char *dst, size_t dstlen, cell *c, idx_t c_c
 
 	while (is_iso_list(c)) {
 		if (cnt++ > MAX_DEPTH) {
-			return ~(dst - save_dst);
+			return -1;
 		}
 
 		if (q->max_depth && (depth >= q->max_depth) && (running < 0)) {
-			dst += snprintf(dst, dstlen, "%s", "|...");
-			return dst - save_dst;
+			buf_strcat(b, "|...");
+			return buf_len(b) - save_len;
 		}
 
 		LIST_HANDLER(c);
@@ -522,7 +605,7 @@ ssize_t print_term_to_buf(query *q, char *dst, size_t dstlen, cell *c, idx_t c_c
 		cell *head = LIST_HEAD(c);
 
 		if (!cons)
-			dst += snprintf(dst, dstlen, "%s", "[");
+			buf_strcat(b, "[");
 
 		head = running ? deref(q, head, c_ctx) : head;
 		idx_t head_ctx = q->latest_ctx;
@@ -532,11 +615,10 @@ ssize_t print_term_to_buf(query *q, char *dst, size_t dstlen, cell *c, idx_t c_c
 			|| !strcmp(GET_STR(head), "*->")
 			|| !strcmp(GET_STR(head), "-->"));
 		int parens = is_structure(head) && special_op;
-		if (parens) dst += snprintf(dst, dstlen, "%s", "(");
-		ssize_t res = print_term_to_buf(q, dst, dstlen, head, head_ctx, running, 0, depth+1);
-		if (res < 0) return -1;
-		dst += res;
-		if (parens) dst += snprintf(dst, dstlen, "%s", ")");
+		if (parens) buf_strcat(b, "(");
+		if (print_term_(q, b, head, head_ctx, running, 0, depth+1) < 0)
+			return -1;
+		if (parens) buf_strcat(b, ")");
 
 		cell *tail = LIST_TAIL(c);
 		tail = running ? deref(q, tail, c_ctx) : tail;
@@ -546,13 +628,12 @@ ssize_t print_term_to_buf(query *q, char *dst, size_t dstlen, cell *c, idx_t c_c
 			src = GET_STR(tail);
 
 			if (strcmp(src, "[]")) {
-				dst += snprintf(dst, dstlen, "%s", "|");
-				ssize_t res = print_term_to_buf(q, dst, dstlen, tail, c_ctx, running, 1, depth+1);
-				if (res < 0) return -1;
-				dst += res;
+				buf_strcat(b, "|");
+				if (print_term_(q, b, tail, c_ctx, running, 1, depth+1) < 0)
+					return -1;
 			}
 		} else if (is_iso_list(tail)) {
-			dst += snprintf(dst, dstlen, "%s", ",");
+			buf_strcat(b, ",");
 			c = tail;
 			print_list++;
 			cons = 1;
@@ -562,24 +643,23 @@ ssize_t print_term_to_buf(query *q, char *dst, size_t dstlen, cell *c, idx_t c_c
 			LIST_HANDLER(l);
 
 			while (is_list(l)) {
-				dst += snprintf(dst, dstlen, "%s", ",");
+				buf_strcat(b, ",");
 				cell *h = LIST_HEAD(l);
-				dst += formatted(dst, dstlen, GET_STR(h), LEN_STR(h), false);
+				buf_formatted(b, GET_STR(h), LEN_STR(h), false);
 				l = LIST_TAIL(l);
 			}
 
 			print_list++;
 		} else {
-			dst += snprintf(dst, dstlen, "%s", "|");
-			ssize_t res = print_term_to_buf(q, dst, dstlen, tail, c_ctx, running, 1, depth+1);
-			if (res < 0) return -1;
-			dst += res;
+			buf_strcat(b, "|");
+			if (print_term_(q, b, tail, c_ctx, running, 1, depth+1) < 0)
+				return -1;
 		}
 
 		if (!cons || print_list)
-			dst += snprintf(dst, dstlen, "%s", "]");
+			buf_strcat(b, "]");
 
-		return dst - save_dst;
+		return buf_len(b) - save_len;
 	}
 
 	int optype = GET_OP(c);
@@ -601,8 +681,8 @@ ssize_t print_term_to_buf(query *q, char *dst, size_t dstlen, cell *c, idx_t c_c
 
 		if (running && is_literal(c) && !strcmp(src, "$VAR") && q->numbervars && is_integer(c+1)) {
 			unsigned var_nbr = ((c+1)->val_num) - q->nv_start;
-			dst += snprintf(dst, dstlen, "%s", varformat(var_nbr));
-			return dst - save_dst;
+			buf_strcat(b, varformat(var_nbr));
+			return buf_len(b) - save_len;
 		}
 
 		if (running && is_variable(c) && q->variable_names) {
@@ -617,8 +697,8 @@ ssize_t print_term_to_buf(query *q, char *dst, size_t dstlen, cell *c, idx_t c_c
 				cell *val = h+2;
 
 				if (!strcmp(GET_STR(val), GET_STR(c))) {
-					dst += snprintf(dst, dstlen, "%s", GET_STR(name));
-					return dst - save_dst;
+					buf_strcat(b, GET_STR(name));
+					return buf_len(b) - save_len;
 				}
 
 				l = LIST_TAIL(l);
@@ -627,14 +707,14 @@ ssize_t print_term_to_buf(query *q, char *dst, size_t dstlen, cell *c, idx_t c_c
 			}
 		}
 
-		dst += snprintf(dst, dstlen, "%s", !braces&&quote?dq?"\"":"'":"");
+		buf_strcat(b, !braces&&quote?dq?"\"":"'":"");
 
 		if (running && is_variable(c)
 			&& ((c_ctx != q->st.curr_frame) || is_fresh(c) || (running > 0))) {
 			frame *g = GET_FRAME(c_ctx);
 			slot *e = GET_SLOT(g, c->var_nbr);
-			dst += snprintf(dst, dstlen, "_%u", (unsigned)(e - q->slots));
-			return dst - save_dst;
+			buf_printf(b, "_%u", (unsigned)(e - q->slots));
+			return buf_len(b) - save_len;
 		}
 
 		int len_str = LEN_STR(c);
@@ -645,18 +725,18 @@ ssize_t print_term_to_buf(query *q, char *dst, size_t dstlen, cell *c, idx_t c_c
 			if ((running < 0) && is_blob(c) && (len_str > 256))
 				len_str = 256;
 
-			dst += formatted(dst, dstlen, src, LEN_STR(c), dq);
+			buf_formatted(b, src, LEN_STR(c), dq);
 
 			if ((running < 0) && is_blob(c) && (len_str == 256))
-				dst += snprintf(dst, dstlen, "%s", "|...");
+				buf_strcat(b, "|...");
 		} else
-			dst += plain(dst, dstlen, src, LEN_STR(c));
+			buf_strcatn(b, src, LEN_STR(c));
 
-		dst += snprintf(dst, dstlen, "%s", !braces&&quote?dq?"\"":"'":"");
+		buf_strcat(b, !braces&&quote?dq?"\"":"'":"");
 
 		if (is_structure(c) && !is_string(c)) {
 			idx_t arity = c->arity;
-			dst += snprintf(dst, dstlen, "%s", braces?"{":"(");
+			buf_strcat(b, braces?"{":"(");
 
 			for (c++; arity--; c += c->nbr_cells) {
 				cell *tmp = running ? deref(q, c, c_ctx) : c;
@@ -673,23 +753,22 @@ ssize_t print_term_to_buf(query *q, char *dst, size_t dstlen, cell *c, idx_t c_c
 				}
 
 				if (parens)
-					dst += snprintf(dst, dstlen, "%s", "(");
+					buf_strcat(b, "(");
 
-				ssize_t res = print_term_to_buf(q, dst, dstlen, tmp, tmp_ctx, running, 0, depth+1);
-				if (res < 0) return -1;
-				dst += res;
+				if (print_term_(q, b, tmp, tmp_ctx, running, 0, depth+1) < 0)
+					return -1;
 
 				if (parens)
-					dst += snprintf(dst, dstlen, "%s", ")");
+					buf_strcat(b, ")");
 
 				if (arity)
-					dst += snprintf(dst, dstlen, "%s", ",");
+					buf_strcat(b, ",");
 			}
 
-			dst += snprintf(dst, dstlen, "%s", braces?"}":")");
+			buf_strcat(b, braces?"}":")");
 		}
 
-		return dst - save_dst;
+		return buf_len(b) - save_len;
 	}
 
 	// Postfix...
@@ -698,11 +777,10 @@ ssize_t print_term_to_buf(query *q, char *dst, size_t dstlen, cell *c, idx_t c_c
 		cell *lhs = c + 1;
 		lhs = running ? deref(q, lhs, c_ctx) : lhs;
 		idx_t lhs_ctx = q->latest_ctx;
-		ssize_t res = print_term_to_buf(q, dst, dstlen, lhs, lhs_ctx, running, 0, depth+1);
-		if (res < 0) return -1;
-		dst += res;
-		dst += snprintf(dst, dstlen, "%s", src);
-		return dst - save_dst;
+		if (print_term_(q, b, lhs, lhs_ctx, running, 0, depth+1) < 0)
+			return -1;
+		buf_strcat(b, src);
+		return buf_len(b) - save_len;
 	}
 
 	// Prefix...
@@ -713,16 +791,15 @@ ssize_t print_term_to_buf(query *q, char *dst, size_t dstlen, cell *c, idx_t c_c
 		idx_t rhs_ctx = q->latest_ctx;
 		int space = iswalpha(peek_char_utf8(src)) || !strcmp(src, ":-") || !strcmp(src, "\\+");
 		space += (!strcmp(src, "-") || !strcmp(src, "+")) && is_rational(rhs) && (rhs->val_num < 0);
-		//if (!strcmp(src, "-") && !is_rational(rhs)) dst += snprintf(dst, dstlen, "%s", " ");
+		//if (!strcmp(src, "-") && !is_rational(rhs)) buf_strcat(b, " ");
 		int parens = is_structure(rhs) && !strcmp(GET_STR(rhs), ",");
-		dst += snprintf(dst, dstlen, "%s", src);
-		if (space && !parens) dst += snprintf(dst, dstlen, "%s", " ");
-		if (parens) dst += snprintf(dst, dstlen, "%s", " (");
-		ssize_t res = print_term_to_buf(q, dst, dstlen, rhs, rhs_ctx, running, 0, depth+1);
-		if (res < 0) return -1;
-		dst += res;
-		if (parens) dst += snprintf(dst, dstlen, "%s", ")");
-		return dst - save_dst;
+		buf_strcat(b, src);
+		if (space && !parens) buf_strcat(b, " ");
+		if (parens) buf_strcat(b, " (");
+		if (print_term_(q, b, rhs, rhs_ctx, running, 0, depth+1) < 0)
+			return -1;
+		if (parens) buf_strcat(b, ")");
+		return buf_len(b) - save_len;
 	}
 
 	// Infix...
@@ -743,11 +820,10 @@ ssize_t print_term_to_buf(query *q, char *dst, size_t dstlen, cell *c, idx_t c_c
 	int lhs_parens = lhs_pri_1 >= my_priority;
 	if ((lhs_pri_1 == my_priority) && IS_YFX(c)) lhs_parens = 0;
 	lhs_parens += lhs_pri_2 > 0;
-	if (lhs_parens) dst += snprintf(dst, dstlen, "%s", "(");
-	ssize_t res = print_term_to_buf(q, dst, dstlen, lhs, lhs_ctx, running, 0, depth+1);
-	if (res < 0) return -1;
-	dst += res;
-	if (lhs_parens) dst += snprintf(dst, dstlen, "%s", ")");
+	if (lhs_parens) buf_strcat(b, "(");
+	if (print_term_(q, b, lhs, lhs_ctx, running, 0, depth+1) < 0)
+		return -1;
+	if (lhs_parens) buf_strcat(b, ")");
 
 	int space = iswalpha(peek_char_utf8(src)) || iswspace(*src)
 		|| !strcmp(src, ":-") || !strcmp(src, "-->")
@@ -755,210 +831,192 @@ ssize_t print_term_to_buf(query *q, char *dst, size_t dstlen, cell *c, idx_t c_c
 		|| !strcmp(src, "=~=") || !strcmp(src, "=..")
 		|| !strcmp(src, "=>")|| !strcmp(src, "?=")
 		|| !*src;
-	if (space) dst += snprintf(dst, dstlen, "%s", " ");
+	if (space) buf_strcat(b, " ");
 
-	dst += snprintf(dst, dstlen, "%s", src);
+	buf_strcat(b, src);
 	if (!*src) space = 0;
 	space += is_rational(rhs) && (rhs->val_num < 0);
-	if (space) dst += snprintf(dst, dstlen, "%s", " ");
+	if (space) buf_strcat(b, " ");
 
 	int rhs_parens = rhs_pri_1 >= my_priority;
 	if ((rhs_pri_1 == my_priority) && IS_XFY(c)) rhs_parens = 0;
 	rhs_parens += rhs_pri_2 > 0;
-	if (rhs_parens) dst += snprintf(dst, dstlen, "%s", "(");
-	res = print_term_to_buf(q, dst, dstlen, rhs, rhs_ctx, running, 0, depth+1);
-	if (res < 0) return -1;
-	dst += res;
-	if (rhs_parens) dst += snprintf(dst, dstlen, "%s", ")");
+	if (rhs_parens) buf_strcat(b, "(");
+	if (print_term_(q, b, rhs, rhs_ctx, running, 0, depth+1) < 0)
+		return -1;
+	if (rhs_parens) buf_strcat(b, ")");
 
-	return dst - save_dst;
+	return buf_len(b) - save_len;
 }
 
-char *print_canonical_to_strbuf(query *q, cell *c, idx_t c_ctx, int running)
+static void start_canonical(query *q, cell *c, idx_t c_ctx)
+{
+	fake_numbervars(q, c, c_ctx, 0);
+	memset(s_mask1, 0, MAX_ARITY);
+	memset(s_mask2, 0, MAX_ARITY);
+	q->nv_start = -1;
+	mark_canonical_vars(q, c, c_ctx, 0);
+}
+
+// A cyclic term is detected by going too deep, in which case it is
+// written again as the raw cells (which are never cyclic).
+
+static void print_canonical_all(query *q, STRING *b, cell *c, idx_t c_ctx, int running)
 {
-	bool cycle_error = false;
-	ssize_t len = print_canonical_to_buf(q, NULL, 0, c, c_ctx, running, false, 0);
+	if (running)
+		start_canonical(q, c, c_ctx);
 
-	if (len < 0) {
-		running = 0;
-		len = print_canonical_to_buf(q, NULL, 0, c, c_ctx, running, false, 1);
-		cycle_error = true;
-	}
+	q->cycle_error = false;
 
-	char *buf = malloc(len+10);
-	ensure(buf);
-	len = print_canonical_to_buf(q, buf, len+1, c, c_ctx, running, false, 0);
-	q->cycle_error = cycle_error;
-	return buf;
+	if (print_canonical_(q, b, c, c_ctx, running, false, 0) < 0) {
+		b->dst = b->buf;
+		DISCARD_RESULT print_canonical_(q, b, c, c_ctx, 0, false, 0);
+		q->cycle_error = true;
+	}
 }
 
-pl_status print_canonical_to_stream(query *q, stream *str, cell *c, idx_t c_ctx, int running)
+static void print_term_all(query *q, STRING *b, cell *c, idx_t c_ctx, int running)
 {
-	bool cycle_error = false;
-	ssize_t len = print_canonical_to_buf(q, NULL, 0, c, c_ctx, running, false, 0);
+	q->cycle_error = false;
 
-	if (len < 0) {
-		running = 0;
-		len = print_canonical_to_buf(q, NULL, 0, c, c_ctx, running, false, 1);
-		cycle_error = true;
+	if (print_term_(q, b, c, c_ctx, running, false, 0) < 0) {
+		b->dst = b->buf;
+		DISCARD_RESULT print_term_(q, b, c, c_ctx, 0, false, 0);
+		q->cycle_error = true;
 	}
+}
 
-	char *dst = malloc(len*2+1); //cehteh: why *2?
-	may_ptr_error(dst);
-	len = print_canonical_to_buf(q, dst, len+1, c, c_ctx, running, false, 0);
-	const char *src = dst;
+// Copy out as much as fits, returning the full length.
 
-	if (q->nv_start == -1) {
-		memset(q->nv_mask, 0, MAX_ARITY);
-		q->nv_start = 0;
+static ssize_t copy_out(char *dst, size_t dstlen, const STRING *b, ssize_t len)
+{
+	if (dst && dstlen && (len >= 0)) {
+		size_t n = (size_t)len < dstlen ? (size_t)len : dstlen - 1;
+		if (n) memcpy(dst, b->buf, n);
+		dst[n] = '\0';
 	}
 
-	while (len) {
-		size_t nbytes = net_write(src, len, str);
+	return len;
+}
 
-		if (feof(str->fp)) {
-			q->error = true;
-			free(dst);
-			q->cycle_error = cycle_error;
-			return pl_error; //cehteh: need a pl_eof error?
-		}
+ssize_t print_canonical_to_buf(query *q, char *dst, size_t dstlen, cell *c, idx_t c_ctx, int running, bool cons, unsigned depth)
+{
+	STRING b = {0};
 
-		len -= nbytes;
-		src += nbytes;
-	}
+	if (running && !depth)
+		start_canonical(q, c, c_ctx);
 
-	free(dst);
-	q->cycle_error = cycle_error;
-	return pl_success;
+	ssize_t len = copy_out(dst, dstlen, &b, print_canonical_(q, &b, c, c_ctx, running, cons, depth));
+	free(b.buf);
+	return len;
 }
 
-pl_status print_canonical(query *q, FILE *fp, cell *c, idx_t c_ctx, int running)
+ssize_t print_term_to_buf(query *q, char *dst, size_t dstlen, cell *c, idx_t c_ctx, int running, bool cons, unsigned depth)
 {
-	bool cycle_error = false;
-	ssize_t len = print_canonical_to_buf(q, NULL, 0, c, c_ctx, running, false, 0);
+	STRING b = {0};
+	ssize_t len = copy_out(dst, dstlen, &b, print_term_(q, &b, c, c_ctx, running, cons, depth));
+	free(b.buf);
+	return len;
+}
 
-	if (len < 0) {
-		running = 0;
-		len = print_canonical_to_buf(q, NULL, 0, c, c_ctx, running, false, 1);
-		cycle_error = true;
-	}
+// Output to streams goes via a per-thread buffer, which is kept for
+// reuse unless it grew large.
 
-	char *dst = malloc(len*2+1); //cehteh: why *2?
-	may_ptr_error(dst);
-	len = print_canonical_to_buf(q, dst, len+1, c, c_ctx, running, false, 0);
-	const char *src = dst;
+#define MAX_OUTBUF_KEEP (1024*1024)
 
-	if (q->nv_start == -1) {
-		memset(q->nv_mask, 0, MAX_ARITY);
-		q->nv_start = 0;
-	}
+static THREAD_LOCAL STRING s_outbuf = {0};
+
+static pl_status flush_outbuf(query *q, stream *str, FILE *fp)
+{
+	const char *src = s_outbuf.buf;
+	size_t len = buf_len(&s_outbuf);
+	pl_status ok = pl_success;
 
 	while (len) {
-		size_t nbytes = fwrite(src, 1, len, fp);
+		size_t nbytes = str ? net_write(src, len, str) : fwrite(src, 1, len, fp);
 
-		if (feof(fp)) {
+		if (feof(str ? str->fp : fp)) {
 			q->error = true;
-			free(dst);
-			q->cycle_error = cycle_error;
-			return pl_error;
+			ok = pl_error;
+			break;
 		}
 
 		len -= nbytes;
 		src += nbytes;
 	}
 
-	free(dst);
-	q->cycle_error = cycle_error;
-	return pl_success;
+	if (s_outbuf.size > MAX_OUTBUF_KEEP) {
+		free(s_outbuf.buf);
+		s_outbuf = (STRING){0};
+	} else
+		s_outbuf.dst = s_outbuf.buf;
+
+	return ok;
 }
 
-char *print_term_to_strbuf(query *q, cell *c, idx_t c_ctx, int running)
+char *print_canonical_to_strbuf(query *q, cell *c, idx_t c_ctx, int running)
 {
-	bool cycle_error = false;
-	ssize_t len = print_term_to_buf(q, NULL, 0, c, c_ctx, running, false, 0);
+	STRING b = {0};
+	print_canonical_all(q, &b, c, c_ctx, running);
 
-	if (len < 0) {
-		running = 0;
-		len = print_term_to_buf(q, NULL, 0, c, c_ctx, running, false, 1);
-		cycle_error = true;
+	if (!b.buf) {
+		b.buf = strdup("");
+		ensure(b.buf);
 	}
 
-	char *buf = malloc(len+10);
-	ensure(buf);
-	len = print_term_to_buf(q, buf, len+1, c, c_ctx, running, false, 0);
-	q->numbervars = false;
-	q->cycle_error = cycle_error;
-	return buf;
+	return b.buf;
 }
 
-pl_status print_term_to_stream(query *q, stream *str, cell *c, idx_t c_ctx, int running)
+pl_status print_canonical_to_stream(query *q, stream *str, cell *c, idx_t c_ctx, int running)
 {
-	bool cycle_error = false;
-	ssize_t len = print_term_to_buf(q, NULL, 0, c, c_ctx, running, false, 0);
+	print_canonical_all(q, &s_outbuf, c, c_ctx, running);
 
-	if (len < 0) {
-		running = 0;
-		len = print_term_to_buf(q, NULL, 0, c, c_ctx, running, false, 1);
-		cycle_error = true;
+	if (q->nv_start == -1) {
+		memset(q->nv_mask, 0, MAX_ARITY);
+		q->nv_start = 0;
 	}
 
-	char *dst = malloc(len+10);
-	may_ptr_error(dst);
-	len = print_term_to_buf(q, dst, len+1, c, c_ctx, running, false, 0);
-	const char *src = dst;
-
-	while (len) {
-		size_t nbytes = net_write(src, len, str);
+	return flush_outbuf(q, str, NULL);
+}
 
-		if (feof(str->fp)) {
-			q->error = true;
-			free(dst);
-			q->cycle_error = cycle_error;
-			return pl_error;
-		}
+pl_status print_canonical(query *q, FILE *fp, cell *c, idx_t c_ctx, int running)
+{
+	print_canonical_all(q, &s_outbuf, c, c_ctx, running);
 
-		len -= nbytes;
-		src += nbytes;
+	if (q->nv_start == -1) {
+		memset(q->nv_mask, 0, MAX_ARITY);
+		q->nv_start = 0;
 	}
 
-	free(dst);
-	q->numbervars = false;
-	q->cycle_error = cycle_error;
-	return pl_success;
+	return flush_outbuf(q, NULL, fp);
 }
 
-pl_status print_term(query *q, FILE *fp, cell *c, idx_t c_ctx, int running)
+char *print_term_to_strbuf(query *q, cell *c, idx_t c_ctx, int running)
 {
-	bool cycle_error = false;
-	ssize_t len = print_term_to_buf(q, NULL, 0, c, c_ctx, running, false, 0);
+	STRING b = {0};
+	print_term_all(q, &b, c, c_ctx, running);
+	q->numbervars = false;
 
-	if (len < 0) {
-		running = 0;
-		len = print_term_to_buf(q, NULL, 0, c, c_ctx, running, false, 1);
-		cycle_error = true;
+	if (!b.buf) {
+		b.buf = strdup("");
+		ensure(b.buf);
 	}
 
-	char *dst = malloc(len+10);
-	may_ptr_error(dst);
-	len = print_term_to_buf(q, dst, len+1, c, c_ctx, running, false, 0);
-	const char *src = dst;
-
-	while (len) {
-		size_t nbytes = fwrite(src, 1, len, fp);
-
-		if (feof(fp)) {
-			q->error = true;
-			free(dst);
-			q->cycle_error = cycle_error;
-			return pl_error;
-		}
+	return b.buf;
+}
 
-		len -= nbytes;
-		src += nbytes;
-	}
+pl_status print_term_to_stream(query *q, stream *str, cell *c, idx_t c_ctx, int running)
+{
+	print_term_all(q, &s_outbuf, c, c_ctx, running);
+	pl_status ok = flush_outbuf(q, str, NULL);
+	q->numbervars = false;
+	return ok;
+}
 
-	free(dst);
+pl_status print_term(query *q, FILE *fp, cell *c, idx_t c_ctx, int running)
+{
+	print_term_all(q, &s_outbuf, c, c_ctx, running);
+	pl_status ok = flush_outbuf(q, NULL, fp);
 	q->numbervars = false;
-	q->cycle_error = cycle_error;
-	return pl_success;
+	return ok;
 }
@@ -7,6 +7,10 @@
 #include <float.h>
 #include <sys/time.h>
 
+#if USE_THREADS
+#include <sys/mman.h>
+#endif
+
 #include "internal.h"
 #include "history.h"
 #include "library.h"
@@ -20,13 +24,19 @@
 #include "utf8.h"
 
 static const size_t INITIAL_POOL_SIZE = 64000;	// bytes
+static const size_t INITIAL_SYMTAB_SIZE = 4096;	// power of 2
+static const size_t ATOM_GC_MIN_BYTES = 1024*1024;
+
+#if USE_THREADS
+static const size_t POOL_RESERVE = (size_t)1024*1024*1024;	// bytes
+#endif
 
 stream g_streams[MAX_STREAMS] = {{0}};
 idx_t g_empty_s, g_pair_s, g_dot_s, g_cut_s, g_nil_s, g_true_s, g_fail_s;
 idx_t g_anon_s, g_clause_s, g_eof_s, g_lt_s, g_gt_s, g_eq_s, g_false_s;
 idx_t g_sys_elapsed_s, g_sys_queue_s, g_braces_s, g_call_s, g_braces_s;
 idx_t g_stream_property_s, g_unify_s, g_on_s, g_off_s, g_sys_var_s;
-idx_t g_plus_s, g_minus_s, g_once_s, g_post_unify_hook_s, g_sys_record_key_s;
+idx_t g_plus_s, g_minus_s, g_once_s, g_post_unify_hook_s, g_alarm_hook_s, g_sys_record_key_s;
 unsigned g_cpu_count = 4;
 char *g_tpl_lib = NULL;
 int g_ac = 0, g_avc = 1;
@@ -49,35 +59,463 @@ bool is_multifile_in_db(prolog *pl, const char *mod, const char *name, idx_t ari
 	return h->is_multifile ? true : false;
 }
 
-static idx_t add_to_pool(prolog *pl, const char *name)
+// The symbol table is an open-addressing hash table (linear probing)
+// of offsets into the pool, keyed by the text stored there...
+
+static uint32_t hash_symbol(const char *name, size_t *len)
+{
+	const char *src = name;
+	uint32_t h = 2166136261U;
+
+	while (*src) {
+		h ^= (uint8_t)*src++;
+		h *= 16777619U;
+	}
+
+	*len = src - name;
+	return h;
+}
+
+static symbol *find_symbol(const prolog *pl, const char *name, uint32_t hash)
+{
+	idx_t mask = pl->symtab_size - 1;
+	idx_t i = hash & mask;
+
+	for (;;) {
+		symbol *s = pl->symtab + i;
+
+		if (s->val_off == ERR_IDX)
+			return s;
+
+		if ((s->hash == hash) && !strcmp(pl->pool + s->val_off, name))
+			return s;
+
+		i = (i + 1) & mask;
+	}
+}
+
+static bool grow_symtab(prolog *pl)
+{
+	idx_t new_size = pl->symtab_size * 2;
+	symbol *tab = malloc(sizeof(symbol) * new_size);
+	if (!tab) return false;
+
+	for (idx_t i = 0; i < new_size; i++)
+		tab[i].val_off = ERR_IDX;
+
+	idx_t mask = new_size - 1;
+
+	for (idx_t i = 0; i < pl->symtab_size; i++) {
+		const symbol *s = pl->symtab + i;
+
+		if (s->val_off == ERR_IDX)
+			continue;
+
+		idx_t j = s->hash & mask;
+
+		while (tab[j].val_off != ERR_IDX)
+			j = (j + 1) & mask;
+
+		tab[j] = *s;
+	}
+
+	free(pl->symtab);
+	pl->symtab = tab;
+	pl->symtab_size = new_size;
+	return true;
+}
+
+// Gaps are binned by the floor of log2 of their length, so any gap
+// in bin 'ceil(log2(n))' or above will hold 'n' bytes...
+
+static unsigned gap_bin(idx_t len, bool round_up)
+{
+	unsigned bin = 0;
+
+	while (((idx_t)1 << (bin+1)) <= len)
+		bin++;
+
+	if (round_up && (((idx_t)1 << bin) < len))
+		bin++;
+
+	return bin < MAX_POOL_BINS ? bin : MAX_POOL_BINS-1;
+}
+
+static void add_gap(prolog *pl, idx_t off, idx_t len)
+{
+	unsigned bin = gap_bin(len, false);
+
+	if (pl->pool_gaps_nbr[bin] == pl->pool_gaps_size[bin]) {
+		idx_t new_size = pl->pool_gaps_size[bin] ? pl->pool_gaps_size[bin] * 2 : 16;
+		pool_gap *tmp = realloc(pl->pool_gaps[bin], sizeof(pool_gap) * new_size);
+		if (!tmp) return;	// just lose the space
+		pl->pool_gaps[bin] = tmp;
+		pl->pool_gaps_size[bin] = new_size;
+	}
+
+	pool_gap *g = pl->pool_gaps[bin] + pl->pool_gaps_nbr[bin]++;
+	g->off = off;
+	g->len = len;
+}
+
+static idx_t alloc_from_gaps(prolog *pl, idx_t len)
+{
+	for (unsigned bin = gap_bin(len, true); bin < MAX_POOL_BINS; bin++) {
+		for (idx_t i = 0; i < pl->pool_gaps_nbr[bin]; i++) {
+			pool_gap g = pl->pool_gaps[bin][i];
+
+			if (g.len < len)
+				continue;
+
+			pl->pool_gaps[bin][i] = pl->pool_gaps[bin][--pl->pool_gaps_nbr[bin]];
+
+			if (g.len > len)
+				add_gap(pl, g.off+len, g.len-len);
+
+			return g.off;
+		}
+	}
+
+	return ERR_IDX;
+}
+
+// With threads the pool is reserved up front and never moves, as
+// other threads read atom names from it without holding a lock...
+
+static bool resize_pool(prolog *pl, size_t nbytes)
 {
-	idx_t offset = pl->pool_offset;
-	size_t len = strlen(name);
-
-	while ((offset+len+1+1) >= pl->pool_size) {
-		size_t nbytes = pl->pool_size * 2;
-		char *tmp = realloc(pl->pool, nbytes);
-		if (!tmp) return ERR_IDX;
-		pl->pool = tmp;
+#if USE_THREADS
+	if (nbytes > pl->pool_size)
+		return false;
+
+	size_t page = 4096, from = (nbytes + page - 1) & ~(page - 1);
+
+	if (from < pl->pool_size)
+		madvise(pl->pool + from, pl->pool_size - from, MADV_DONTNEED);
+
+	return true;
+#else
+	char *tmp = realloc(pl->pool, nbytes);
+	if (!tmp) return false;
+	pl->pool = tmp;
+
+	if (nbytes > pl->pool_size)
 		memset(pl->pool + pl->pool_size, 0, nbytes - pl->pool_size);
-		pl->pool_size = nbytes;
+
+	pl->pool_size = nbytes;
+	return true;
+#endif
+}
+
+static idx_t add_to_pool(prolog *pl, const char *name, size_t len, uint32_t hash)
+{
+	if (((pl->symtab_count + 1) * 4) >= (pl->symtab_size * 3)) {
+		if (!grow_symtab(pl))
+			return ERR_IDX;
+	}
+
+	idx_t offset = alloc_from_gaps(pl, len+1);
+
+	if (offset == ERR_IDX) {
+		offset = pl->pool_offset;
+
+		while ((offset+len+1+1) >= pl->pool_size) {
+			if (!resize_pool(pl, pl->pool_size * 2))
+				return ERR_IDX;
+		}
+
+		pl->pool_offset += len + 1;
 	}
 
 	memcpy(pl->pool + offset, name, len+1);
-	pl->pool_offset += len + 1;
-	const char *key = strdup(name);
-	m_set(pl->symtab, key, (void*)(unsigned long)offset);
+	pl->pool_alloced += len + 1;
+	symbol *s = find_symbol(pl, name, hash);
+	s->hash = hash;
+	s->val_off = offset;
+	pl->symtab_count++;
 	return offset;
 }
 
+bool is_in_pool(prolog *pl, const char *name, idx_t *val_off)
+{
+	size_t len;
+	uint32_t hash = hash_symbol(name, &len);
+	acquire(&pl->pool_lock);
+	const symbol *s = find_symbol(pl, name, hash);
+	idx_t off = s->val_off;
+	release(&pl->pool_lock);
+
+	if (off == ERR_IDX)
+		return false;
+
+	*val_off = off;
+	return true;
+}
+
 idx_t index_from_pool(prolog *pl, const char *name)
 {
-	const void *val;
+	size_t len;
+	uint32_t hash = hash_symbol(name, &len);
+	acquire(&pl->pool_lock);
+	const symbol *s = find_symbol(pl, name, hash);
+	idx_t off = s->val_off;
+
+	if (off == ERR_IDX)
+		off = add_to_pool(pl, name, len, hash);
+
+	release(&pl->pool_lock);
+	return off;
+}
 
-	if (m_get(pl->symtab, name, &val))
-		return (idx_t)(unsigned long)val;
+// Atom GC. The pool offsets in use are found by marking from every
+// place a cell can live: the clauses (including those retracted but
+// still on a dirty list) and argument index keys of every module, the
+// terms held by live parsers and the heap, slots, queues and temporary
+// heap of the query. Atoms interned while creating the prolog are
+// never collected, as C code holds on to them. The symbol table is
+// then rebuilt from the survivors and the space between them binned
+// for reuse by add_to_pool(). It is only safe between goals when the
+// query is the only one running, as other queries (and C callers
+// further up the stack) may hold offsets of their own.
+
+static void mark_atom(const prolog *pl, uint8_t *marks, idx_t off)
+{
+	if (off < pl->pool_offset)
+		marks[off/8] |= 1 << (off%8);
+}
 
-	return add_to_pool(pl, name);
+static void mark_cells(const prolog *pl, uint8_t *marks, const cell *c, idx_t nbr_cells)
+{
+	for (idx_t i = 0; i < nbr_cells; i++, c++) {
+		if (is_literal(c) || is_variable(c))
+			mark_atom(pl, marks, c->val_off);
+	}
+}
+
+static void mark_modules(const prolog *pl, uint8_t *marks)
+{
+	for (const module *m = pl->modules; m; m = m->next) {
+		mark_atom(pl, marks, m->id);
+
+		for (const predicate *h = m->head; h; h = h->next) {
+			mark_cells(pl, marks, &h->key, 1);
+
+			for (const clause *r = h->head; r; r = r->next)
+				mark_cells(pl, marks, r->t.cells, r->t.cidx);
+
+			for (unsigned i = 0; h->arg_idx && (i < h->key.arity); i++) {
+				const arg_index *ai = &h->arg_idx[i];
+
+				for (idx_t j = 0; j < ai->capacity; j++) {
+					if (ai->table[j])
+						mark_cells(pl, marks, &ai->table[j]->key, 1);
+				}
+			}
+		}
+	}
+}
+
+static void mark_query(const prolog *pl, uint8_t *marks, const query *q)
+{
+	for (const arena *a = q->arenas; a; a = a->next)
+		mark_cells(pl, marks, a->heap, a->hp);
+
+	// Choices may restore slots beyond the current ones...
+
+	idx_t max_sp = q->st.sp;
+
+	for (idx_t i = 0; i < q->cp; i++) {
+		const choice *ch = q->choices + i;
+
+		if (ch->st.sp > max_sp)
+			max_sp = ch->st.sp;
+	}
+
+	for (idx_t i = 0; (i < max_sp) && (i < q->slots_size); i++)
+		mark_cells(pl, marks, &q->slots[i].c, 1);
+
+	if (q->tmp_heap)
+		mark_cells(pl, marks, q->tmp_heap, q->tmphp);
+
+	for (unsigned i = 0; i < MAX_QUEUES; i++) {
+		if (q->queue[i])
+			mark_cells(pl, marks, q->queue[i], q->qp[i]);
+
+		if (q->tmpq[i])
+			mark_cells(pl, marks, q->tmpq[i], q->tmpq_size[i]);
+	}
+
+	mark_cells(pl, marks, &q->accum, 1);
+
+	for (idx_t i = 0; i < q->st.tp; i++) {
+		const trail *tr = q->trails + i;
+
+		if (tr->ctx != ERR_IDX)
+			continue;
+
+		const global_undo *u = (const global_undo*)tr->attrs;
+		mark_cells(pl, marks, &u->key, 1);
+
+		if (u->val)
+			mark_cells(pl, marks, u->val->cells, u->val->cidx);
+	}
+
+	for (unsigned i = 0; i < q->alarms.cnt; i++) {
+		const alarm_slot *a = q->alarms.slots + q->alarms.heap[i];
+		mark_cells(pl, marks, a->goal->cells, a->goal->cidx);
+	}
+}
+
+static void mark_global_vars(const prolog *pl, uint8_t *marks, const global_vars *gv)
+{
+	for (idx_t i = 0; i < gv->size; i++) {
+		const global_var *v = gv->vars + i;
+
+		if (!v->val)
+			continue;
+
+		mark_cells(pl, marks, &v->key, 1);
+		mark_cells(pl, marks, v->val->cells, v->val->cidx);
+	}
+}
+
+typedef struct {
+	const prolog *pl;
+	uint8_t *marks;
+} atom_marker;
+
+static void mark_queued_term(const term *t, void *data)
+{
+	const atom_marker *am = data;
+	mark_cells(am->pl, am->marks, t->cells, t->cidx);
+}
+
+static int offset_cmp(const void *p1, const void *p2)
+{
+	idx_t off1 = *(const idx_t*)p1, off2 = *(const idx_t*)p2;
+	return off1 < off2 ? -1 : off1 > off2 ? 1 : 0;
+}
+
+static bool sweep_atoms(query *q)
+{
+	prolog *pl = q->st.m->pl;
+	uint8_t *marks = calloc((pl->pool_offset/8)+1, 1);
+	idx_t *live = malloc(sizeof(idx_t) * (pl->symtab_count+1));
+	idx_t new_size = INITIAL_SYMTAB_SIZE;
+
+	while ((pl->symtab_count * 2) > new_size)
+		new_size *= 2;
+
+	symbol *tab = malloc(sizeof(symbol) * new_size);
+
+	if (!marks || !live || !tab) {
+		free(marks);
+		free(live);
+		free(tab);
+		return false;
+	}
+
+	mark_modules(pl, marks);
+
+	for (const parser *p = pl->parsers; p; p = p->next) {
+		mark_cells(pl, marks, p->t->cells, p->t->cidx);
+		mark_cells(pl, marks, &p->v, 1);
+	}
+
+	mark_query(pl, marks, q);
+	mark_global_vars(pl, marks, get_global_vars(q));
+	atom_marker am = { pl, marks };
+	walk_queued_terms(mark_queued_term, &am);
+
+	// Sweep...
+
+	for (idx_t i = 0; i < new_size; i++)
+		tab[i].val_off = ERR_IDX;
+
+	idx_t mask = new_size - 1, nbr_live = 0, nbr_freed = 0;
+
+	for (idx_t i = 0; i < pl->symtab_size; i++) {
+		const symbol *s = pl->symtab + i;
+
+		if (s->val_off == ERR_IDX)
+			continue;
+
+		if (s->val_off >= pl->pool_fixed) {
+			if (!(marks[s->val_off/8] & (1 << (s->val_off%8)))) {
+				nbr_freed++;
+				continue;
+			}
+
+			live[nbr_live++] = s->val_off;
+		}
+
+		idx_t j = s->hash & mask;
+
+		while (tab[j].val_off != ERR_IDX)
+			j = (j + 1) & mask;
+
+		tab[j] = *s;
+	}
+
+	free(pl->symtab);
+	pl->symtab = tab;
+	pl->symtab_size = new_size;
+	pl->symtab_count -= nbr_freed;
+
+	// Rebuild the free space from what's between the survivors,
+	// and give back the tail...
+
+	for (unsigned i = 0; i < MAX_POOL_BINS; i++)
+		pl->pool_gaps_nbr[i] = 0;
+
+	qsort(live, nbr_live, sizeof(idx_t), offset_cmp);
+	idx_t offset = pl->pool_fixed, live_bytes = 0;
+
+	for (idx_t i = 0; i < nbr_live; i++) {
+		if (live[i] > offset)
+			add_gap(pl, offset, live[i] - offset);
+
+		idx_t len = strlen(pl->pool + live[i]) + 1;
+		offset = live[i] + len;
+		live_bytes += len;
+	}
+
+	pl->pool_offset = offset;
+	size_t nbytes = pl->pool_size;
+
+	while (((nbytes / 2) >= INITIAL_POOL_SIZE) && (((pl->pool_offset + 2) * 2) < (nbytes / 2)))
+		nbytes /= 2;
+
+	if (nbytes < pl->pool_size)
+		resize_pool(pl, nbytes);
+
+	pl->atom_gc_threshold = live_bytes > ATOM_GC_MIN_BYTES ? live_bytes : ATOM_GC_MIN_BYTES;
+	pl->pool_alloced = 0;
+	pl->tot_atoms_freed += nbr_freed;
+	pl->tot_atom_gcs++;
+	free(marks);
+	free(live);
+	return true;
+}
+
+bool collect_atoms(query *q)
+{
+	prolog *pl = q->st.m->pl;
+
+	if ((pl->nbr_queries != 1) || q->st.m->tasks)
+		return true;
+
+	// Dead terms on the heap would otherwise keep their atoms...
+
+	if (!collect_heap(q))
+		return false;
+
+	acquire(&pl->db_lock);
+	acquire(&pl->pool_lock);
+	bool ok = sweep_atoms(q);
+	release(&pl->pool_lock);
+	release(&pl->db_lock);
+	return ok;
 }
 
 bool deconsult(prolog *pl, const char *filename)
@@ -173,10 +611,20 @@ static void g_destroy(prolog *pl)
 
 	free(g_tpl_lib);
 	m_destroy(pl->funtab);
-	m_destroy(pl->symtab);
+	free(pl->symtab);
 	m_destroy(pl->keyval);
+	clear_global_vars(&pl->gvars);
+#if USE_THREADS
+	munmap(pl->pool, pl->pool_size);
+#else
 	free(pl->pool);
+#endif
+
+	for (unsigned i = 0; i < MAX_POOL_BINS; i++)
+		free(pl->pool_gaps[i]);
+
 	pl->pool_offset = 0;
+	pl->symtab_count = 0;
 }
 
 static void keyvalfree(const void *key, const void *val)
@@ -187,14 +635,28 @@ static void keyvalfree(const void *key, const void *val)
 
 static bool g_init(prolog *pl)
 {
+#if USE_THREADS
+	pl->pool_size = POOL_RESERVE;
+	pl->pool = mmap(NULL, pl->pool_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+
+	if (pl->pool == MAP_FAILED)
+		pl->pool = NULL;
+#else
 	pl->pool = calloc(pl->pool_size=INITIAL_POOL_SIZE, 1);
+#endif
+
 	if (pl->pool) {
 		bool error = false;
 
-		CHECK_SENTINEL(pl->symtab = m_create((void*)strcmp, (void*)free, NULL), NULL);
+		CHECK_SENTINEL(pl->symtab = malloc(sizeof(symbol)*INITIAL_SYMTAB_SIZE), NULL);
 		CHECK_SENTINEL(pl->keyval = m_create((void*)strcmp, (void*)keyvalfree, NULL), NULL);
 
 		if (!error) {
+			pl->symtab_size = INITIAL_SYMTAB_SIZE;
+
+			for (idx_t i = 0; i < pl->symtab_size; i++)
+				pl->symtab[i].val_off = ERR_IDX;
+
 			CHECK_SENTINEL(g_false_s = index_from_pool(pl, "false"), ERR_IDX);
 			CHECK_SENTINEL(g_true_s = index_from_pool(pl, "true"), ERR_IDX);
 			CHECK_SENTINEL(g_plus_s = index_from_pool(pl, "+"), ERR_IDX);
@@ -242,6 +704,7 @@ static bool g_init(prolog *pl)
 			CHECK_SENTINEL(g_sys_var_s = index_from_pool(pl, "$VAR"), ERR_IDX);
 			CHECK_SENTINEL(g_stream_property_s = index_from_pool(pl, "$stream_property"), ERR_IDX);
 			CHECK_SENTINEL(g_post_unify_hook_s = index_from_pool(pl, "$post_unify_hook"), ERR_IDX);
+			CHECK_SENTINEL(g_alarm_hook_s = index_from_pool(pl, "$alarm_hook"), ERR_IDX);
 			CHECK_SENTINEL(g_sys_record_key_s = index_from_pool(pl, "$record_key"), ERR_IDX);
 		}
 
@@ -262,12 +725,19 @@ void pl_destroy(prolog *pl)
 	if (!--g_tpl_count)
 		g_destroy(pl);
 
+	deinit_lock(&pl->pool_lock);
+	deinit_lock(&pl->db_lock);
+	deinit_lock(&pl->dirty_lock);
 	free(pl);
 }
 
 prolog *pl_create()
 {
 	prolog *pl = calloc(1, sizeof(prolog));
+	pl->atom_gc_threshold = ERR_IDX;		// not until the builtins are in
+	init_lock(&pl->pool_lock);
+	init_lock(&pl->db_lock);
+	init_lock(&pl->dirty_lock);
 
 	if (!g_tpl_count++ && !g_init(pl)) {
 		free(pl);
@@ -349,6 +819,9 @@ prolog *pl_create()
 		}
 
 		pl->user_m->prebuilt = false;
+		pl->pool_fixed = pl->pool_offset;
+		pl->pool_alloced = 0;
+		pl->atom_gc_threshold = ATOM_GC_MIN_BYTES;
 	}
 
 	if (!pl->user_m || pl->user_m->error || !pl->user_m->filename) {
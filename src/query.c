@@ -25,6 +25,7 @@
 #define Trace if (q->trace /*&& !consulting*/) trace_call
 
 static const unsigned INITIAL_NBR_HEAP = 8000;		// cells
+static const unsigned GC_MIN_ARENAS = 16;
 static const unsigned INITIAL_NBR_QUEUE = 1000;		// cells
 
 static const unsigned INITIAL_NBR_GOALS = 1000;
@@ -32,14 +33,20 @@ static const unsigned INITIAL_NBR_SLOTS = 1000;
 static const unsigned INITIAL_NBR_CHOICES = 1000;
 static const unsigned INITIAL_NBR_TRAILS = 1000;
 
+static const unsigned JIT_INDEX_MIN_CLAUSES = 16;
+static const unsigned TRIM_STACKS_GOALS = 1000000;
+
 int g_tpl_interrupt = 0;
 
 typedef enum { CALL, EXIT, REDO, NEXT, FAIL } box_t;
 
 static USE_RESULT pl_status check_trail(query *q)
 {
-	if (q->st.tp > q->max_trails) {
-		q->max_trails = q->st.tp;
+	if (q->st.tp > q->hw_trails) {
+		q->hw_trails = q->st.tp;
+
+		if (q->st.tp > q->max_trails)
+			q->max_trails = q->st.tp;
 
 		if (q->st.tp >= q->trails_size) {
 			idx_t new_trailssize = alloc_grow((void**)&q->trails, sizeof(trail), q->st.tp, q->trails_size*3/2);
@@ -49,6 +56,9 @@ static USE_RESULT pl_status check_trail(query *q)
 			}
 
 			q->trails_size = new_trailssize;
+
+			if (q->trails_size > q->peak_trails_size)
+				q->peak_trails_size = q->trails_size;
 		}
 	}
 
@@ -57,8 +67,11 @@ static USE_RESULT pl_status check_trail(query *q)
 
 static USE_RESULT pl_status check_choice(query *q)
 {
-	if (q->cp > q->max_choices) {
-		q->max_choices = q->cp;
+	if (q->cp > q->hw_choices) {
+		q->hw_choices = q->cp;
+
+		if (q->cp > q->max_choices)
+			q->max_choices = q->cp;
 
 		if (q->cp >= q->choices_size) {
 			idx_t new_choicessize = alloc_grow((void**)&q->choices, sizeof(choice), q->cp, q->choices_size*3/2);
@@ -68,6 +81,9 @@ static USE_RESULT pl_status check_choice(query *q)
 			}
 
 			q->choices_size = new_choicessize;
+
+			if (q->choices_size > q->peak_choices_size)
+				q->peak_choices_size = q->choices_size;
 		}
 	}
 
@@ -76,8 +92,11 @@ static USE_RESULT pl_status check_choice(query *q)
 
 static USE_RESULT pl_status check_frame(query *q)
 {
-	if (q->st.fp > q->max_frames) {
-		q->max_frames = q->st.fp;
+	if (q->st.fp > q->hw_frames) {
+		q->hw_frames = q->st.fp;
+
+		if (q->st.fp > q->max_frames)
+			q->max_frames = q->st.fp;
 
 		if (q->st.fp >= q->frames_size) {
 			idx_t new_framessize = alloc_grow((void**)&q->frames, sizeof(frame), q->st.fp, q->frames_size*3/2);
@@ -87,6 +106,9 @@ static USE_RESULT pl_status check_frame(query *q)
 			}
 
 			q->frames_size = new_framessize;
+
+			if (q->frames_size > q->peak_frames_size)
+				q->peak_frames_size = q->frames_size;
 		}
 	}
 
@@ -97,8 +119,11 @@ static USE_RESULT pl_status check_slot(query *q, unsigned cnt)
 {
 	idx_t nbr = q->st.sp + cnt + MAX_ARITY;
 
-	if (nbr > q->max_slots) {
-		q->max_slots = q->st.sp;
+	if (nbr > q->hw_slots) {
+		q->hw_slots = nbr;
+
+		if (q->st.sp > q->max_slots)
+			q->max_slots = q->st.sp;
 
 		if (nbr >= q->slots_size) {
 			idx_t new_slotssize = alloc_grow((void**)&q->slots, sizeof(slot), nbr, q->slots_size*3/2>nbr?q->slots_size*3/2:nbr);
@@ -109,12 +134,62 @@ static USE_RESULT pl_status check_slot(query *q, unsigned cnt)
 
 			memset(q->slots+q->slots_size, 0, sizeof(slot)*(new_slotssize-q->slots_size));
 			q->slots_size = new_slotssize;
+
+			if (q->slots_size > q->peak_slots_size)
+				q->peak_slots_size = q->slots_size;
 		}
 	}
 
 	return pl_success;
 }
 
+// Give back stack memory after a deep excursion. The target size is
+// based on the high-water mark since the last trim rather than on the
+// current usage, so a loop that repeatedly goes deep keeps its stacks
+// and only a one-off spike is released (on the trim after it).
+
+static void trim_stack(void **addr, size_t elem_size, idx_t *size, idx_t *hw, idx_t used, idx_t initial)
+{
+	idx_t want = *hw > used ? *hw : used;
+	want += want / 2;
+
+	if (want < initial)
+		want = initial;
+
+	*hw = used;
+
+	if (*size < (want * 2))
+		return;
+
+	void *mem = realloc(*addr, elem_size * want);
+
+	if (!mem)
+		return;
+
+	*addr = mem;
+	*size = want;
+}
+
+static void trim_stacks(query *q)
+{
+	idx_t fp = q->st.fp, sp = q->st.sp, tp = q->st.tp;
+
+	if (q->cp) {
+		const choice *ch = GET_CURR_CHOICE();
+		if (ch->st.fp > fp) fp = ch->st.fp;
+		if (ch->st.sp > sp) sp = ch->st.sp;
+		if (ch->st.tp > tp) tp = ch->st.tp;
+	}
+
+	unsigned div = q->is_task ? 10 : 1;
+	trim_stack((void**)&q->frames, sizeof(frame), &q->frames_size, &q->hw_frames, fp+1, INITIAL_NBR_GOALS/div);
+	trim_stack((void**)&q->slots, sizeof(slot), &q->slots_size, &q->hw_slots, sp+MAX_ARITY+1, INITIAL_NBR_SLOTS/div);
+	trim_stack((void**)&q->choices, sizeof(choice), &q->choices_size, &q->hw_choices, q->cp+1, INITIAL_NBR_CHOICES/div);
+	trim_stack((void**)&q->trails, sizeof(trail), &q->trails_size, &q->hw_trails, tp+1, INITIAL_NBR_TRAILS/div);
+	q->trim_goals = q->tot_goals;
+}
+
+#if DEBUG
 // Note: when in commit there is a provisional choice point
 // that we should skip over, hence the '2' ...
 
@@ -127,6 +202,7 @@ static bool any_choices(query *q, frame *g, bool in_commit)
 	const choice *ch = GET_CHOICE(curr_choice);
 	return ch->cgen >= g->cgen ? true : false;
 }
+#endif
 
 static void trace_call(query *q, cell *c, box_t box)
 {
@@ -173,63 +249,188 @@ static void trace_call(query *q, cell *c, box_t box)
 		sleep(1);
 }
 
-static void purge_dirty_list(query *q)
+static void unlink_clause(prolog *pl, clause *r)
 {
-	int cnt = 0;
+	predicate *h = r->owner;
+	acquire(&h->guard);
+
+	if (r->prev)
+		store_link(r->prev->next, r->next);
+
+	if (r->next)
+		r->next->prev = r->prev;
+
+	if (h->head == r)
+		store_link(h->head, r->next);
+
+	if (h->tail == r)
+		h->tail = r->prev;
+
+	// With no query left to hold a bucket ordinal the holes can go...
+
+	unindex_clause(h, r, !pl->pinned);
+	release(&h->guard);
+	r->ugen_unlinked = ++pl->ugen;
+}
+
+// Every live query is pinned at the generation it was created in.
+// A retracted clause is unlinked once no pinned query can still see
+// it under the logical update view, but readers may be stepping past
+// it, so it is only freed once every query pinned before the unlink
+// has gone. The unlinked clause keeps its next link meanwhile.
+
+static void pin_query(query *q)
+{
+	prolog *pl = q->st.m->pl;
+	acquire(&pl->dirty_lock);
+	q->pin_ugen = pl->ugen;
+	q->next_pinned = pl->pinned;
+
+	if (q->next_pinned)
+		q->next_pinned->prev_pinned = q;
+
+	pl->pinned = q;
+	release(&pl->dirty_lock);
+}
+
+static void reclaim_clauses(query *q)
+{
+	prolog *pl = q->st.m->pl;
+	acquire(&pl->dirty_lock);
+
+	if (q->prev_pinned)
+		q->prev_pinned->next_pinned = q->next_pinned;
+	else
+		pl->pinned = q->next_pinned;
+
+	if (q->next_pinned)
+		q->next_pinned->prev_pinned = q->prev_pinned;
 
 	while (q->dirty_list) {
 		clause *r = q->dirty_list;
 		q->dirty_list = r->dirty;
+		r->dirty = pl->dirty_list;
+		pl->dirty_list = r;
+	}
+
+	uint64_t oldest = UINT64_MAX;
+
+	for (query *tmp = pl->pinned; tmp; tmp = tmp->next_pinned) {
+		if (tmp->pin_ugen < oldest)
+			oldest = tmp->pin_ugen;
+	}
+
+	clause **link = &pl->dirty_list;
+
+	while (*link) {
+		clause *r = *link;
+
+		if (!r->ugen_unlinked && (r->t.ugen_erased <= oldest))
+			unlink_clause(pl, r);
+
+		if (r->ugen_unlinked && (r->ugen_unlinked <= oldest)) {
+			*link = r->dirty;
+			clear_term(&r->t);
+			free(r);
+			continue;
+		}
+
+		link = &r->dirty;
+	}
 
-		if (r->prev)
-			r->prev->next = r->next;
+	release(&pl->dirty_lock);
+}
+
+static void done_iter(const prolog_state *st)
+{
+	if (!st->iter)
+		return;
 
-		if (r->next)
-			r->next->prev = r->prev;
+	acquire(&st->pr->guard);
+	m_done(st->iter);
+	release(&st->pr->guard);
+}
+
+// Step over the holes left by deleted clauses, leaving the ordinal
+// at the clause returned. An ordinal before a trimmed front starts
+// from the first slot still in use.
 
-		if (r->owner->head == r)
-			r->owner->head = r->next;
+static clause *get_bucket_clause(const bucket *b, idx_t *ord)
+{
+	idx_t i = *ord + b->moved;
 
-		if (r->owner->tail == r)
-			r->owner->tail = r->prev;
+	if (i < b->first)
+		i = b->first;
 
-		clear_term(&r->t);
-		free(r);
-		cnt++;
+	for (; (i - b->first) < b->nbr; i++) {
+		if (b->clauses[i]) {
+			*ord = i - b->moved;
+			return b->clauses[i];
+		}
 	}
 
-	//if (cnt) printf("Info: query purged %d retracted items\n", cnt);
+	return NULL;
 }
 
+// Buckets and the index can be reshaped by writers, so stepping
+// through them holds the predicate lock. The plain clause list is
+// walked without it.
+
 static void next_key(query *q)
 {
-	if (q->st.iter) {
+	if (!q->st.bkt && !q->st.iter) {
+		q->st.curr_clause = load_link(q->st.curr_clause->next);
+		return;
+	}
+
+	acquire(&q->st.pr->guard);
+
+	if (q->st.bkt) {
+		q->st.bkt_ord++;
+		q->st.curr_clause = get_bucket_clause(q->st.bkt, &q->st.bkt_ord);
+
+		if (!q->st.curr_clause)
+			q->st.bkt = NULL;
+	} else if (q->st.iter) {
 		if (!m_nextkey(q->st.iter, (void**)&q->st.curr_clause)) {
 			q->st.curr_clause = NULL;
 			q->st.iter = NULL;
 		}
-	} else
-		q->st.curr_clause = q->st.curr_clause->next;
+	}
+
+	release(&q->st.pr->guard);
 }
 
 static bool is_next_key(query *q)
 {
-	if (q->st.iter) {
-		if (m_is_nextkey(q->st.iter))
-			return true;
-	} else if (q->st.curr_clause->next)
-		return true;
+	if (!q->st.bkt && !q->st.iter)
+		return load_link(q->st.curr_clause->next) != NULL;
 
-	return false;
+	bool ok = false;
+	acquire(&q->st.pr->guard);
+
+	if (q->st.bkt) {
+		idx_t ord = q->st.bkt_ord + 1;
+		ok = get_bucket_clause(q->st.bkt, &ord) != NULL;
+	} else
+		ok = m_is_nextkey(q->st.iter);
+
+	release(&q->st.pr->guard);
+	return ok;
 }
 
-void add_to_dirty_list(query *q, clause *r)
+// Under the logical update view a query may retract a clause it has
+// itself already retracted, but not one that another thread has.
+
+bool add_to_dirty_list(query *q, clause *r)
 {
 	if (!retract_from_db(q->st.m, r))
-		return;
+		return r->erased_by == (q->qid + 1);
 
+	r->erased_by = q->qid + 1;
 	r->dirty = q->dirty_list;
 	q->dirty_list = r;
+	return true;
 }
 
 bool is_valid_list(query *q, cell *p1, idx_t p1_ctx, bool allow_partials)
@@ -306,6 +507,11 @@ static void unwind_trail(query *q, const choice *ch)
 	while (q->st.tp > ch->st.tp) {
 		const trail *tr = q->trails + --q->st.tp;
 
+		if (tr->ctx == ERR_IDX) {
+			undo_global_var((global_undo*)tr->attrs);
+			continue;
+		}
+
 		if (ch->pins) {
 			if (ch->pins & (1 << tr->var_nbr))
 				continue;
@@ -331,6 +537,7 @@ void try_me(const query *q, unsigned nbr_vars)
 	g->nbr_slots = nbr_vars;
 	g->nbr_vars = nbr_vars;
 	g->ctx = q->st.sp;
+	g->is_shared = false;
 	slot *e = GET_SLOT(g, 0);
 
 	for (unsigned i = 0; i < nbr_vars; i++, e++) {
@@ -343,24 +550,23 @@ void try_me(const query *q, unsigned nbr_vars)
 static void trim_heap(query *q, const choice *ch)
 {
 	for (arena *a = q->arenas; a;) {
-		if (a->nbr <= ch->st.anbr)
+		if (a->nbr < ch->st.anbr)
 			break;
 
-		for (idx_t i = 0; i < a->hp; i++) {
-			cell *c = a->heap + i;
-			unshare_cell(c);
-			c->val_type = TYPE_EMPTY;
-		}
-
 		arena *save = a;
 		q->arenas = a = a->next;
-		free(save->heap);
-		free(save);
+		free_arena(q, save);
 	}
 
+	// The arena current at the time of the choice may have since been
+	// collected, in which case its cells are already gone...
+
 	const arena *a = q->arenas;
 
-	for (idx_t i = ch->st.hp; a && (i < a->hp); i++) {
+	if (!a || (a->nbr != (ch->st.anbr - 1)))
+		return;
+
+	for (idx_t i = ch->st.hp; i < a->hp; i++) {
 		cell *c = a->heap + i;
 		unshare_cell(c);
 		c->val_type = TYPE_EMPTY;
@@ -388,7 +594,7 @@ bool retry_choice(query *q)
 		return retry_choice(q);
 
 	trim_heap(q, ch);
-	m_done(q->st.iter);
+	done_iter(&q->st);
 	q->st = ch->st;
 	q->save_m = NULL;		// maybe move q->save_m to q->st.save_m
 
@@ -416,13 +622,27 @@ static frame *make_frame(query *q, unsigned nbr_vars)
 	return g;
 }
 
+// Entries dropped without being unwound can no longer be undone...
+
+static void drop_trail(query *q, idx_t tp)
+{
+	for (idx_t i = tp; i < q->st.tp; i++) {
+		const trail *tr = q->trails + i;
+
+		if (tr->ctx == ERR_IDX)
+			drop_global_var((global_undo*)tr->attrs);
+	}
+
+	q->st.tp = tp;
+}
+
 static void trim_trail(query *q)
 {
 	if (q->undo_hi_tp)
 		return;
 
 	if (!q->cp) {
-		q->st.tp = 0;
+		drop_trail(q, 0);
 		return;
 	}
 
@@ -444,45 +664,91 @@ static void trim_trail(query *q)
 	}
 }
 
+// Last-call optimisation: the head of the last goal in a body has
+// been unified into a provisional frame (at 'fp'). Instead of pushing
+// that frame, move its slots down over the caller's and drop every
+// frame above the caller, so deterministic recursion runs in constant
+// frame and slot space. Trail entries for the dropped and reused
+// frames are discarded, as any choice older than them will drop them.
+
 static void reuse_frame(query *q, unsigned nbr_vars)
 {
-	const frame *newg = GET_FRAME(q->st.fp);
 	frame *g = GET_CURR_FRAME();
-	slot *e = GET_SLOT(g, 0);
+	const frame *newg = GET_FRAME(q->st.fp);
+	const choice *ch = q->cp > 1 ? GET_CHOICE(q->cp-2) : NULL;
+	idx_t tp = ch ? ch->st.tp : 0, dst = tp;
 
-	for (unsigned i = 0; i < g->nbr_vars; i++, e++) {
+	for (idx_t i = tp; i < q->st.tp; i++) {
+		const trail *tr = q->trails + i;
+
+		if ((tr->ctx < q->st.curr_frame) || (tr->ctx == ERR_IDX))
+			q->trails[dst++] = *tr;
+	}
+
+	q->st.tp = dst;
+
+	for (idx_t i = g->ctx; i < newg->ctx; i++) {
+		slot *e = q->slots + i;
 		unshare_cell(&e->c);
 		e->c.val_type = TYPE_EMPTY;
 		e->c.attrs = NULL;
 	}
 
-	g->cgen = newg->cgen;
+	memmove(q->slots+g->ctx, q->slots+newg->ctx, sizeof(slot)*nbr_vars);
+
+	for (idx_t i = g->ctx; i < (g->ctx+nbr_vars); i++) {
+		slot *e = q->slots + i;
+
+		if (e->ctx == q->st.fp)
+			e->ctx = q->st.curr_frame;
+	}
+
+	idx_t from = g->ctx + nbr_vars > newg->ctx ? g->ctx + nbr_vars : newg->ctx;
+
+	for (idx_t i = from; i < (newg->ctx+nbr_vars); i++) {
+		slot *e = q->slots + i;
+		e->c.val_type = TYPE_EMPTY;
+		e->c.attrs = NULL;
+	}
+
+	g->cgen = ++q->st.cgen;
 	g->nbr_slots = nbr_vars;
 	g->nbr_vars = nbr_vars;
 	g->overflow = 0;
-
-	const choice *ch = GET_CURR_CHOICE();
-	q->st.sp = ch->st.sp;
-
-	const slot *from = GET_SLOT(newg, 0);
-	slot *to = GET_SLOT(g, 0);
-	memmove(to, from, sizeof(slot)*nbr_vars);
+	g->is_shared = false;
 	q->st.sp = g->ctx + nbr_vars;
+	q->st.fp = q->st.curr_frame + 1;
 	q->tot_tcos++;
 }
 
-static bool check_slots(const query *q, frame *g, term *t)
+// The caller's frame (and those above it) can only be given up when
+// nothing outlives it: the goal is the last in a clause body, there
+// are no choices left since it was made, no older frame is bound to
+// anything in them, and the callee's new slots don't refer back to it.
+
+static bool check_slots(const query *q, unsigned nbr_vars)
 {
-	if (g->nbr_vars != t->nbr_vars)
+	const cell *next = q->st.curr_cell + q->st.curr_cell->nbr_cells;
+
+	if (!q->st.curr_frame || !is_end(next) || next->val_ptr)
 		return false;
 
-	for (unsigned i = 0; i < g->nbr_vars; i++) {
-		const slot *e = GET_SLOT(g, i);
+	const choice *ch = q->cp > 1 ? GET_CHOICE(q->cp-2) : NULL;
 
-		if (is_indirect(&e->c))
+	if (ch && (ch->st.fp > q->st.curr_frame))
+		return false;
+
+	for (idx_t i = q->st.curr_frame; i <= q->st.fp; i++) {
+		if (GET_FRAME(i)->is_shared)
 			return false;
+	}
+
+	const frame *newg = GET_FRAME(q->st.fp);
+
+	for (unsigned i = 0; i < nbr_vars; i++) {
+		const slot *e = GET_SLOT(newg, i);
 
-		if (is_string(&e->c))
+		if ((is_variable(&e->c) || is_indirect(&e->c)) && (e->ctx == q->st.curr_frame))
 			return false;
 	}
 
@@ -496,27 +762,22 @@ static void commit_me(query *q, term *t)
 	q->st.m = q->st.curr_clause->owner->m;
 	q->st.iter = NULL;
 	bool last_match = t->first_cut || !is_next_key(q);
-	bool recursive = is_tail_recursive(q->st.curr_cell);
-	bool tco = !q->no_tco && recursive && !any_choices(q, g, true);
-	bool slots_ok = check_slots(q, g, t);
+	q->st.bkt = NULL;
+	bool tco = last_match && q->st.m->pl->opt && check_slots(q, t->nbr_vars);
 	choice *ch = GET_CURR_CHOICE();
 
-#if 0
-	printf("*** tco=%d, q->no_tco=%d, last_match=%d, rec=%d, any_choices=%d, check_slots=%d\n",
-		tco, q->no_tco, last_match, recursive, any_choices(q, g, true), check_slots(q, g, t));
-#endif
-
-	if (tco && slots_ok && q->st.m->pl->opt)
+	if (tco)
 		reuse_frame(q, t->nbr_vars);
 	else
 		g = make_frame(q, t->nbr_vars);
 
 	if (last_match) {
-		m_done(ch->st.iter);
+		done_iter(&ch->st);
 		drop_choice(q);
 		trim_trail(q);
 	} else {
 		ch->st.curr_clause = q->st.curr_clause;
+		ch->st.bkt_ord = q->st.bkt_ord;
 		ch->cgen = g->cgen;
 	}
 
@@ -544,6 +805,7 @@ void stash_me(query *q, term *t, bool last_match)
 	g->prev_cell = NULL;
 	g->cgen = cgen;
 	g->overflow = 0;
+	g->is_shared = false;
 
 	q->st.sp += nbr_vars;
 }
@@ -618,7 +880,7 @@ void cut_me(query *q, bool local_cut, bool soft_cut)
 		if (ch->cgen < g->cgen)
 			break;
 
-		m_done(ch->st.iter);
+		done_iter(&ch->st);
 		q->cp--;
 
 		if (ch->chk_is_det) {
@@ -644,23 +906,10 @@ void cut_me(query *q, bool local_cut, bool soft_cut)
 
 			break;
 		}
-
-#if 0
-		if (ch->tail_rec) {
-			printf("*** here2\n");
-			frame *g_prev = GET_FRAME(g->prev_frame);
-			g->prev_frame = g_prev->prev_frame;
-			g->prev_cell = g_prev->prev_cell;
-			*g_prev = *g;
-			q->st.curr_frame--;
-			q->st.fp--;
-			q->tot_tcos++;
-		}
-#endif
 	}
 
 	if (!q->cp && !q->undo_hi_tp)
-		q->st.tp = 0;
+		drop_trail(q, 0);
 }
 
 // Continue to next term in body
@@ -689,16 +938,6 @@ static bool resume_frame(query *q)
 		return false;
 
 	frame *g = GET_CURR_FRAME();
-
-#if 0
-	term *t = &q->st.curr_clause->t;
-
-	if ((q->st.curr_frame == (q->st.fp-1))
-		&& q->st.m->pl->opt && t->tail_rec
-		&& !any_choices(q, g, false) && check_slots(q, g, t))
-		q->st.fp--;
-#endif
-
 	q->st.curr_cell = g->prev_cell;
 	q->st.curr_frame = g->prev_frame;
 	g = GET_CURR_FRAME();
@@ -752,11 +991,47 @@ unsigned create_vars(query *q, unsigned cnt)
 	return var_nbr;
 }
 
+// A frame of fresh variables above the current one that is never
+// entered. A builtin can bind its result through these when it needs
+// more than the current frame can take. It goes with the frames above
+// it on backtracking. Returns the new frame's context, or 0.
+
+idx_t create_var_frame(query *q, unsigned cnt)
+{
+	if ((check_frame(q) != pl_success) || (check_slot(q, cnt) != pl_success))
+		return 0;
+
+	idx_t new_frame = q->st.fp++;
+	frame *g = GET_FRAME(new_frame);
+	g->prev_frame = q->st.curr_frame;
+	g->prev_cell = NULL;
+	g->m = q->st.m;
+	g->ugen = q->st.m->pl->ugen;
+	g->cgen = ++q->st.cgen;
+	g->ctx = q->st.sp;
+	g->overflow = 0;
+	g->nbr_vars = g->nbr_slots = cnt;
+	g->is_shared = false;
+
+	for (unsigned i = 0; i < cnt; i++) {
+		slot *e = GET_SLOT(g, i);
+		unshare_cell(&e->c);
+		e->c.val_type = TYPE_EMPTY;
+		e->c.attrs = NULL;
+	}
+
+	q->st.sp += cnt;
+	return new_frame;
+}
+
 void set_var(query *q, const cell *c, idx_t c_ctx, cell *v, idx_t v_ctx)
 {
 	const frame *g = GET_FRAME(c_ctx);
 	slot *e = GET_SLOT(g, c->var_nbr);
 	e->ctx = v_ctx;
+
+	if ((c_ctx < v_ctx) && (is_variable(v) || is_structure(v)))
+		GET_FRAME(v_ctx)->is_shared = true;
 	cell *attrs;
 
 	if (is_empty(&e->c))
@@ -788,6 +1063,39 @@ void set_var(query *q, const cell *c, idx_t c_ctx, cell *v, idx_t v_ctx)
 	tr->attrs = attrs;
 }
 
+// Only the first change to a global variable since the newest choice
+// needs undoing, later ones would be rolled back past anyway.
+
+pl_status trail_global_var(query *q, global_undo *u)
+{
+	const choice *ch = GET_CURR_CHOICE();
+
+	for (idx_t i = q->st.tp; i > ch->st.tp; i--) {
+		const trail *tr = q->trails + i - 1;
+
+		if (tr->ctx != ERR_IDX)
+			continue;
+
+		const global_undo *u2 = (const global_undo*)tr->attrs;
+
+		if ((u2->gv == u->gv) && (u2->key.val_off == u->key.val_off)) {
+			drop_global_var(u);
+			return pl_success;
+		}
+	}
+
+	if (check_trail(q) != pl_success) {
+		drop_global_var(u);
+		return pl_error;
+	}
+
+	trail *tr = q->trails + q->st.tp++;
+	tr->ctx = ERR_IDX;
+	tr->var_nbr = 0;
+	tr->attrs = (cell*)u;
+	return pl_success;
+}
+
 void reset_var(query *q, const cell *c, idx_t c_ctx, cell *v, idx_t v_ctx)
 {
 	const frame *g = GET_FRAME(c_ctx);
@@ -802,6 +1110,9 @@ void reset_var(query *q, const cell *c, idx_t c_ctx, cell *v, idx_t v_ctx)
 
 	e->ctx = v_ctx;
 
+	if ((c_ctx < v_ctx) && (is_variable(v) || v->arity))
+		GET_FRAME(v_ctx)->is_shared = true;
+
 	if (v->arity && !is_string(v))
 		make_indirect(&e->c, v);
 	else {
@@ -935,9 +1246,6 @@ bool unify_internal(query *q, cell *p1, idx_t p1_ctx, cell *p2, idx_t p2_ctx, un
 		return false;
 	}
 
-	if (p1_ctx == q->st.curr_frame)
-		q->no_tco = true;
-
 	if (is_variable(p1) && is_variable(p2)) {
 		if (p2_ctx > p1_ctx)
 			set_var(q, p2, p2_ctx, p1, p1_ctx);
@@ -1016,13 +1324,13 @@ USE_RESULT pl_status match_rule(query *q, cell *p1, idx_t p1_ctx)
 			if (!h->is_dynamic)
 				return throw_error(q, head, "permission_error", "modify,static_procedure");
 
-			q->st.curr_clause2 = h->head;
+			q->st.curr_clause2 = load_link(h->head);
 		}
 
 		frame *g = GET_FRAME(q->st.curr_frame);
 		g->ugen = q->st.m->pl->ugen;
 	} else {
-		q->st.curr_clause2 = q->st.curr_clause2->next;
+		q->st.curr_clause2 = load_link(q->st.curr_clause2->next);
 	}
 
 	if (!q->st.curr_clause2)
@@ -1032,7 +1340,7 @@ USE_RESULT pl_status match_rule(query *q, cell *p1, idx_t p1_ctx)
 	cell *p1_body = deref(q, get_logical_body(p1), p1_ctx);
 	cell *orig_p1 = p1;
 
-	for (; q->st.curr_clause2; q->st.curr_clause2 = q->st.curr_clause2->next) {
+	for (; q->st.curr_clause2; q->st.curr_clause2 = load_link(q->st.curr_clause2->next)) {
 
 		if (!check_update_view(q, q->st.curr_clause2))
 			continue;
@@ -1116,13 +1424,13 @@ USE_RESULT pl_status match_clause(query *q, cell *p1, idx_t p1_ctx, enum clause_
 					return throw_error(q, p1, "permission_error", "access,private_procedure");
 			}
 
-			q->st.curr_clause2 = h->head;
+			q->st.curr_clause2 = load_link(h->head);
 		}
 
 		frame *g = GET_FRAME(q->st.curr_frame);
 		g->ugen = q->st.m->pl->ugen;
 	} else {
-		q->st.curr_clause2 = q->st.curr_clause2->next;
+		q->st.curr_clause2 = load_link(q->st.curr_clause2->next);
 	}
 
 	if (!q->st.curr_clause2)
@@ -1130,7 +1438,7 @@ USE_RESULT pl_status match_clause(query *q, cell *p1, idx_t p1_ctx, enum clause_
 
 	may_error(make_choice(q));
 
-	for (; q->st.curr_clause2; q->st.curr_clause2 = q->st.curr_clause2->next) {
+	for (; q->st.curr_clause2; q->st.curr_clause2 = load_link(q->st.curr_clause2->next)) {
 		if (!check_update_view(q, q->st.curr_clause2))
 			continue;
 
@@ -1167,6 +1475,103 @@ static const char *dump_key(void *p, const void *p1)
 }
 #endif
 
+// Compare a stored clause head against the goal in place, taking the
+// goal bindings from the current frame. This orders keys exactly as
+// compkey2 does for the whole-head index, so no copy of the goal has
+// to be made to look it up. It is used again on retry, by which time
+// the goal and its frame have been restored from the choice point.
+
+static int compkey_goal(query *q, const cell *p1, cell *p2, idx_t p2_ctx)
+{
+	p2 = deref(q, p2, p2_ctx);
+	p2_ctx = q->latest_ctx;
+
+	if (is_variable(p1) || is_variable(p2))
+		return 0;
+
+	if (is_integer(p1)) {
+		if (is_integer(p2)) {
+			if (p1->val_num < p2->val_num)
+				return -1;
+			else if (p1->val_num > p2->val_num)
+				return 1;
+		}
+	} else if (is_float(p1)) {
+		if (is_float(p2)) {
+			if (p1->val_flt < p2->val_flt)
+				return -1;
+			else if (p1->val_flt > p2->val_flt)
+				return 1;
+		}
+	} else if (is_atom(p1)) {
+		if (is_atom(p2))
+			return strcmp(GET_STR(p1), GET_STR(p2));
+	} else if (is_structure(p1)) {
+		if (is_structure(p2)) {
+			if (p1->arity < p2->arity)
+				return -1;
+
+			if (p1->arity > p2->arity)
+				return 1;
+
+			int i = strcmp(GET_STR(p1), GET_STR(p2));
+
+			if (i != 0)
+				return i;
+
+			int arity = p1->arity;
+			p1++; p2++;
+
+			while (arity--) {
+				int i = compkey_goal(q, p1, p2, p2_ctx);
+
+				if (i != 0)
+					return i;
+
+				p1 += p1->nbr_cells;
+				p2 += p2->nbr_cells;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int compgoal(const void *ptr1, const void *ptr2, const void *param)
+{
+	query *q = (query*)param;
+	return compkey_goal(q, (const cell*)ptr1, (cell*)ptr2, q->st.curr_frame);
+}
+
+// Pick the smallest bucket from the bound arguments of the goal,
+// building per-argument indexes on demand as call patterns show up.
+
+static bucket *select_bucket(query *q, predicate *h, cell *c)
+{
+	if ((h->cnt < JIT_INDEX_MIN_CLAUSES) || q->st.m->pl->noindex)
+		return NULL;
+
+	bucket *best = NULL;
+	cell *p = c + 1;
+
+	for (unsigned i = 0; i < c->arity; i++, p += p->nbr_cells) {
+		cell *key = deref(q, p, q->st.curr_frame);
+
+		if (is_variable(key))
+			continue;
+
+		bucket *b = find_arg_bucket(h, i, key);
+
+		if (b && (!best || ((b->nbr - b->dead) < (best->nbr - best->dead))))
+			best = b;
+
+		if (best && ((best->nbr - best->dead) <= 1))
+			break;
+	}
+
+	return best;
+}
+
 static USE_RESULT pl_status match_head(query *q)
 {
 	if (!q->retry) {
@@ -1208,28 +1613,29 @@ static USE_RESULT pl_status match_head(query *q)
 				c->match = h;
 		}
 
-		if (h->index) {
-			cell *key = deep_clone_to_heap(q, c, q->st.curr_frame);
-			unsigned arity = key->arity;
-			bool all_vars = true;
+		cell *arg1 = c->arity ? deref(q, c+1, q->st.curr_frame) : NULL;
+		bucket *b = NULL;
+		q->st.bkt = NULL;
 
-			for (cell *c = key + 1; arity--; c += c->nbr_cells) {
-				if (!is_variable(c)) {
-					all_vars = false;
-					break;
-				}
-			}
+		q->st.pr = h;
+		acquire(&h->guard);
 
-			if (!all_vars) {
-				q->st.iter = m_findkey(h->index, key);
-				next_key(q);
-			} else {
-				q->st.curr_clause = h->head;
-			}
+		if (h->index && arg1 && is_structure(arg1)) {
+			q->st.iter = m_findkey_cmp(h->index, c, compgoal, q);
+			next_key(q);
+		} else if ((b = select_bucket(q, h, c)) != NULL) {
+			q->st.bkt = b;
+			q->st.bkt_ord = b->first - b->moved;
+			q->st.curr_clause = get_bucket_clause(b, &q->st.bkt_ord);
+
+			if (!q->st.curr_clause)
+				q->st.bkt = NULL;
 		} else {
-			q->st.curr_clause = h->head;
+			q->st.curr_clause = load_link(h->head);
 		}
 
+		release(&h->guard);
+
 		frame *g = GET_FRAME(q->st.curr_frame);
 		g->ugen = q->st.m->pl->ugen;
 	} else
@@ -1249,7 +1655,6 @@ static USE_RESULT pl_status match_head(query *q)
 		cell *head = get_head(t->cells);
 		try_me(q, t->nbr_vars);
 		q->tot_matches++;
-		q->no_tco = false;
 
 		if (unify_structure(q, q->st.curr_cell, q->st.curr_frame, head, q->st.fp, 0)) {
 			if (q->error)
@@ -1466,12 +1871,24 @@ static bool any_outstanding_choices(query *q)
 	return q->cp > 0;
 }
 
+// Alarms are checked after each builtin succeeds and on entering each
+// clause body, so only while the query is running...
+
+static bool alarm_is_due(const query *q)
+{
+	uint64_t due;
+	return next_alarm_due(q, &due) && (due <= (get_time_in_usec() / 1000));
+}
+
 pl_status start(query *q)
 {
 	q->yielded = false;
 	bool done = false;
 
 	while (!done && !q->error) {
+		if (q->cancel)
+			break;
+
 		if (g_tpl_interrupt) {
 			int ok = check_interrupt(q);
 
@@ -1490,6 +1907,9 @@ pl_status start(query *q)
 
 			if (!retry_choice(q))
 				break;
+
+			if ((q->tot_goals - q->trim_goals) >= TRIM_STACKS_GOALS)
+				trim_stacks(q);
 		}
 
 		if (is_variable(q->st.curr_cell)) {
@@ -1497,6 +1917,20 @@ pl_status start(query *q)
 				continue;
 		}
 
+		if (q->tot_heapsize >= q->gc_threshold) {
+			if (!q->st.m->tasks)
+				may_error(collect_heap(q));
+
+			q->gc_threshold = q->tot_heapsize * 2;
+
+			if (q->gc_threshold < (q->h_size * GC_MIN_ARENAS))
+				q->gc_threshold = q->h_size * GC_MIN_ARENAS;
+		}
+
+		if ((q->st.m->pl->pool_alloced >= q->st.m->pl->atom_gc_threshold)
+			&& (q->st.m->pl->nbr_queries == 1) && !q->st.m->tasks)
+			may_error(collect_atoms(q));
+
 		q->tot_goals++;
 		q->did_throw = false;
 		q->save_tp = q->st.tp;
@@ -1514,8 +1948,10 @@ pl_status start(query *q)
 			if (!q->st.curr_cell->fn(q)) {
 				q->retry = QUERY_RETRY;
 
-				if (q->yielded)
+				if (q->yielded) {
+					trim_stacks(q);
 					break;
+				}
 
 				q->tot_retries++;
 				continue;
@@ -1523,6 +1959,8 @@ pl_status start(query *q)
 
 			if (q->has_attrs && !q->in_hook)
 				may_error(do_post_unification_hook(q));
+			else if (q->alarms.cnt && alarm_is_due(q))
+				may_error(do_alarm_hook(q, NULL));
 
 			follow_me(q);
 		} else if (is_iso_list(q->st.curr_cell)) {
@@ -1539,6 +1977,8 @@ pl_status start(query *q)
 
 			if (q->has_attrs)
 				may_error(do_post_unification_hook(q));
+			else if (q->alarms.cnt && (save_cell->val_off != g_alarm_hook_s) && alarm_is_due(q))
+				may_error(do_alarm_hook(q, q->st.curr_cell));
 		}
 
 		Trace(q, save_cell, EXIT);
@@ -1624,13 +2064,16 @@ pl_status execute(query *q, term *t)
 	g->nbr_slots = t->nbr_vars;
 	g->ugen = ++q->st.m->pl->ugen;
 	pl_status ret = start(q);
-	m_done(q->st.iter);
+	done_iter(&q->st);
 	return ret;
 }
 
 void destroy_query(query *q)
 {
-	purge_dirty_list(q);
+	q->st.m->pl->nbr_queries--;
+	drop_trail(q, 0);
+	reclaim_clauses(q);
+	clear_alarms(&q->alarms);
 
 	while (q->st.qnbr > 0) {
 		free(q->tmpq[q->st.qnbr]);
@@ -1639,15 +2082,9 @@ void destroy_query(query *q)
 	}
 
 	for (arena *a = q->arenas; a;) {
-		for (idx_t i = 0; i < a->hp; i++) {
-			cell *c = a->heap + i;
-			unshare_cell(c);
-		}
-
 		arena *save = a;
 		a = a->next;
-		free(save->heap);
-		free(save);
+		free_arena(q, save);
 	}
 
 	for (int i = 0; i < MAX_QUEUES; i++) {
@@ -1695,15 +2132,23 @@ query *create_query(module *m, bool is_task)
 	CHECK_SENTINEL(q->slots = calloc(q->slots_size, sizeof(slot)), NULL);
 	CHECK_SENTINEL(q->choices = calloc(q->choices_size, sizeof(choice)), NULL);
 	CHECK_SENTINEL(q->trails = calloc(q->trails_size, sizeof(trail)), NULL);
+	q->peak_frames_size = q->frames_size;
+	q->peak_slots_size = q->slots_size;
+	q->peak_choices_size = q->choices_size;
+	q->peak_trails_size = q->trails_size;
 
 	// Allocate these later as needed...
 
 	q->h_size = is_task ? INITIAL_NBR_HEAP/10 : INITIAL_NBR_HEAP;
+	q->gc_threshold = q->h_size * GC_MIN_ARENAS;
 	q->tmph_size = is_task ? INITIAL_NBR_CELLS/10 : INITIAL_NBR_CELLS;
 
 	for (int i = 0; i < MAX_QUEUES; i++)
 		q->q_size[i] = is_task ? INITIAL_NBR_QUEUE/10 : INITIAL_NBR_QUEUE;
 
+	m->pl->nbr_queries++;
+	pin_query(q);
+
 	if (error) {
 		destroy_query (q);
 		q = NULL;
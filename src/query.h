@@ -21,6 +21,7 @@ extern 	USE_RESULT pl_status start(query *q);
 extern USE_RESULT pl_status match_rule(query *q, cell *p1, idx_t p1_ctx);
 extern USE_RESULT pl_status match_clause(query *q, cell *p1, idx_t p1_ctx, enum clause_type retract);
 extern unsigned create_vars(query *q, unsigned nbr);
+extern idx_t create_var_frame(query *q, unsigned nbr);
 extern void try_me(const query *q, unsigned vars);
 extern USE_RESULT pl_status throw_error(query *q, cell *c, const char *err_type, const char *expected);
 extern void call_attrs(query *q, cell *attrs);
@@ -37,12 +38,14 @@ extern void make_indirect(cell *tmp, cell *c);
 extern unsigned fake_numbervars(query *q, cell *c, idx_t c_ctx, unsigned start);
 extern bool has_vars(query *q, cell *c, idx_t c_ctx, unsigned depth);
 extern pl_status do_post_unification_hook(query *q);
+extern pl_status do_alarm_hook(query *q, cell *ret);
 extern pl_status throw_error(query *q, cell *c, const char *err_type, const char *expected);
 extern int compare(query *q, cell *p1, idx_t p1_ctx, cell *p2, idx_t p2_ctx, unsigned depth);
 extern USE_RESULT pl_status fn_iso_add_2(query *q);
 extern void do_calc_(query *q, cell *c, idx_t c_ctx);
 extern pl_status call_function(query *q, cell *c, idx_t c_ctx);
-extern void add_to_dirty_list(query *q, clause *r);
+extern bool add_to_dirty_list(query *q, clause *r);
+extern USE_RESULT pl_status trail_global_var(query *q, global_undo *u);
 
 extern ssize_t print_term_to_buf(query *q, char *dst, size_t dstlen, cell *c, idx_t c_ctx, int running, bool cons, unsigned depth);
 extern pl_status print_term(query *q, FILE *fp, cell *c, idx_t c_ctx, int running);
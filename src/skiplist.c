@@ -26,6 +26,8 @@ struct sliter_ {
 	skiplist *l;
 	slnode_t *p;
 	const void *key;
+	int (*cmpkey)(const void*, const void*, const void *p);
+	const void *p1;
 	int idx;
 	bool dead;
 };
@@ -134,13 +136,13 @@ static int binary_search(const skiplist *l, const keyval_t n[], const void *key,
 
 // Modified binary search: return position where it is or ought to be
 
-static int binary_search1(const skiplist *l, const keyval_t n[], const void *key, int imin, int imax)
+static int binary_search1(int (*cmpkey)(const void*, const void*, const void*), const void *p, const keyval_t n[], const void *key, int imin, int imax)
 {
 	int imid = 0;
 
 	while (imax >= imin) {
 		imid = (imax + imin) / 2;
-		int ok = l->cmpkey(n[imid].key, key, l->p);
+		int ok = cmpkey(n[imid].key, key, p);
 
 		if (ok < 0)
 			imin = imid + 1;
@@ -148,7 +150,7 @@ static int binary_search1(const skiplist *l, const keyval_t n[], const void *key
 			imax = imid - 1;
 	}
 
-	int ok = l->cmpkey(n[imid].key, key, l->p);
+	int ok = cmpkey(n[imid].key, key, p);
 
 	if (ok < 0)
 		imid++;
@@ -488,6 +490,8 @@ sliter *sl_first(skiplist *l)
 	}
 
 	iter->key = NULL;
+	iter->cmpkey = l->cmpkey;
+	iter->p1 = l->p;
 	iter->l = l;
 	iter->p = l->header->forward[0];
 	iter->idx = 0;
@@ -514,25 +518,29 @@ bool sl_next(sliter *iter, void **val)
 	return false;
 }
 
-sliter *sl_findkey(skiplist *l, const void *key)
+// Search with a comparator other than the one the list was built with.
+// It must order keys the same way, but the key it is given need not
+// be of the same kind as the stored keys (the iterator keeps both).
+
+sliter *sl_findkey_cmp(skiplist *l, const void *key, int (*cmpkey)(const void*, const void*, const void*), const void *p1)
 {
 	slnode_t *p, *q = 0;
 	p = l->header;
 
 	for (int k = l->level - 1; k >= 0; k--) {
-		while ((q = p->forward[k]) && (l->cmpkey(q->bkt[q->nbr - 1].key, key, l->p) < 0))
+		while ((q = p->forward[k]) && (cmpkey(q->bkt[q->nbr - 1].key, key, p1) < 0))
 			p = q;
 	}
 
 	if (!(q = p->forward[0]))
 		return NULL;
 
-	int imid = binary_search1(l, q->bkt, key, 0, q->nbr - 1);
+	int imid = binary_search1(cmpkey, p1, q->bkt, key, 0, q->nbr - 1);
 
 	if (imid < 0)
 		return NULL;
 
-	if (l->cmpkey(q->bkt[imid].key, key, l->p) != 0)
+	if (cmpkey(q->bkt[imid].key, key, p1) != 0)
 		return NULL;
 
 	sliter *iter;
@@ -546,6 +554,8 @@ sliter *sl_findkey(skiplist *l, const void *key)
 	}
 
 	iter->key = key;
+	iter->cmpkey = cmpkey;
+	iter->p1 = p1;
 	iter->l = l;
 	iter->p = q;
 	iter->idx = imid;
@@ -553,6 +563,11 @@ sliter *sl_findkey(skiplist *l, const void *key)
 	return iter;
 }
 
+sliter *sl_findkey(skiplist *l, const void *key)
+{
+	return sl_findkey_cmp(l, key, l->cmpkey, l->p);
+}
+
 bool sl_is_nextkey(sliter *iter)
 {
 	if (!iter)
@@ -560,7 +575,7 @@ bool sl_is_nextkey(sliter *iter)
 
 	while (iter->p) {
 		if (iter->idx < iter->p->nbr) {
-			if (iter->l->cmpkey(iter->p->bkt[iter->idx].key, iter->key, iter->l->p) != 0) {
+			if (iter->cmpkey(iter->p->bkt[iter->idx].key, iter->key, iter->p1) != 0) {
 				sl_done(iter);
 				return false;
 			}
@@ -582,7 +597,7 @@ bool sl_nextkey(sliter *iter, void **val)
 
 	while (iter->p) {
 		if (iter->idx < iter->p->nbr) {
-			if (iter->l->cmpkey(iter->p->bkt[iter->idx].key, iter->key, iter->l->p) != 0) {
+			if (iter->cmpkey(iter->p->bkt[iter->idx].key, iter->key, iter->p1) != 0) {
 				sl_done(iter);
 				return false;
 			}
@@ -31,6 +31,14 @@ extern void sl_find(
 	);
 
 extern sliter *sl_findkey(skiplist *l, const void *k);
+
+extern sliter *sl_findkey_cmp(
+	skiplist *l,
+	const void *k,
+	int (*cmpkey)(const void *k1, const void *k2, const void* p),
+	const void *p
+	);
+
 extern bool sl_is_nextkey(sliter *i);
 extern bool sl_nextkey(sliter *i, void **v);
 
@@ -0,0 +1,1212 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "trealla.h"
+#include "internal.h"
+#include "parser.h"
+#include "prolog.h"
+#include "query.h"
+#include "heap.h"
+#include "builtins.h"
+
+// Each thread runs its own query against the shared database. Without
+// USE_THREADS the goal is run to completion inside thread_create/3 so
+// that programs using the API still work, just not concurrently.
+
+typedef struct {
+	query *q;
+	term *goal, *ball;
+	char *alias;
+	global_vars gvars;
+#if USE_THREADS
+	pthread_t id;
+#endif
+	bool in_use, done, detached;
+} pl_thread;
+
+static pl_thread g_threads[MAX_THREADS];
+static THREAD_LOCAL unsigned g_thread_nbr;
+
+#if USE_THREADS
+static lock g_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+#else
+static lock g_threads_lock;
+#endif
+
+static void make_atom(cell *tmp, idx_t offset)
+{
+	*tmp = (cell){0};
+	tmp->val_type = TYPE_LITERAL;
+	tmp->nbr_cells = 1;
+	tmp->val_off = offset;
+}
+
+static void make_thread_id(query *q, cell *tmp, unsigned n)
+{
+	if (!n)
+		make_atom(tmp, index_from_pool(q->st.m->pl, "main"));
+	else if (g_threads[n].alias)
+		make_atom(tmp, index_from_pool(q->st.m->pl, g_threads[n].alias));
+	else
+		make_int(tmp, n);
+}
+
+// Returns the slot of a live thread given its id or alias, else zero.
+
+static unsigned find_thread(query *q, cell *c)
+{
+	unsigned n = 0;
+	acquire(&g_threads_lock);
+
+	if (is_integer(c)) {
+		if ((c->val_num > 0) && (c->val_num < MAX_THREADS)
+			&& g_threads[c->val_num].in_use)
+			n = c->val_num;
+	} else if (is_atom(c)) {
+		for (unsigned i = 1; i < MAX_THREADS; i++) {
+			if (g_threads[i].in_use && g_threads[i].alias
+				&& !strcmp(g_threads[i].alias, GET_STR(c))) {
+				n = i;
+				break;
+			}
+		}
+	}
+
+	release(&g_threads_lock);
+	return n;
+}
+
+// Mailboxes are multi-producer single-consumer queues of detached
+// terms. Senders link messages in with an atomic exchange and never
+// take a lock. The receiver moves what has arrived onto its own list
+// so it can pick out the first message that unifies.
+
+#define MAX_MAILBOXES 1024
+
+typedef struct msg_ msg;
+
+struct msg_ {
+	msg *next;
+	term *t;
+};
+
+typedef struct {
+	msg *head, *tail, stub;
+	msg *first, *last;
+	char *alias;
+	unsigned waiters;
+	lock guard;
+#if USE_THREADS
+	pthread_cond_t cond;
+#endif
+	bool in_use;
+} mailbox;
+
+static mailbox g_mailboxes[MAX_THREADS], g_queues[MAX_MAILBOXES];
+static bool g_mailboxes_init;
+
+static void init_mailbox(mailbox *mb)
+{
+	mb->head = mb->tail = &mb->stub;
+	mb->stub.next = NULL;
+	init_lock(&mb->guard);
+#if USE_THREADS
+	pthread_cond_init(&mb->cond, NULL);
+#endif
+}
+
+static void init_mailboxes(void)
+{
+	if (__atomic_load_n(&g_mailboxes_init, __ATOMIC_ACQUIRE))
+		return;
+
+	acquire(&g_threads_lock);
+
+	if (!g_mailboxes_init) {
+		for (unsigned i = 0; i < MAX_THREADS; i++)
+			init_mailbox(&g_mailboxes[i]);
+
+		for (unsigned i = 0; i < MAX_MAILBOXES; i++)
+			init_mailbox(&g_queues[i]);
+
+		g_mailboxes[0].in_use = true;
+		__atomic_store_n(&g_mailboxes_init, true, __ATOMIC_RELEASE);
+	}
+
+	release(&g_threads_lock);
+}
+
+static void mailbox_push(mailbox *mb, msg *m)
+{
+	m->next = NULL;
+	msg *prev = __atomic_exchange_n(&mb->head, m, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&prev->next, m, __ATOMIC_RELEASE);
+}
+
+// Consumer side only. Returns NULL if empty, or if a producer is
+// part way through a push (it will be seen next time).
+
+static msg *mailbox_pop(mailbox *mb)
+{
+	msg *tail = mb->tail;
+	msg *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	if (tail == &mb->stub) {
+		if (!next)
+			return NULL;
+
+		mb->tail = tail = next;
+		next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	}
+
+	if (next) {
+		mb->tail = next;
+		return tail;
+	}
+
+	if (tail != __atomic_load_n(&mb->head, __ATOMIC_SEQ_CST))
+		return NULL;
+
+	mailbox_push(mb, &mb->stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	if (!next)
+		return NULL;
+
+	mb->tail = next;
+	return tail;
+}
+
+static void free_msg(msg *m)
+{
+	clear_term(m->t);
+	free(m->t);
+	free(m);
+}
+
+static bool mailbox_drain(mailbox *mb)
+{
+	bool any = false;
+	msg *m;
+
+	while ((m = mailbox_pop(mb)) != NULL) {
+		m->next = NULL;
+
+		if (mb->last)
+			mb->last->next = m;
+		else
+			mb->first = m;
+
+		mb->last = m;
+		any = true;
+	}
+
+	return any;
+}
+
+static void mailbox_clear(mailbox *mb)
+{
+	acquire(&mb->guard);
+	mailbox_drain(mb);
+
+	for (msg *m = mb->first; m;) {
+		msg *save = m;
+		m = m->next;
+		free_msg(save);
+	}
+
+	mb->first = mb->last = NULL;
+	free(mb->alias);
+	mb->alias = NULL;
+	release(&mb->guard);
+}
+
+// Atom GC has to see the terms still waiting in mailboxes and queues,
+// including any pushes not yet drained.
+
+void walk_queued_terms(void (*fn)(const term *t, void *data), void *data)
+{
+	if (!__atomic_load_n(&g_mailboxes_init, __ATOMIC_ACQUIRE))
+		return;
+
+	for (unsigned i = 0; i < (MAX_THREADS+MAX_MAILBOXES); i++) {
+		mailbox *mb = i < MAX_THREADS ? &g_mailboxes[i] : &g_queues[i-MAX_THREADS];
+
+		if (!mb->in_use)
+			continue;
+
+		acquire(&mb->guard);
+		mailbox_drain(mb);
+
+		for (const msg *m = mb->first; m; m = m->next)
+			fn(m->t, data);
+
+		release(&mb->guard);
+	}
+}
+
+static void mailbox_send(mailbox *mb, term *t)
+{
+	msg *m = malloc(sizeof(msg));
+	ensure(m);
+	m->t = t;
+	mailbox_push(mb, m);
+
+#if USE_THREADS
+	if (__atomic_load_n(&mb->waiters, __ATOMIC_SEQ_CST)) {
+		acquire(&mb->guard);
+		pthread_cond_signal(&mb->cond);
+		release(&mb->guard);
+	}
+#endif
+}
+
+static void free_thread(prolog *pl, pl_thread *t)
+{
+	pl->nbr_threads--;
+	mailbox_clear(&g_mailboxes[t - g_threads]);
+	destroy_query(t->q);
+	clear_term(t->goal);
+	free(t->goal);
+
+	if (t->ball) {
+		clear_term(t->ball);
+		free(t->ball);
+	}
+
+	free(t->alias);
+	acquire(&g_threads_lock);
+	memset(t, 0, sizeof(pl_thread));
+	g_mailboxes[t - g_threads].in_use = false;
+	release(&g_threads_lock);
+}
+
+static void run_thread(pl_thread *t)
+{
+	unsigned save_nbr = g_thread_nbr;
+	g_thread_nbr = t - g_threads;
+	execute(t->q, t->goal);
+	clear_global_vars(&t->gvars);
+	g_thread_nbr = save_nbr;
+	prolog *pl = t->q->st.m->pl;
+	acquire(&g_threads_lock);
+	t->done = true;
+	bool detached = t->detached;
+	release(&g_threads_lock);
+
+	if (detached)
+		free_thread(pl, t);
+}
+
+#if USE_THREADS
+static void *start_routine(void *arg)
+{
+	run_thread((pl_thread*)arg);
+	return NULL;
+}
+#endif
+
+// Wrap the goal as call(Goal) so control constructs and builtins are
+// resolved at run-time in the new query.
+
+static term *make_goal(query *q, cell *p1, idx_t p1_ctx)
+{
+	term *tmp = detach_term(q, p1, p1_ctx);
+	if (!tmp) return NULL;
+	term *t = calloc(1, sizeof(term)+(sizeof(cell)*(tmp->cidx+2)));
+
+	if (!t) {
+		clear_term(tmp);
+		free(tmp);
+		return NULL;
+	}
+
+	bool found = false;
+	cell *c = t->cells;
+	make_atom(c, g_call_s);
+	c->arity = 1;
+	c->nbr_cells = 1 + tmp->cidx;
+	c->fn = get_builtin(q->st.m->pl, "call", 1, &found);
+	c->flags |= FLAG_BUILTIN;
+	memcpy(c+1, tmp->cells, sizeof(cell)*tmp->cidx);
+	make_end(c+1+tmp->cidx);
+	t->cidx = t->nbr_cells = tmp->cidx + 2;
+	t->nbr_vars = tmp->nbr_vars;
+	free(tmp);
+	return t;
+}
+
+static USE_RESULT pl_status fn_sys_thread_create_3(query *q)
+{
+	GET_FIRST_ARG(p1,callable);
+	GET_NEXT_ARG(p2,variable);
+	GET_NEXT_ARG(p3,list_or_nil);
+	cell *alias = NULL;
+	bool detached = false;
+	LIST_HANDLER(p3);
+
+	while (is_list(p3)) {
+		cell *h = LIST_HEAD(p3);
+		cell *c = deref(q, h, p3_ctx);
+
+		if (is_variable(c))
+			return throw_error(q, c, "instantiation_error", "args_not_sufficiently_instantiated");
+
+		if (!is_structure(c) || (c->arity != 1))
+			return throw_error(q, c, "domain_error", "thread_option");
+
+		cell *name = deref(q, c+1, q->latest_ctx);
+
+		if (!strcmp(GET_STR(c), "alias")) {
+			if (!is_atom(name))
+				return throw_error(q, c, "domain_error", "thread_option");
+
+			if (find_thread(q, name))
+				return throw_error(q, name, "permission_error", "create,thread");
+
+			alias = name;
+		} else if (!strcmp(GET_STR(c), "detached")) {
+			if (!is_atom(name))
+				return throw_error(q, c, "domain_error", "thread_option");
+
+			detached = name->val_off == g_true_s;
+		} else
+			return throw_error(q, c, "domain_error", "thread_option");
+
+		p3 = LIST_TAIL(p3);
+		p3 = deref(q, p3, p3_ctx);
+		p3_ctx = q->latest_ctx;
+	}
+
+	init_mailboxes();
+	unsigned n = 0;
+	acquire(&g_threads_lock);
+
+	for (unsigned i = 1; i < MAX_THREADS; i++) {
+		if (!g_threads[i].in_use) {
+			g_threads[i].in_use = true;
+			g_mailboxes[i].in_use = true;
+			n = i;
+			break;
+		}
+	}
+
+	release(&g_threads_lock);
+
+	if (!n)
+		return throw_error(q, p1, "resource_error", "threads");
+
+	pl_thread *t = g_threads + n;
+	t->goal = make_goal(q, p1, p1_ctx);
+
+	if (!t->goal) {
+		t->in_use = g_mailboxes[n].in_use = false;
+		return q->did_throw ? pl_success : throw_error(q, p1, "resource_error", "memory");
+	}
+
+	t->q = create_query(q->st.m, false);
+	ensure(t->q);
+	t->alias = alias ? strdup(GET_STR(alias)) : NULL;
+	t->detached = detached;
+	q->st.m->pl->nbr_threads++;
+	cell tmp;
+	make_thread_id(q, &tmp, n);
+
+#if USE_THREADS
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, 16*1024*1024);
+
+	if (detached)
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	int err = pthread_create(&t->id, &attr, start_routine, t);
+	pthread_attr_destroy(&attr);
+
+	if (err) {
+		free_thread(q->st.m->pl, t);
+		return throw_error(q, p1, "resource_error", "threads");
+	}
+#else
+	run_thread(t);
+#endif
+
+	return unify(q, p2, p2_ctx, &tmp, q->st.curr_frame);
+}
+
+static USE_RESULT pl_status fn_sys_thread_exception_1(query *q)
+{
+	GET_FIRST_ARG(p1,any);
+
+	if (!g_thread_nbr)
+		return pl_success;
+
+	pl_thread *t = g_threads + g_thread_nbr;
+	t->ball = detach_term(q, p1, p1_ctx);
+	return pl_success;
+}
+
+static USE_RESULT pl_status fn_thread_join_2(query *q)
+{
+	GET_FIRST_ARG(p1,atom_or_int);
+	GET_NEXT_ARG(p2,any);
+	unsigned n = find_thread(q, p1);
+
+	if (!n || g_threads[n].detached || (n == g_thread_nbr))
+		return throw_error(q, p1, "existence_error", "thread");
+
+	pl_thread *t = g_threads + n;
+
+#if USE_THREADS
+	pthread_join(t->id, NULL);
+#endif
+
+	cell *tmp;
+
+	if (t->ball) {
+		cell *c = attach_term(q, t->ball);
+		if (!c) return pl_error;
+		tmp = alloc_on_heap(q, 1+t->ball->cidx);
+		may_ptr_error(tmp);
+		make_atom(tmp, index_from_pool(q->st.m->pl, "exception"));
+		tmp->arity = 1;
+		tmp->nbr_cells = 1 + t->ball->cidx;
+		safe_copy_cells(tmp+1, c, t->ball->cidx);
+	} else {
+		tmp = alloc_on_heap(q, 1);
+		may_ptr_error(tmp);
+		make_atom(tmp, t->q->status ? g_true_s : g_false_s);
+	}
+
+	free_thread(q->st.m->pl, t);
+	return unify(q, p2, p2_ctx, tmp, q->st.curr_frame);
+}
+
+static USE_RESULT pl_status fn_thread_detach_1(query *q)
+{
+	GET_FIRST_ARG(p1,atom_or_int);
+	unsigned n = find_thread(q, p1);
+
+	if (!n)
+		return throw_error(q, p1, "existence_error", "thread");
+
+	pl_thread *t = g_threads + n;
+	acquire(&g_threads_lock);
+	bool done = t->done;
+	t->detached = true;
+#if USE_THREADS
+	pthread_t id = t->id;
+#endif
+	release(&g_threads_lock);
+
+#if USE_THREADS
+	if (done)
+		pthread_join(id, NULL);
+	else
+		pthread_detach(id);
+#endif
+
+	if (done)
+		free_thread(q->st.m->pl, t);
+
+	return pl_success;
+}
+
+static cell *make_queue_id(query *q, unsigned n)
+{
+	cell *tmp = alloc_on_heap(q, 2);
+	if (!tmp) return NULL;
+	make_atom(tmp, index_from_pool(q->st.m->pl, "$message_queue"));
+	tmp->arity = 1;
+	tmp->nbr_cells = 2;
+	make_int(tmp+1, n);
+	return tmp;
+}
+
+// A mailbox is named by a thread id or alias, or by a queue made with
+// message_queue_create/1,2 (its '$message_queue'(N) term or alias).
+
+static mailbox *find_mailbox(query *q, cell *c)
+{
+	init_mailboxes();
+
+	if (is_structure(c) && (c->arity == 1) && !strcmp(GET_STR(c), "$message_queue")) {
+		cell *n = deref(q, c+1, q->latest_ctx);
+
+		if (is_integer(n) && (n->val_num >= 0) && (n->val_num < MAX_MAILBOXES)
+			&& g_queues[n->val_num].in_use)
+			return &g_queues[n->val_num];
+
+		return NULL;
+	}
+
+	if (is_atom(c) && !strcmp(GET_STR(c), "main"))
+		return &g_mailboxes[0];
+
+	unsigned n = find_thread(q, c);
+
+	if (n)
+		return &g_mailboxes[n];
+
+	if (!is_atom(c))
+		return NULL;
+
+	mailbox *mb = NULL;
+	acquire(&g_threads_lock);
+
+	for (unsigned i = 0; i < MAX_MAILBOXES; i++) {
+		if (g_queues[i].in_use && g_queues[i].alias
+			&& !strcmp(g_queues[i].alias, GET_STR(c))) {
+			mb = &g_queues[i];
+			break;
+		}
+	}
+
+	release(&g_threads_lock);
+	return mb;
+}
+
+static USE_RESULT pl_status fn_message_queue_create_2(query *q)
+{
+	GET_FIRST_ARG(p1,variable);
+	GET_NEXT_ARG(p2,list_or_nil);
+	cell *alias = NULL;
+	LIST_HANDLER(p2);
+
+	while (is_list(p2)) {
+		cell *h = LIST_HEAD(p2);
+		cell *c = deref(q, h, p2_ctx);
+
+		if (is_variable(c))
+			return throw_error(q, c, "instantiation_error", "args_not_sufficiently_instantiated");
+
+		if (!is_structure(c) || (c->arity != 1) || strcmp(GET_STR(c), "alias"))
+			return throw_error(q, c, "domain_error", "queue_option");
+
+		alias = deref(q, c+1, q->latest_ctx);
+
+		if (!is_atom(alias))
+			return throw_error(q, c, "domain_error", "queue_option");
+
+		if (find_mailbox(q, alias))
+			return throw_error(q, alias, "permission_error", "create,message_queue");
+
+		p2 = LIST_TAIL(p2);
+		p2 = deref(q, p2, p2_ctx);
+		p2_ctx = q->latest_ctx;
+	}
+
+	init_mailboxes();
+	unsigned n = MAX_MAILBOXES;
+	acquire(&g_threads_lock);
+
+	for (unsigned i = 0; i < MAX_MAILBOXES; i++) {
+		if (!g_queues[i].in_use) {
+			g_queues[i].in_use = true;
+			g_queues[i].alias = alias ? strdup(GET_STR(alias)) : NULL;
+			n = i;
+			break;
+		}
+	}
+
+	release(&g_threads_lock);
+
+	if (n == MAX_MAILBOXES)
+		return throw_error(q, p1, "resource_error", "message_queues");
+
+	if (alias)
+		return unify(q, p1, p1_ctx, alias, q->st.curr_frame);
+
+	cell *tmp = make_queue_id(q, n);
+	may_ptr_error(tmp);
+	return unify(q, p1, p1_ctx, tmp, q->st.curr_frame);
+}
+
+static USE_RESULT pl_status fn_message_queue_destroy_1(query *q)
+{
+	GET_FIRST_ARG(p1,nonvar);
+	mailbox *mb = find_mailbox(q, p1);
+
+	if (!mb || (mb < g_queues) || (mb >= (g_queues+MAX_MAILBOXES)))
+		return throw_error(q, p1, "existence_error", "message_queue");
+
+	mailbox_clear(mb);
+	acquire(&g_threads_lock);
+	mb->in_use = false;
+	release(&g_threads_lock);
+	return pl_success;
+}
+
+static USE_RESULT pl_status fn_thread_send_message_2(query *q)
+{
+	GET_FIRST_ARG(p1,nonvar);
+	GET_NEXT_ARG(p2,any);
+	mailbox *mb = find_mailbox(q, p1);
+
+	if (!mb)
+		return throw_error(q, p1, "existence_error", "message_queue");
+
+	term *t = detach_term(q, p2, p2_ctx);
+
+	if (!t)
+		return q->did_throw ? pl_success : throw_error(q, p2, "resource_error", "memory");
+
+	mailbox_send(mb, t);
+	return pl_success;
+}
+
+// Take the first message that unifies with the pattern, waiting up to
+// 'msecs' for one to arrive (forever if negative).
+
+static pl_status get_message(query *q, mailbox *mb, cell *p1, idx_t p1_ctx, int64_t msecs)
+{
+#if USE_THREADS
+	struct timespec deadline;
+
+	if (msecs > 0) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += msecs / 1000;
+		deadline.tv_nsec += (msecs % 1000) * 1000 * 1000;
+
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+#endif
+
+	may_error(make_choice(q));
+	frame *g = GET_CURR_FRAME();
+	acquire(&mb->guard);
+	mailbox_drain(mb);
+
+	msg *prev = NULL;
+
+	// Only messages that arrive while waiting need to be looked at
+	// again, so carry on from the last one tried...
+
+	while (true) {
+		for (msg *m = prev ? prev->next : mb->first; m; prev = m, m = m->next) {
+			cell *c = attach_term(q, m->t);
+
+			if (!c) {
+				release(&mb->guard);
+				drop_choice(q);
+				return pl_error;
+			}
+
+			try_me(q, g->nbr_vars);
+
+			if (unify(q, p1, p1_ctx, c, q->st.curr_frame)) {
+				if (prev)
+					prev->next = m->next;
+				else
+					mb->first = m->next;
+
+				if (mb->last == m)
+					mb->last = prev;
+
+				release(&mb->guard);
+				free_msg(m);
+				drop_choice(q);
+				return pl_success;
+			}
+
+			undo_me(q);
+		}
+
+		if (!msecs)
+			break;
+
+#if USE_THREADS
+		__atomic_add_fetch(&mb->waiters, 1, __ATOMIC_SEQ_CST);
+		int err = 0;
+
+		if (!mailbox_drain(mb)) {
+			if (msecs > 0)
+				err = pthread_cond_timedwait(&mb->cond, &mb->guard, &deadline);
+			else
+				pthread_cond_wait(&mb->cond, &mb->guard);
+		}
+
+		__atomic_sub_fetch(&mb->waiters, 1, __ATOMIC_SEQ_CST);
+		mailbox_drain(mb);
+
+		if (err == ETIMEDOUT)
+			msecs = 0;
+#else
+		break;
+#endif
+	}
+
+	release(&mb->guard);
+	drop_choice(q);
+	return pl_failure;
+}
+
+static USE_RESULT pl_status fn_thread_get_message_1(query *q)
+{
+	GET_FIRST_ARG(p1,any);
+	init_mailboxes();
+	return get_message(q, &g_mailboxes[g_thread_nbr], p1, p1_ctx, -1);
+}
+
+static USE_RESULT pl_status fn_thread_get_message_2(query *q)
+{
+	GET_FIRST_ARG(p1,nonvar);
+	GET_NEXT_ARG(p2,any);
+	mailbox *mb = find_mailbox(q, p1);
+
+	if (!mb)
+		return throw_error(q, p1, "existence_error", "message_queue");
+
+	return get_message(q, mb, p2, p2_ctx, -1);
+}
+
+static USE_RESULT pl_status fn_thread_get_message_3(query *q)
+{
+	GET_FIRST_ARG(p1,nonvar);
+	GET_NEXT_ARG(p2,any);
+	GET_NEXT_ARG(p3,list_or_nil);
+	mailbox *mb = find_mailbox(q, p1);
+
+	if (!mb)
+		return throw_error(q, p1, "existence_error", "message_queue");
+
+	int64_t msecs = -1;
+	LIST_HANDLER(p3);
+
+	while (is_list(p3)) {
+		cell *h = LIST_HEAD(p3);
+		cell *c = deref(q, h, p3_ctx);
+
+		if (is_variable(c))
+			return throw_error(q, c, "instantiation_error", "args_not_sufficiently_instantiated");
+
+		if (!is_structure(c) || (c->arity != 1) || strcmp(GET_STR(c), "timeout"))
+			return throw_error(q, c, "domain_error", "message_option");
+
+		cell *val = deref(q, c+1, q->latest_ctx);
+
+		if (is_integer(val))
+			msecs = val->val_num * 1000;
+		else if (is_float(val))
+			msecs = val->val_flt * 1000;
+		else
+			return throw_error(q, c, "domain_error", "message_option");
+
+		if (msecs < 0)
+			msecs = 0;
+
+		p3 = LIST_TAIL(p3);
+		p3 = deref(q, p3, p3_ctx);
+		p3_ctx = q->latest_ctx;
+	}
+
+	return get_message(q, mb, p2, p2_ctx, msecs);
+}
+
+// Ask a thread to stop at its next goal, its status becomes false.
+
+static USE_RESULT pl_status fn_sys_thread_cancel_1(query *q)
+{
+	GET_FIRST_ARG(p1,atom_or_int);
+	unsigned n = find_thread(q, p1);
+
+	if (!n)
+		return throw_error(q, p1, "existence_error", "thread");
+
+	g_threads[n].q->cancel = true;
+	return pl_success;
+}
+
+// Engines are queries run on demand in the caller's thread. An answer
+// is handed back by engine_yield/1 suspending the query, the next call
+// to engine_next/2 resumes it where it left off.
+
+#define MAX_ENGINES 1024
+
+typedef struct {
+	query *q;
+	term *goal, *answer, *ball, *post;
+	char *alias;
+	bool in_use, started, running;
+} pl_engine;
+
+static pl_engine g_engines[MAX_ENGINES];
+static THREAD_LOCAL unsigned g_engine_nbr;
+
+static cell *make_engine_id(query *q, unsigned n)
+{
+	if (g_engines[n].alias) {
+		cell *tmp = alloc_on_heap(q, 1);
+		if (!tmp) return NULL;
+		make_atom(tmp, index_from_pool(q->st.m->pl, g_engines[n].alias));
+		return tmp;
+	}
+
+	cell *tmp = alloc_on_heap(q, 2);
+	if (!tmp) return NULL;
+	make_atom(tmp, index_from_pool(q->st.m->pl, "$engine"));
+	tmp->arity = 1;
+	tmp->nbr_cells = 2;
+	make_int(tmp+1, n);
+	return tmp;
+}
+
+// Returns the engine given its '$engine'(N) term or alias, else NULL.
+
+static pl_engine *find_engine(query *q, cell *c)
+{
+	if (is_structure(c) && (c->arity == 1) && !strcmp(GET_STR(c), "$engine")) {
+		cell *n = deref(q, c+1, q->latest_ctx);
+
+		if (is_integer(n) && (n->val_num > 0) && (n->val_num < MAX_ENGINES)
+			&& g_engines[n->val_num].in_use)
+			return &g_engines[n->val_num];
+
+		return NULL;
+	}
+
+	if (!is_atom(c))
+		return NULL;
+
+	pl_engine *e = NULL;
+	acquire(&g_threads_lock);
+
+	for (unsigned i = 1; i < MAX_ENGINES; i++) {
+		if (g_engines[i].in_use && g_engines[i].alias
+			&& !strcmp(g_engines[i].alias, GET_STR(c))) {
+			e = &g_engines[i];
+			break;
+		}
+	}
+
+	release(&g_threads_lock);
+	return e;
+}
+
+static void free_term(term **t)
+{
+	if (!*t)
+		return;
+
+	clear_term(*t);
+	free(*t);
+	*t = NULL;
+}
+
+// Once an engine has run out of answers its query can go, the slot
+// stays until engine_destroy/1.
+
+static void finish_engine(pl_engine *e)
+{
+	if (e->q)
+		destroy_query(e->q);
+
+	e->q = NULL;
+	free_term(&e->goal);
+	free_term(&e->answer);
+	free_term(&e->post);
+}
+
+static USE_RESULT pl_status fn_sys_engine_create_3(query *q)
+{
+	GET_FIRST_ARG(p1,callable);
+	GET_NEXT_ARG(p2,variable);
+	GET_NEXT_ARG(p3,list_or_nil);
+	cell *alias = NULL;
+	LIST_HANDLER(p3);
+
+	while (is_list(p3)) {
+		cell *h = LIST_HEAD(p3);
+		cell *c = deref(q, h, p3_ctx);
+
+		if (is_variable(c))
+			return throw_error(q, c, "instantiation_error", "args_not_sufficiently_instantiated");
+
+		if (!is_structure(c) || (c->arity != 1) || strcmp(GET_STR(c), "alias"))
+			return throw_error(q, c, "domain_error", "engine_option");
+
+		alias = deref(q, c+1, q->latest_ctx);
+
+		if (!is_atom(alias))
+			return throw_error(q, c, "domain_error", "engine_option");
+
+		if (find_engine(q, alias))
+			return throw_error(q, alias, "permission_error", "create,engine");
+
+		p3 = LIST_TAIL(p3);
+		p3 = deref(q, p3, p3_ctx);
+		p3_ctx = q->latest_ctx;
+	}
+
+	unsigned n = 0;
+	acquire(&g_threads_lock);
+
+	for (unsigned i = 1; i < MAX_ENGINES; i++) {
+		if (!g_engines[i].in_use) {
+			g_engines[i].in_use = true;
+			n = i;
+			break;
+		}
+	}
+
+	release(&g_threads_lock);
+
+	if (!n)
+		return throw_error(q, p1, "resource_error", "engines");
+
+	pl_engine *e = g_engines + n;
+	e->goal = make_goal(q, p1, p1_ctx);
+
+	if (!e->goal) {
+		e->in_use = false;
+		return q->did_throw ? pl_success : throw_error(q, p1, "resource_error", "memory");
+	}
+
+	e->q = create_query(q->st.m, false);
+	ensure(e->q);
+	e->alias = alias ? strdup(GET_STR(alias)) : NULL;
+	cell *tmp = make_engine_id(q, n);
+	may_ptr_error(tmp);
+	return unify(q, p2, p2_ctx, tmp, q->st.curr_frame);
+}
+
+static USE_RESULT pl_status fn_sys_engine_exception_1(query *q)
+{
+	GET_FIRST_ARG(p1,any);
+
+	if (!g_engine_nbr)
+		return pl_success;
+
+	pl_engine *e = g_engines + g_engine_nbr;
+	free_term(&e->ball);
+	e->ball = detach_term(q, p1, p1_ctx);
+	return pl_success;
+}
+
+// Run the engine to its next answer. The reply is answer(T) or
+// exception(E), and there is none once the goal has finished. An
+// engine can't be resumed while it is running, whether by itself or
+// by an engine it is waiting on.
+
+static USE_RESULT pl_status engine_next(query *q, pl_engine *e, cell *p2, idx_t p2_ctx)
+{
+	if (!e->q)
+		return pl_failure;
+
+	unsigned save_nbr = g_engine_nbr;
+	g_engine_nbr = e - g_engines;
+	e->running = true;
+
+	do {
+		if (!e->started) {
+			e->started = true;
+			execute(e->q, e->goal);
+		} else
+			DISCARD_RESULT start(e->q);
+	} while (e->q->yielded && e->q->st.curr_cell && !e->answer);
+
+	e->running = false;
+	g_engine_nbr = save_nbr;
+
+	if (!e->answer)
+		finish_engine(e);
+
+	term *t = e->ball ? e->ball : e->answer;
+
+	if (!t)
+		return pl_failure;
+
+	cell *c = attach_term(q, t);
+	if (!c) return pl_error;
+	cell *tmp = alloc_on_heap(q, 1+t->cidx);
+	may_ptr_error(tmp);
+	make_atom(tmp, index_from_pool(q->st.m->pl, e->ball ? "exception" : "answer"));
+	tmp->arity = 1;
+	tmp->nbr_cells = 1 + t->cidx;
+	safe_copy_cells(tmp+1, c, t->cidx);
+	free_term(e->ball ? &e->ball : &e->answer);
+	return unify(q, p2, p2_ctx, tmp, q->st.curr_frame);
+}
+
+static USE_RESULT pl_status fn_sys_engine_next_2(query *q)
+{
+	GET_FIRST_ARG(p1,nonvar);
+	GET_NEXT_ARG(p2,variable);
+	pl_engine *e = find_engine(q, p1);
+
+	if (!e)
+		return throw_error(q, p1, "existence_error", "engine");
+
+	if (e->running)
+		return throw_error(q, p1, "permission_error", "resume,engine");
+
+	return engine_next(q, e, p2, p2_ctx);
+}
+
+// Suspend the engine with an answer, resuming it just succeeds.
+
+static USE_RESULT pl_status fn_engine_yield_1(query *q)
+{
+	GET_FIRST_ARG(p1,any);
+
+	if (q->retry)
+		return pl_success;
+
+	if (!g_engine_nbr || (g_engines[g_engine_nbr].q != q))
+		return throw_error(q, p1, "permission_error", "yield,engine");
+
+	pl_engine *e = g_engines + g_engine_nbr;
+	e->answer = detach_term(q, p1, p1_ctx);
+
+	if (!e->answer)
+		return q->did_throw ? pl_success : throw_error(q, p1, "resource_error", "memory");
+
+	q->yielded = true;
+	may_error(make_choice(q));
+	return pl_failure;
+}
+
+static USE_RESULT pl_status fn_engine_post_2(query *q)
+{
+	GET_FIRST_ARG(p1,nonvar);
+	GET_NEXT_ARG(p2,any);
+	pl_engine *e = find_engine(q, p1);
+
+	if (!e)
+		return throw_error(q, p1, "existence_error", "engine");
+
+	if (e->post)
+		return throw_error(q, p1, "permission_error", "post_to,engine");
+
+	e->post = detach_term(q, p2, p2_ctx);
+
+	if (!e->post)
+		return q->did_throw ? pl_success : throw_error(q, p2, "resource_error", "memory");
+
+	return pl_success;
+}
+
+// As engine_post/2 then '$engine_next'/2, but the post is only made
+// once the engine is known to be resumable.
+
+static USE_RESULT pl_status fn_sys_engine_post_3(query *q)
+{
+	GET_FIRST_ARG(p1,nonvar);
+	GET_NEXT_ARG(p2,any);
+	GET_NEXT_ARG(p3,variable);
+	pl_engine *e = find_engine(q, p1);
+
+	if (!e)
+		return throw_error(q, p1, "existence_error", "engine");
+
+	if (e->running)
+		return throw_error(q, p1, "permission_error", "resume,engine");
+
+	if (e->post)
+		return throw_error(q, p1, "permission_error", "post_to,engine");
+
+	e->post = detach_term(q, p2, p2_ctx);
+
+	if (!e->post)
+		return q->did_throw ? pl_success : throw_error(q, p2, "resource_error", "memory");
+
+	return engine_next(q, e, p3, p3_ctx);
+}
+
+static USE_RESULT pl_status fn_engine_fetch_1(query *q)
+{
+	GET_FIRST_ARG(p1,any);
+
+	if (!g_engine_nbr)
+		return throw_error(q, p1, "permission_error", "fetch,engine");
+
+	pl_engine *e = g_engines + g_engine_nbr;
+
+	if (!e->post)
+		return throw_error(q, p1, "existence_error", "term");
+
+	cell *c = attach_term(q, e->post);
+	if (!c) return pl_error;
+	free_term(&e->post);
+	return unify(q, p1, p1_ctx, c, q->st.curr_frame);
+}
+
+static USE_RESULT pl_status fn_engine_destroy_1(query *q)
+{
+	GET_FIRST_ARG(p1,nonvar);
+	pl_engine *e = find_engine(q, p1);
+
+	if (!e)
+		return throw_error(q, p1, "existence_error", "engine");
+
+	if (e->running)
+		return throw_error(q, p1, "permission_error", "destroy,engine");
+
+	finish_engine(e);
+	free_term(&e->ball);
+	free(e->alias);
+	acquire(&g_threads_lock);
+	memset(e, 0, sizeof(pl_engine));
+	release(&g_threads_lock);
+	return pl_success;
+}
+
+static USE_RESULT pl_status fn_engine_self_1(query *q)
+{
+	GET_FIRST_ARG(p1,any);
+
+	if (!g_engine_nbr)
+		return pl_failure;
+
+	cell *tmp = make_engine_id(q, g_engine_nbr);
+	may_ptr_error(tmp);
+	return unify(q, p1, p1_ctx, tmp, q->st.curr_frame);
+}
+
+global_vars *get_global_vars(query *q)
+{
+	if (g_thread_nbr)
+		return &g_threads[g_thread_nbr].gvars;
+
+	return &q->st.m->pl->gvars;
+}
+
+static USE_RESULT pl_status fn_thread_self_1(query *q)
+{
+	GET_FIRST_ARG(p1,any);
+	cell tmp;
+	make_thread_id(q, &tmp, g_thread_nbr);
+	return unify(q, p1, p1_ctx, &tmp, q->st.curr_frame);
+}
+
+const struct builtins g_thread_funcs[] =
+{
+	{"$thread_create", 3, fn_sys_thread_create_3, NULL},
+	{"$thread_exception", 1, fn_sys_thread_exception_1, NULL},
+	{"thread_join", 2, fn_thread_join_2, NULL},
+	{"thread_detach", 1, fn_thread_detach_1, NULL},
+	{"thread_self", 1, fn_thread_self_1, NULL},
+	{"$thread_cancel", 1, fn_sys_thread_cancel_1, NULL},
+	{"thread_send_message", 2, fn_thread_send_message_2, NULL},
+	{"thread_get_message", 1, fn_thread_get_message_1, NULL},
+	{"thread_get_message", 2, fn_thread_get_message_2, NULL},
+	{"thread_get_message", 3, fn_thread_get_message_3, NULL},
+	{"message_queue_create", 2, fn_message_queue_create_2, NULL},
+	{"message_queue_destroy", 1, fn_message_queue_destroy_1, NULL},
+	{"$engine_create", 3, fn_sys_engine_create_3, NULL},
+	{"$engine_exception", 1, fn_sys_engine_exception_1, NULL},
+	{"$engine_next", 2, fn_sys_engine_next_2, NULL},
+	{"$engine_post", 3, fn_sys_engine_post_3, NULL},
+	{"engine_yield", 1, fn_engine_yield_1, NULL},
+	{"engine_post", 2, fn_engine_post_2, NULL},
+	{"engine_fetch", 1, fn_engine_fetch_1, NULL},
+	{"engine_destroy", 1, fn_engine_destroy_1, NULL},
+	{"engine_self", 1, fn_engine_self_1, NULL},
+
+	{0}
+};
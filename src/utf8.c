@@ -55,6 +55,19 @@ const char *strchr_utf8(const char *s, int ch)
 	return src;
 }
 
+const char *memchr_utf8(const char *s, int ch, size_t n)
+{
+	const char *src = s, *end = s + n;
+
+	while ((src < end) && (peek_char_utf8(src) != ch))
+		get_char_utf8(&src);
+
+	if (src >= end)
+		return NULL;
+
+	return src;
+}
+
 const char *strrchr_utf8(const char *s, int ch)
 {
 	const char *src = s, *save_src = NULL;
@@ -199,34 +212,12 @@ int xgetc_utf8(int(*fn)(), void *p1)
 	int expect = 1;
 
 	while (expect--) {
-		int _ch = fn(p1);
+		int ch = fn(p1);
 
-		if (_ch == EOF)
+		if (ch == EOF)
 			return EOF;
 
-		unsigned char ch = (unsigned char)_ch;
-
-		if ((ch & 0b11111100) == 0b11111100) {
-			n = ch & 0b00000001;
-			expect = 5;
-		} else if ((ch & 0b11111000) == 0b11111000) {
-			n = ch & 0b00000011;
-			expect = 4;
-		} else if ((ch & 0b11110000) == 0b11110000) {
-			n = ch & 0b00000111;
-			expect = 3;
-		} else if ((ch & 0b11100000) == 0b11100000) {
-			n = ch & 0b00001111;
-			expect = 2;
-		} else if ((ch & 0b11000000) == 0b11000000) {
-			n = ch & 0b00011111;
-			expect = 1;
-		} else if ((ch & 0b10000000) == 0b10000000) {
-			n <<= 6;
-			n |= ch & 0b00111111;
-		} else {
-			n = ch;
-		}
+		decode_utf8((unsigned char)ch, &n, &expect);
 	}
 
 	return (int)n;
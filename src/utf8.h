@@ -8,6 +8,36 @@
 
 #define BOM_UTF8 0xFEFF
 
+/*
+ * Decode one byte of a character: a lead byte sets how many more are
+ * expected, a continuation byte is shifted in...
+ */
+
+static inline void decode_utf8(unsigned char ch, unsigned *n, int *expect)
+{
+	if ((ch & 0b11111100) == 0b11111100) {
+		*n = ch & 0b00000001;
+		*expect = 5;
+	} else if ((ch & 0b11111000) == 0b11111000) {
+		*n = ch & 0b00000011;
+		*expect = 4;
+	} else if ((ch & 0b11110000) == 0b11110000) {
+		*n = ch & 0b00000111;
+		*expect = 3;
+	} else if ((ch & 0b11100000) == 0b11100000) {
+		*n = ch & 0b00001111;
+		*expect = 2;
+	} else if ((ch & 0b11000000) == 0b11000000) {
+		*n = ch & 0b00011111;
+		*expect = 1;
+	} else if ((ch & 0b10000000) == 0b10000000) {
+		*n <<= 6;
+		*n |= ch & 0b00111111;
+	} else {
+		*n = ch;
+	}
+}
+
 /*
  * This allows supplying a getter function...
  */
@@ -25,6 +55,7 @@ extern size_t strlen_utf8(const char *s);						// returns #chars
 extern size_t substrlen_utf8(const char *s, size_t n);			// returns #chars
 extern const char *strchr_utf8(const char *s, int ch);
 extern const char *strrchr_utf8(const char *s, int ch);
+extern const char *memchr_utf8(const char *s, int ch, size_t n);
 
 /*
  *  These just get/put a memory buffer...
@@ -0,0 +1,23 @@
+:- initialization(main).
+:- dynamic(g/2).
+
+% Per-argument (JIT) indexes: lookups on the second argument, clauses
+% with a variable in the indexed position, and asserta/retract while
+% a call on the same key is still open.
+
+setup :-
+    between(1, 40, I),
+        ( I mod 7 =:= 0 -> assertz(g(_, I)) ; J is I mod 3, assertz(g(J, I)) ),
+        fail.
+setup.
+
+main :-
+    setup,
+    findall(I, g(1, I), L1), write(L1), nl,
+    findall(X, g(X, 20), L2), write(L2), nl,
+    findall(X, g(X, 14), L3), length(L3, N3), write(N3), nl,
+    findall(I, (g(2, I), I < 10, asserta(g(2, 100))), L4), write(L4), nl,
+    retractall(g(2, 100)),
+    findall(I, g(2, I), L5), write(L5), nl,
+    findall(I, g(foo, I), L6), write(L6), nl,
+    halt.
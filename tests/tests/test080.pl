@@ -0,0 +1,25 @@
+:- initialization(main).
+:- use_module(library(lists)).
+
+% Heap garbage collection: a deterministic loop that builds enough
+% garbage to trigger collections, while keeping an accumulator and
+% a choice point with bindings alive across them.
+
+loop(0, Acc, Acc) :- !.
+loop(N, Acc0, Acc) :-
+    length(L, 100), copy_term(f(L, N), f(_, M)),
+    ( N mod 1000 =:= 0 -> Acc1 = [g(M, [N])|Acc0] ; Acc1 = Acc0 ),
+    N1 is N - 1,
+    loop(N1, Acc1, Acc).
+
+main :-
+    X = h([1,2,3], "str", 1.5),
+    member(Y, [p(X), q(X)]),
+    loop(10000, [], Acc),
+    length(Acc, Len), write(Len), nl,
+    Acc = [First|_], write(First), nl,
+    last(Acc, Last), write(Last), nl,
+    write(Y), nl,
+    Y = q(_), !,
+    statistics(gctime, T), ( float(T) -> write(ok) ; write(T) ), nl,
+    halt.
@@ -0,0 +1,31 @@
+:- initialization(main).
+:- use_module(library(lists)).
+
+% Last-call optimization: deterministic recursion reuses the caller's
+% frame, including under findall, catch, cut and open choice points.
+
+cnt(0, A, A) :- !.
+cnt(N, A0, A) :- A1 is A0+N, N1 is N-1, cnt(N1, A1, A).
+
+len([], N, N).
+len([_|T], N0, N) :- N1 is N0+1, len(T, N1, N).
+
+alt(0, X) :- !, X = end.
+alt(N, X) :- N1 is N-1, alt2(N1, X).
+alt2(N, X) :- alt(N, X).
+
+out(0, R) :- !, R = [].
+out(N, R) :- helper(N, H), N1 is N-1, R = [H|T], out(N1, T).
+helper(N, f(N)).
+
+t1 :- findall(X-S, (member(X,[1,2,3]), cnt(1000, X, S)), L), write(L), nl.
+t2 :- findall(X, between(1, 5000, X), L), len(L, 0, N), write(N), nl.
+t3 :- alt(100000, X), write(X), nl.
+t4 :- out(3, R), write(R), nl.
+t5 :- catch((cnt(1000, 0, S), throw(x(S))), x(V), (write(caught(V)), nl)).
+t6 :- between(1, 3, I), cnt(10, I, S), write(I-S), nl, I >= 3, !.
+t7 :- cnt(1000000, 0, S), write(S), nl.
+
+main :-
+    t1, t2, t3, t4, t5, t6, t7,
+    halt.
@@ -0,0 +1,27 @@
+:- initialization(main).
+
+% Stacks grown by a deep recursion are given back once the query
+% has backtracked out of it and kept running for a while. Each
+% statistic is [Size, Peak].
+
+deep(0) :- !.
+deep(N) :- N1 is N-1, deep(N1), true.
+spin(0) :- !.
+spin(N) :- N1 is N-1, spin(N1).
+
+check(Name, [Size0, _], [Size, Peak]) :-
+    ( Peak > Size0, Size =:= Size0 -> write(Name-trimmed) ; write(Name-[Size0, Size, Peak]) ), nl.
+
+main :-
+    statistics(frames, F0),
+    statistics(slots, S0),
+    statistics(trails, T0),
+    statistics(choices, C0),
+    F0 = [Init, _],
+    ( deep(300000), statistics(frames, [F1, _]), ( F1 > Init -> write(grown) ; write(F1) ), nl, fail ; true ),
+    ( between(1, 5, _), spin(500000), fail ; true ),
+    statistics(frames, F2), check(frames, F0, F2),
+    statistics(slots, S), check(slots, S0, S),
+    statistics(trails, T), check(trails, T0, T),
+    statistics(choices, C), ( C == C0 -> write(choices-unchanged) ; write(choices-C) ), nl,
+    halt.
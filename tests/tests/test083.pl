@@ -0,0 +1,35 @@
+:- initialization(main).
+
+% Native sort/2, msort/2, keysort/2 and sort/4, plus predsort/3.
+
+rev(O, A, B) :- compare(O, B, A).
+
+pairs(0, []) :- !.
+pairs(N, [K-f(_)|T]) :- K is N mod 7, N1 is N-1, pairs(N1, T).
+
+bind([]).
+bind([K-f(K)|T]) :- bind(T).
+
+bound([]).
+bound([K-f(V)|T]) :- V == K, bound(T).
+
+main :-
+    sort([c,a,b,a,f(x),1,2.0,f(x)], L1), write(L1), nl,
+    msort([c,a,b,a,1], L2), write(L2), nl,
+    keysort([b-1,a-2,b-0,a-1], L3), write(L3), nl,
+    sort(0, @>=, [1,3,2,3], L4), write(L4), nl,
+    sort(1, @<, [f(2,a),f(1,b),f(2,c)], L5), write(L5), nl,
+    sort(2, @>=, [f(2,a),f(1,b),f(2,a)], L6), write(L6), nl,
+    predsort(rev, [3,1,2,1], L7), write(L7), nl,
+    sort([g(Z)], [g(W)]), Z = 1, write(W), nl,
+    catch(sort([a|_], _), E2, (write(E2), nl)),
+    catch(sort(foo, _), E3, (write(E3), nl)),
+    catch(keysort([a], _), E4, (write(E4), nl)),
+    catch(sort([b,a], foo), E5, (write(E5), nl)),
+    catch(sort(0, foo, [], _), E6, (write(E6), nl)),
+    ( sort([b,a], [a]) -> write(yes) ; write(no) ), nl,
+    findall(X0, (between(1, 300000, I0), X0 is 300000-I0), RL), sort(RL, SL), length(SL, Len), write(Len), nl,
+    findall(K-V, (between(1, 100000, V), K is V mod 7), Ps), keysort(Ps, [P1,P2|_]), write(P1/P2), nl,
+    pairs(40000, NG), keysort(NG, SNG), length(SNG, Len2), write(Len2), nl,
+    bind(SNG), ( bound(NG) -> write(shared) ; write(not_shared) ), nl,
+    halt.
@@ -0,0 +1,21 @@
+:- initialization(main).
+:- use_module(library(lists)).
+
+% Structural term_hash/2 and term_hash/4.
+
+main :-
+    term_hash(foo(bar, [1,2.5,"ab"]), H1), write(H1), nl,
+    atom_concat(fo, o, A), term_hash(A, H2), term_hash(foo, H3), (H2 == H3 -> write(same_atom) ; write(diff_atom)), nl,
+    term_hash("ab", H4), term_hash([a,b], H5), (H4 == H5 -> write(same_str) ; write(diff_str)), nl,
+    ( term_hash(f(_), H6), var(H6) -> write(unbound) ; write(bound) ), nl,
+    term_hash(f(_, a), 1, 1000, H7), write(H7), nl,
+    ( term_hash(f(x, _), 2, 1000, H8), var(H8) -> write(unbound) ; write(bound) ), nl,
+    term_hash(f(x, _), 1, 1000, H12), write(H12), nl,
+    term_hash(1, H9), term_hash(1.0, H10), (H9 == H10 -> write(same_num) ; write(diff_num)), nl,
+    findall(X, between(1, 200000, X), L), term_hash(L, H11), integer(H11), write(ok), nl,
+    findall(X, (between(1, 20000, I), (I == 20000 -> X = x ; X = I)), L2),
+    findall(X, (between(1, 20000, I), (I == 20000 -> X = y ; X = I)), L4),
+    term_hash(L2, H13), term_hash(L4, H14), (H13 == H14 -> write(same_long) ; write(diff_long)), nl,
+    findall(X, between(1, 20000, X), L3), append(L3, [_], L5), ( term_hash(L5, H15), var(H15) -> write(unbound) ; write(bound) ), nl,
+    C = [a|C], ( term_hash(C, H16), var(H16) -> write(unbound) ; write(bound) ), nl,
+    halt.
@@ -0,0 +1,17 @@
+:- initialization(main).
+
+% Interning many atoms through the hashed symbol table.
+
+mk(I, T) :- number_codes(I, Cs), atom_codes(A, [0'x|Cs]), functor(T, A, 1).
+
+main :-
+    statistics(atoms, N0),
+    ( between(1, 20000, I), mk(I, _), fail ; true ),
+    statistics(atoms, N1),
+    ( N1 - N0 >= 19000 -> write(grown) ; write(N0-N1) ), nl,
+    mk(123, T1), mk(123, T2), functor(T1, F1, _), functor(T2, F2, _),
+    ( F1 == F2 -> write(same) ; write(different) ), nl,
+    ( T1 = x123(_) -> write(yes) ; write(no) ), nl,
+    statistics(symtab, [Used, Size]),
+    ( Used < Size -> write(ok) ; write(full) ), nl,
+    halt.
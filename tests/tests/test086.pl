@@ -0,0 +1,47 @@
+:- initialization(main).
+:- dynamic(keep/2).
+
+% Atom GC: atoms only used by dead terms are reclaimed, live ones stay.
+
+mk(P, I, A) :-
+    number_codes(I, Cs), atom_codes(N, Cs), atom_concat(P, N, A0),
+    functor(T, A0, 1), functor(T, A, _).
+
+gen(P, N) :- between(1, N, I), mk(P, I, _), fail.
+gen(_, _).
+
+keep_some(N) :-
+    between(1, N, I), mk(a_rather_long_temporary_atom_name_, I, A),
+    ( I mod 1000 =:= 0 -> assertz(keep(I, A)) ; true ),
+    fail.
+keep_some(_).
+
+check :-
+    keep(I, A), I > 0, mk(a_rather_long_temporary_atom_name_, I, B), A \== B, !,
+    write(bad(I)), nl.
+check :-
+    write(ok), nl.
+
+send_one(Q) :- mk(queued_, 1, A), thread_send_message(Q, msg(A)), fail.
+send_one(_).
+
+main :-
+    message_queue_create(Q), send_one(Q),
+    gen(tmp_, 10000),
+    mk(held_, 42, H), assertz(keep(0, H)),
+    findall(X, (between(1, 100, I), mk(list_, I, X)), L),
+    statistics(atoms, N1),
+    garbage_collect_atoms,
+    statistics(atoms, N2),
+    ( N1 - N2 >= 9000 -> write(reclaimed) ; write(N1-N2) ), nl,
+    keep(0, K), write(K), nl,
+    L = [X1|_], write(X1), nl,
+    gen(new_, 10000),
+    mk(list_, 7, X7), ( memberchk(X7, L) -> write(found) ; write(lost) ), nl,
+    keep_some(60000),
+    statistics(atom_gc, [C, _]),
+    ( C > 1 -> write(collected) ; write(C) ), nl,
+    check,
+    findall(I, keep(I, _), Is), length(Is, Len), write(Len), nl,
+    thread_get_message(Q, msg(M)), write(M), nl,
+    halt.
@@ -0,0 +1,35 @@
+:- initialization(main).
+:- dynamic(counter/1).
+
+counter(0).
+
+bump(N) :-
+	between(1, N, _),
+	retract(counter(C)),
+	C1 is C + 1,
+	assertz(counter(C1)),
+	fail.
+bump(_).
+
+main :-
+	thread_create(bump(100), T1, []),
+	thread_join(T1, S1),
+	writeq(S1), nl,
+	counter(C), writeq(C), nl,
+	thread_create(throw(oops), T2),
+	thread_join(T2, S2),
+	writeq(S2), nl,
+	thread_create(fail, T3),
+	thread_join(T3, S3),
+	writeq(S3), nl,
+	thread_create((thread_self(Me), Me == worker), _, [alias(worker)]),
+	thread_join(worker, S4),
+	writeq(S4), nl,
+	thread_self(Main),
+	writeq(Main), nl,
+	catch(thread_join(T3, _), E, true),
+	writeq(E), nl,
+	thread_create(fail, T5),
+	catch(thread_join(T5), error(Err, _), true),
+	writeq(Err), nl,
+	halt.
@@ -0,0 +1,38 @@
+:- initialization(main).
+:- use_module(library(lists)).
+
+sleeper(T) :-
+	Ms is (5 - T) * 30,
+	delay(Ms),
+	send(T).
+
+ticker(T, Ms) :-
+	between(1, 3, _),
+	delay(Ms),
+	send(T),
+	fail.
+ticker(_, _).
+
+forked :-
+	between(1, 4, I),
+	fork,
+	sleeper(I).
+forked :-
+	wait.
+
+main :-
+	forked,
+	findall(X, (between(1, 4, _), recv(X)), L),
+	writeq(L), nl,
+	(	member(T-Ms, [1-20, 2-50]),
+		fork,
+		ticker(T, Ms)
+	;	true
+	), !,
+	findall(M, (await, recv(M)), Msgs),
+	writeq(Msgs), nl,
+	statistics(tasks, [Slices, Busy, Idle]),
+	(Slices > 0 -> writeq(ran) ; writeq(Slices)), nl,
+	(Idle >= 150 -> writeq(slept) ; writeq(Idle)), nl,
+	(Busy >= 0 -> writeq(ok) ; true), nl,
+	halt.
@@ -0,0 +1,33 @@
+:- initialization(main).
+:- use_module(library(lists)).
+
+producer(Q, From, N) :-
+	between(1, N, I),
+	thread_send_message(Q, msg(From, I)),
+	fail.
+producer(_, _, _).
+
+main :-
+	thread_send_message(main, hello(1)),
+	thread_send_message(main, other),
+	thread_send_message(main, hello(2)),
+	thread_get_message(hello(X)), writeq(X), nl,
+	thread_get_message(main, Y), writeq(Y), nl,
+	thread_get_message(main, hello(Z), [timeout(0)]), writeq(Z), nl,
+	(thread_get_message(main, _, [timeout(0.05)]) -> writeq(unexpected) ; writeq(timeout)), nl,
+	message_queue_create(Q),
+	message_queue_create(JQ, [alias(jobs)]), writeq(JQ), nl,
+	findall(T, (between(1, 4, P), thread_create(producer(Q, P, 500), T)), Ts),
+	findall(x, (between(1, 2000, _), thread_get_message(Q, msg(_, _))), L), length(L, Len), writeq(Len), nl,
+	forall(member(T, Ts), thread_join(T)),
+	thread_send_message(jobs, job(21)),
+	thread_create((thread_get_message(jobs, job(J)), J2 is J * 2, thread_send_message(main, done(J2))), W),
+	thread_get_message(done(R)), writeq(R), nl,
+	thread_join(W),
+	thread_create((thread_self(Me), thread_send_message(main, pong(Me))), W2, [alias(pinger)]),
+	thread_get_message(pong(P2)), writeq(P2), nl,
+	thread_join(W2),
+	message_queue_destroy(Q),
+	catch(thread_send_message(Q, x), E, true), writeq(E), nl,
+	message_queue_destroy(jobs),
+	halt.
@@ -0,0 +1,28 @@
+:- initialization(main).
+:- use_module(library(lists)).
+
+sq(X, Y) :- Y is X * X.
+add(X, Y, Z) :- Z is X + Y.
+pos(X) :- X > 0.
+chk(X) :- X > 5 -> throw(big(X)) ; true.
+item(a, 1). item(a, 2). item(b, 3). item(c, 4). item(c, 5).
+
+slow(X) :- between(1, 100000, _), fail ; X = slow.
+
+main :-
+	L = [1,2,3,4,5,6,7,8,9,10],
+	concurrent_maplist(sq, L, L2),
+	writeq(L2), nl,
+	concurrent_maplist(add, L, L2, L3),
+	writeq(L3), nl,
+	(concurrent_maplist(pos, L) -> writeq(yes) ; writeq(no)), nl,
+	(concurrent_maplist(pos, [1,0,2]) -> writeq(yes) ; writeq(no)), nl,
+	concurrent_maplist(=, Vs, [x,y,z]),
+	writeq(Vs), nl,
+	concurrent_findall(K-V, member(K, [c,a,b]), item(K, V), Bag),
+	writeq(Bag), nl,
+	catch(concurrent_maplist(chk, L), E, writeq(E)), nl,
+	first_solution(X, [fail, slow(X), X = quick], []),
+	(X == slow ; X == quick), writeq(ok), nl,
+	(first_solution(_, [fail, fail], []) -> writeq(yes) ; writeq(no)), nl,
+	halt.
@@ -0,0 +1,22 @@
+:- initialization(main).
+:- use_module(library(lists)).
+:- dynamic(c/1).
+:- dynamic(p/1).
+:- dynamic(t/1).
+
+inc :- retract(c(N)) -> N1 is N + 1, assertz(c(N1)) ; inc.
+
+worker(K) :- between(1, K, _), inc, fail.
+worker(_).
+
+main :-
+	assertz(c(0)),
+	findall(Id, (between(1, 4, _), thread_create(worker(500), Id, [])), Ids),
+	forall(member(Id, Ids), thread_join(Id, _)),
+	c(N), writeq(N), nl,
+	assertz(p(1)), assertz(p(2)), assertz(p(3)),
+	forall(p(X), (retract(p(X)), Y is X * 10, assertz(p(Y)))),
+	findall(X, p(X), L), writeq(L), nl,
+	between(1, 1000, I), assertz(t(I)), retract(t(I)), I >= 1000, !,
+	findall(X, p(X), L2), findall(X, t(X), L3), writeq(L2-L3), nl,
+	halt.
@@ -0,0 +1,29 @@
+:- initialization(main).
+:- use_module(library(lists)).
+
+count(K) :- nb_getval(K, N), N1 is N + 1, nb_setval(K, N1).
+
+main :-
+	nb_setval(hits, 0),
+	forall(between(1, 1000, _), count(hits)),
+	nb_getval(hits, H), writeq(H), nl,
+	nb_setval(cache, f(X, [a,b|T], X, "str")),
+	nb_getval(cache, C), numbervars(C, 0, _), writeq(C), nl,
+	(nb_getval(cache, f(1, _, Y, _)) -> writeq(Y) ; writeq(no)), nl,
+	b_setval(v, 1),
+	(member(I, [2,3,4]), b_setval(v, I), I >= 3, b_getval(v, V1) -> writeq(V1) ; true), nl,
+	b_getval(v, V2), writeq(V2), nl,
+	(b_setval(w, 10), fail ; true),
+	(nb_current(w, W) -> writeq(W) ; writeq(none)), nl,
+	b_setval(v, 5),
+	(between(1, 3, J), b_setval(v, J), fail ; true),
+	b_getval(v, V3), writeq(V3), nl,
+	findall(K, (nb_current(K, _), memberchk(K, [hits,cache,v])), Ks),
+	msort(Ks, SKs), writeq(SKs), nl,
+	nb_delete(cache),
+	catch(nb_getval(cache, _), E, (writeq(E), nl)),
+	thread_create((nb_setval(hits, -1), nb_getval(hits, TH), thread_send_message(main, TH)), Id, []),
+	thread_join(Id, _),
+	thread_get_message(TM), writeq(TM), nl,
+	nb_getval(hits, H2), writeq(H2), nl,
+	halt.
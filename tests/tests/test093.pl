@@ -0,0 +1,41 @@
+:- initialization(main).
+:- use_module(library(lists)).
+
+nat(N) :- nat(0, N).
+nat(N, N).
+nat(N0, N) :- N1 is N0 + 1, nat(N1, N).
+
+take(0, _, []) :- !.
+take(N, E, [X|Xs]) :- engine_next(E, X), N1 is N - 1, take(N1, E, Xs).
+
+sum(S) :- engine_fetch(X), S1 is S + X, engine_yield(S1), sum(S1).
+
+main :-
+	engine_create(X, nat(X), E),
+	take(5, E, L), writeq(L), nl,
+	engine_next(E, Y), writeq(Y), nl,
+	engine_destroy(E),
+	engine_create(X-Y2, member(X-Y2, [a-1, b-2]), E2),
+	findall(A, (between(1, 3, _), engine_next_reified(E2, A)), As),
+	writeq(As), nl,
+	engine_destroy(E2),
+	engine_create(_, sum(0), E3, [alias(acc)]),
+	engine_post(acc, 10, R1), engine_post(E3, 5, R2), writeq(R1/R2), nl,
+	engine_destroy(acc),
+	engine_create(x, (engine_yield(first), throw(oops)), E4),
+	engine_next(E4, F), writeq(F), nl,
+	catch(engine_next(E4, _), Err, (writeq(caught(Err)), nl)),
+	(engine_next(E4, _) -> writeq(more) ; writeq(done)), nl,
+	engine_destroy(E4),
+	engine_create(S, engine_self(S), E5),
+	engine_next(E5, S5), (S5 == E5 -> writeq(self) ; writeq(S5)), nl,
+	engine_destroy(E5),
+	catch(engine_next(E5, _), error(Ex, _), (writeq(Ex), nl)),
+	engine_create(X6, (engine_fetch(B), engine_next(B, X6)), E6, [alias(a)]),
+	engine_create(X7, engine_next(a, X7), E7, [alias(b)]),
+	catch(engine_post(E6, E7, _), error(Ex6, _), (writeq(Ex6), nl)),
+	engine_destroy(E6), engine_destroy(E7),
+	engine_create(_, (engine_self(S8), engine_destroy(S8)), E8),
+	catch(engine_next(E8, _), error(Ex8, _), (writeq(Ex8), nl)),
+	engine_destroy(E8),
+	halt.
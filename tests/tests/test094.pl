@@ -0,0 +1,38 @@
+:- initialization(main).
+:- use_module(library(lists)).
+
+handler(S) :-
+	accept(S, C),
+	getline(C, L),
+	close(C),
+	send(L).
+
+talk(P, I) :-
+	atomic_list_concat([localhost, ':', P], U),
+	client(U, _, _, S, []),
+	Ms is (4 - I) * 50,
+	delay(Ms),
+	write(S, hello(I)), nl(S),
+	flush_output(S),
+	close(S).
+
+tasks(S, _, N) :-
+	between(1, N, _),
+	fork,
+	handler(S).
+tasks(_, P, N) :-
+	between(1, N, I),
+	fork,
+	talk(P, I).
+tasks(_, _, _) :-
+	wait.
+
+main :-
+	server(':0', S, []),
+	stream_property(S, port(P)),
+	tasks(S, P, 3),
+	findall(X, (between(1, 3, _), recv(X)), L),
+	writeq(L), nl,
+	statistics(tasks, [Slices, _, _]),
+	(Slices < 50 -> writeq(parked) ; writeq(Slices)), nl,
+	halt.
@@ -0,0 +1 @@
+$TPL -q --workers 3 -g "write(ok), nl, halt"
@@ -0,0 +1,39 @@
+:- initialization(main).
+:- use_module(library(lists)).
+
+loop :- repeat, fail.
+
+l :- l.
+
+nap(A) :- (A == 1 -> alarm(0.05, throw(woken), _) ; true), delay(200).
+
+main :-
+	catch(call_with_time_limit(0.1, loop), E1, true),
+	writeq(E1), nl,
+	catch(call_with_time_limit(0.1, sleep(5)), E2, true),
+	writeq(E2), nl,
+	catch(call_with_time_limit(0.1, call_with_time_limit(5, loop)), E3, true),
+	writeq(E3), nl,
+	catch(call_with_time_limit(0.1, l), E4, true),
+	writeq(E4), nl,
+	call_with_time_limit(5, X = done),
+	writeq(X), nl,
+	alarm(0.05, (write(fired), nl), _),
+	delay(200),
+	alarm(0.05, (write(never), nl), Id),
+	remove_alarm(Id),
+	remove_alarm(Id),
+	delay(100),
+	alarm(0.1, (write(b), nl), _),
+	alarm(0.05, (write(a), nl), _),
+	alarm(0.15, throw(c), _),
+	catch(loop, C, true),
+	writeq(C), nl,
+	catch(nap(1), W, true),
+	writeq(W), nl,
+	get_time(T0), nap(0), get_time(T1),
+	(T1 - T0 >= 0.19 -> writeq(slept) ; writeq(T1-T0)), nl,
+	findall(Id2, (between(1, 5000, I), T is 10 + I mod 97, alarm(T, true, Id2)), Ids),
+	forall(member(Id2, Ids), remove_alarm(Id2)),
+	writeq(removed), nl,
+	halt.
@@ -0,0 +1,34 @@
+:- initialization(main).
+:- use_module(library(lists)).
+
+% Reads this file back: ünïcödé → λ 😀
+
+chars(S, Cs) :-
+	get_char(S, C),
+	(C == end_of_file -> Cs = [] ; Cs = [C|Cs1], chars(S, Cs1)).
+
+bytes(S, N0, N) :-
+	get_byte(S, B),
+	(B == -1 -> N = N0 ; N1 is N0 + 1, bytes(S, N1, N)).
+
+main :-
+	F = 'tests/tests/test097.pl',
+	open(F, read, S1),
+	chars(S1, Cs),
+	close(S1),
+	length(Cs, NC),
+	findall(C, (member(C, Cs), char_code(C, X), X > 127), Wide),
+	writeq(Wide), nl,
+	open(F, read, S2, [type(binary)]),
+	bytes(S2, 0, NB),
+	close(S2),
+	Extra is NB - NC,
+	writeq(Extra), nl,
+	open(F, read, S3),
+	peek_char(S3, P1),
+	get_char(S3, G1),
+	peek_code(S3, P2),
+	get_code(S3, G2),
+	writeq([P1,G1,P2,G2]), nl,
+	close(S3),
+	halt.
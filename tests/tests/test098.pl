@@ -0,0 +1,25 @@
+:- initialization(main).
+:- use_module(library(dcgs)).
+
+lines([L|Ls]) --> line(L), !, lines(Ls).
+lines([]) --> [].
+
+line([C|Cs]) --> [C], {C \== '\n'}, !, line(Cs).
+line([]) --> ['\n'].
+
+main :-
+	phrase_from_file(lines(Ls), 'tests/tests/test098.pl'),
+	length(Ls, N), write(N), nl,
+	Ls = [L1|_], atom_chars(A1, L1), write(A1), nl,
+	loadfile('tests/tests/test098.pl', S, [mmap(true)]),
+	split(S, '\n', First, Rest),
+	atom_chars(A2, First), write(A2), nl,
+	length(First, N1), write(N1), nl,
+	split_atom(First, '(', '', Parts), writeq(Parts), nl,
+	split(Rest, '(', Before, After),
+	atom_chars(A3, Before), write(A3), nl,
+	sub_atom(After, 0, 7, _, Sub), write(Sub), nl,
+	loadfile('tests/tests/test098.pl', S2),
+	(S == S2 -> write(same) ; write(different)), nl,
+	split("a→b", "→", L, R), write(L-R), nl,
+	halt.
@@ -0,0 +1,46 @@
+#!/bin/sh
+
+DIR=$(mktemp -d)
+trap "rm -rf $DIR" EXIT
+
+seq 1 3000 >$DIR/data.txt
+mkfifo $DIR/pipe
+
+cat >$DIR/test.pl <<'END'
+:- use_module(library(dcgs)).
+
+count(N0, N) --> "\n", !, {N1 is N0+1}, count(N1, N).
+count(N0, N) --> [_], !, count(N0, N).
+count(N, N) --> [].
+
+seq([]) --> [].
+seq([C|Cs]) --> [C], seq(Cs).
+
+main(F) :-
+	phrase_from_file(count(0, N), F),
+	write(N), nl,
+	phrase_from_file((seq(_), "\n2999\n", seq(Rest)), F),
+	atom_chars(A, Rest), write(A),
+	( phrase_from_file((seq(_), "3001\n", seq(_)), F) -> write(found) ; write(not_found) ), nl.
+
+main_pipe(F) :-
+	phrase_from_file(count(0, N), F),
+	write(N), nl.
+
+lines([L|Ls]) --> seq(L), "\n", !, lines(Ls).
+lines([]) --> [].
+
+lines_pipe(F) :-
+	phrase_from_file(lines(Ls), F),
+	Ls = [L1|_], last(Ls, L2), length(Ls, N),
+	atom_chars(A1, L1), atom_chars(A2, L2),
+	write([A1, A2, N]), nl.
+END
+
+$TPL -q $DIR/test.pl -g "main('$DIR/data.txt'), halt"
+cat $DIR/data.txt >$DIR/pipe &
+$TPL -q $DIR/test.pl -g "main_pipe('$DIR/pipe'), halt"
+wait
+cat $DIR/data.txt >$DIR/pipe &
+$TPL -q $DIR/test.pl -g "lines_pipe('$DIR/pipe'), halt"
+wait
@@ -0,0 +1,10 @@
+:- initialization(main).
+
+main :-
+	findall(I, between(1, 20000, I), L),
+	write_term_to_chars(L, [], Cs), length(Cs, N), write(N), nl,
+	open('/dev/null', write, S), write(S, L), close(S),
+	T = g(A, B, A, 'a b', "s", [1,2|B]),
+	writeq(T), nl,
+	write_canonical(T), nl,
+	write_term(h('$VAR'(1), 'X'), [numbervars(true), quoted(true)]), nl.
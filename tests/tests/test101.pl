@@ -0,0 +1,25 @@
+:- initialization(main).
+
+reader(C) :-
+	catch(getline(C, L), E, true),
+	( nonvar(E) -> send(closed) ; send(got(L)) ).
+
+closer(C) :-
+	delay(100),
+	close(C).
+
+tasks(C) :- fork, reader(C).
+tasks(C) :- fork, closer(C).
+tasks(_) :- wait.
+
+main :-
+	server(':0', S, []),
+	stream_property(S, port(P)),
+	atomic_list_concat([localhost, ':', P], U),
+	client(U, _, _, Cl, []),
+	accept(S, C),
+	tasks(C),
+	recv(X),
+	writeq(X), nl,
+	close(Cl),
+	halt.
@@ -0,0 +1,45 @@
+#!/bin/sh
+
+DIR=$(mktemp -d)
+trap "rm -rf $DIR" EXIT
+
+# The engine is part way through p(a,_) when the first query ends and
+# the clauses it retracted are dropped from the argument index.
+
+cat >$DIR/test.pl <<'END'
+:- initialization(main).
+:- dynamic(p/2).
+
+fill :-
+	between(1, 20, I),
+	assertz(p(a, I)),
+	assertz(p(b, I)),
+	fail.
+fill.
+
+next_all(E, [X|Xs]) :-
+	engine_next(E, X), !,
+	next_all(E, Xs).
+next_all(_, []).
+
+main :-
+	fill,
+	p(a, 1),
+	retract(p(a, 2)),
+	retract(p(a, 10)),
+	engine_create(X, p(a, X), _, [alias(it)]),
+	engine_next(it, X1),
+	engine_next(it, X2),
+	engine_next(it, X3),
+	writeq([X1,X2,X3]), nl.
+
+rest :-
+	retract(p(a, 15)),
+	next_all(it, L1),
+	writeq(L1), nl,
+	engine_destroy(it),
+	findall(X, p(a, X), L2),
+	writeq(L2), nl.
+END
+
+$TPL -q $DIR/test.pl -g "rest, halt"
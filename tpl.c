@@ -141,6 +141,132 @@ static int daemonize(int argc, char *argv[])
 #endif
 }
 
+#ifndef _WIN32
+static pid_t spawn_worker(const sigset_t *mask)
+{
+	fflush(stdout);
+	fflush(stderr);
+	pid_t pid = fork();
+
+	if (pid == 0) {
+		signal(SIGINT, &sigfn);
+		signal(SIGTERM, SIG_DFL);
+		sigprocmask(SIG_SETMASK, mask, NULL);
+	}
+
+	return pid;
+}
+
+// Fork the workers, which share the consulted program copy-on-write,
+// and supervise them. A worker that is killed or exits with a non-zero
+// code is restarted, a second later if it died straight away. Returns
+// 1 in a worker, 0 in the parent once all the workers have finished.
+//
+// SIGINT, SIGTERM and SIGCHLD stay blocked in the parent and are taken
+// with sigtimedwait(), so a signal arriving while reaping or restarting
+// is never missed.
+
+static int workers(unsigned nbr)
+{
+	pid_t *pids = calloc(nbr, sizeof(pid_t));
+	time_t *started = calloc(nbr, sizeof(time_t));
+	time_t *restart = calloc(nbr, sizeof(time_t));
+
+	if (!pids || !started || !restart) {
+		free(pids);
+		free(started);
+		free(restart);
+		return -1;
+	}
+
+	sigset_t set, old;
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &set, &old);
+	unsigned running = 0, pending = 0;
+	bool stopping = false;
+	int ok = 0;
+
+	for (unsigned i = 0; i < nbr; i++)
+		restart[i] = 1;
+
+	pending = nbr;
+
+	while (running || pending) {
+		int status;
+		pid_t pid;
+
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			unsigned i = 0;
+
+			while ((i < nbr) && (pids[i] != pid))
+				i++;
+
+			if (i == nbr)
+				continue;
+
+			pids[i] = 0;
+			running--;
+
+			if (stopping || (WIFEXITED(status) && !WEXITSTATUS(status)))
+				continue;
+
+			time_t now = time(NULL);
+			restart[i] = (now - started[i]) < 1 ? now + 1 : now;
+			pending++;
+		}
+
+		time_t now = time(NULL);
+
+		for (unsigned i = 0; !stopping && (i < nbr); i++) {
+			if (!restart[i] || (restart[i] > now))
+				continue;
+
+			restart[i] = 0;
+			pending--;
+
+			if ((pids[i] = spawn_worker(&old)) == 0) {
+				ok = 1;
+				goto done;
+			}
+
+			if (pids[i] < 0) {
+				fprintf(stderr, "Error: can't fork worker: %s\n", strerror(errno));
+				pids[i] = 0;
+			} else {
+				started[i] = now;
+				running++;
+			}
+		}
+
+		if (!running && !pending)
+			break;
+
+		struct timespec ts = {1, 0};
+		int sig = sigtimedwait(&set, NULL, pending ? &ts : NULL);
+
+		if (((sig == SIGINT) || (sig == SIGTERM)) && !stopping) {
+			for (unsigned i = 0; i < nbr; i++) {
+				if (pids[i] > 0)
+					kill(pids[i], SIGTERM);
+			}
+
+			stopping = true;
+			pending = 0;
+		}
+	}
+
+done:
+	sigprocmask(SIG_SETMASK, &old, NULL);
+	free(pids);
+	free(started);
+	free(restart);
+	return ok;
+}
+#endif
+
 int main(int ac, char *av[])
 {
 	setlocale(LC_ALL, ".UTF8");
@@ -164,6 +290,7 @@ int main(int ac, char *av[])
 	int i, do_goal = 0, do_lib = 0;
 	int version = 0, quiet = 0, daemon = 0;
 	int ns = 0;
+	unsigned nbr_workers = 0;
 	void *pl = pl_create();
 	if (!pl)
 	{
@@ -200,6 +327,8 @@ int main(int ac, char *av[])
 			ns = 1;
 		else if (!strcmp(av[i], "-d") || !strcmp(av[i], "--daemon"))
 			daemon = 1;
+		else if (!strcmp(av[i], "--workers") && ((i + 1) < ac))
+			nbr_workers = strtoul(av[++i], NULL, 10);
 	}
 
 	if (daemon) {
@@ -240,6 +369,8 @@ int main(int ac, char *av[])
 		} else if (!strcmp(av[i], "-g") || !strcmp(av[i], "--query-goal")) {
 			do_lib = 0;
 			do_goal = 1;
+		} else if (!strcmp(av[i], "--workers")) {
+			i++;
 		} else if (av[i][0] == '-') {
 			continue;
 		} else if (do_lib) {
@@ -258,6 +389,26 @@ int main(int ac, char *av[])
 		}
 	}
 
+	if (nbr_workers) {
+#ifdef _WIN32
+		fprintf(stderr, "Error: workers not supported\n");
+		pl_destroy(pl);
+		return 1;
+#else
+		if (!goal) {
+			fprintf(stderr, "Error: workers need a goal\n");
+			pl_destroy(pl);
+			return 1;
+		}
+
+		int ok = workers(nbr_workers);
+
+		if (ok <= 0) {
+			pl_destroy(pl);
+			return ok ? 1 : 0;
+		}
+#endif
+	}
 
 	if (goal) {
 		if (!pl_eval(pl, goal)) {
@@ -298,6 +449,7 @@ int main(int ac, char *av[])
 		fprintf(stdout, "  -t, --trace\t\t- trace mode\n");
 		fprintf(stdout, "  -d, --daemon\t\t- daemonize\n");
 		fprintf(stdout, "  -w, --watchdog\t- create watchdog\n");
+		fprintf(stdout, "  --workers n\t\t- run goal in n supervised worker processes\n");
 		fprintf(stdout, "  --consult\t\t- consult from STDIN\n");
 		fprintf(stdout, "  --stats\t\t- print stats\n");
 		fprintf(stdout, "  --noindex\t\t- don't use term indexing\n");